@@ -875,6 +875,7 @@ static int autofs_create_fle(struct pstree_item *task, FdinfoEntry *fe,
 	le = (void *)ALIGN((long)le, sizeof(int));
 
 	futex_init(&le->real_pid);
+	le->task_transport = &rst_info->fd_transport;
 	le->pid = task->pid.virt;
 	le->fe = fe;
 
@@ -274,10 +274,26 @@ int bwrite(struct bfd *bfd, const void *buf, int size)
 int bwritev(struct bfd *bfd, const struct iovec *iov, int cnt)
 {
 	int i, written = 0;
+	size_t total = 0;
 
 	if (!bfd_buffered(bfd))
 		return writev(bfd->fd, iov, cnt);
 
+	/*
+	 * Big vectors (batched records) don't fit the buffer anyway,
+	 * so flush what we have and put them into the file at once
+	 * instead of copying and writing them piece by piece.
+	 */
+	for (i = 0; i < cnt; i++)
+		total += iov[i].iov_len;
+
+	if (total > BUFSIZE) {
+		if (bflush(bfd) < 0)
+			return -1;
+
+		return writev(bfd->fd, iov, cnt);
+	}
+
 	for (i = 0; i < cnt; i++) {
 		int ret;
 
@@ -35,6 +35,7 @@
 struct cg_set {
 	u32			id;
 	struct list_head	l;
+	struct hlist_node	hash;
 	unsigned int 		n_ctls;
 	struct list_head	ctls;
 };
@@ -52,6 +53,30 @@ static u32 cg_set_ids = 1;
 static LIST_HEAD(cgroups);
 static unsigned int n_cgroups;
 
+/*
+ * Sets are hashed by their controllers' names and paths, and
+ * cgroup dirs by controller and path, so that tasks and dirs
+ * don't get compared against all of them.
+ */
+#define CG_SET_HASH_SIZE	256
+#define CG_DIR_HASH_SIZE	1024
+
+static struct hlist_head cg_sets_hash[CG_SET_HASH_SIZE];
+static struct hlist_head cg_dirs_hash[CG_DIR_HASH_SIZE];
+
+static inline u32 cg_hash_mem(u32 h, const char *s, size_t len)
+{
+	while (len--)
+		h = h * 31 + *s++;
+
+	return h;
+}
+
+static inline u32 cg_hash_str(u32 h, const char *s)
+{
+	return cg_hash_mem(h, s, strlen(s) + 1);
+}
+
 static CgSetEntry *find_rst_set_by_id(u32 id)
 {
 	int i;
@@ -108,11 +133,29 @@ static bool cg_set_compare(struct cg_set *set, struct list_head *ctls, int what)
 
 static int collect_cgroups(struct list_head *ctls);
 
+/*
+ * The cgns prefix is not hashed, as strays get it fixed up
+ * after their sets are created (see dump_task_cgroup).
+ */
+static struct hlist_head *cg_set_chain(struct list_head *ctls)
+{
+	struct cg_ctl *ctl;
+	u32 h = 0;
+
+	list_for_each_entry(ctl, ctls, l) {
+		h = cg_hash_str(h, ctl->name);
+		h = cg_hash_str(h, ctl->path);
+	}
+
+	return &cg_sets_hash[h % CG_SET_HASH_SIZE];
+}
+
 static struct cg_set *get_cg_set(struct list_head *ctls, unsigned int n_ctls, bool collect)
 {
+	struct hlist_head *chain = cg_set_chain(ctls);
 	struct cg_set *cs;
 
-	list_for_each_entry(cs, &cg_sets, l)
+	hlist_for_each_entry(cs, chain, hash)
 		if (cg_set_compare(cs, ctls, CGCMP_MATCH)) {
 			pr_debug(" `- Existing css %d found\n", cs->id);
 			put_ctls(ctls);
@@ -127,6 +170,7 @@ static struct cg_set *get_cg_set(struct list_head *ctls, unsigned int n_ctls, bo
 		list_splice_init(ctls, &cs->ctls);
 		cs->n_ctls = n_ctls;
 		list_add_tail(&cs->l, &cg_sets);
+		hlist_add_head(&cs->hash, chain);
 		n_sets++;
 
 		if (!pr_quelled(LOG_DEBUG)) {
@@ -138,6 +182,7 @@ static struct cg_set *get_cg_set(struct list_head *ctls, unsigned int n_ctls, bo
 
 		if (collect && collect_cgroups(&cs->ctls)) {
 			list_del(&cs->l);
+			hlist_del(&cs->hash);
 			n_sets--;
 			put_ctls(&cs->ctls);
 			xfree(cs);
@@ -220,24 +265,60 @@ static unsigned int		path_pref_len;
 #define PARENT_MATCH	1
 #define NO_MATCH	2
 
-static int find_dir(const char *path, struct list_head *dirs, struct cgroup_dir **rdir)
+static struct hlist_head *cg_dir_chain(struct cg_controller *controller,
+					const char *path, size_t len)
+{
+	u32 h = (u32)(unsigned long)controller;
+
+	return &cg_dirs_hash[cg_hash_mem(h, path, len) % CG_DIR_HASH_SIZE];
+}
+
+static void cg_dir_hash(struct cgroup_dir *d, struct cg_controller *controller)
+{
+	d->controller = controller;
+	hlist_add_head(&d->hash, cg_dir_chain(controller, d->path, strlen(d->path)));
+}
+
+static struct cgroup_dir *cg_dir_lookup(struct cg_controller *controller,
+					const char *path, size_t len)
 {
 	struct cgroup_dir *d;
-	list_for_each_entry(d, dirs, siblings) {
-		if (strcmp(d->path, path) == 0) {
+
+	hlist_for_each_entry(d, cg_dir_chain(controller, path, len), hash)
+		if (d->controller == controller &&
+		    !strncmp(d->path, path, len) && d->path[len] == '\0')
+			return d;
+
+	return NULL;
+}
+
+/*
+ * Find the dir with the @path or its closest collected ancestor
+ * by looking the path and its parents up in the index.
+ */
+static int find_dir(const char *path, struct cg_controller *controller,
+		    struct cgroup_dir **rdir)
+{
+	size_t len, plen;
+
+	len = plen = strlen(path);
+	while (len > 0) {
+		struct cgroup_dir *d;
+
+		d = cg_dir_lookup(controller, path, len);
+		if (d) {
 			*rdir = d;
-			return EXACT_MATCH;
+			return len == plen ? EXACT_MATCH : PARENT_MATCH;
 		}
 
-		if (strstartswith(path, d->path)) {
-			int ret = find_dir(path, &d->children, rdir);
-			if (ret == NO_MATCH) {
-				*rdir = d;
-				return PARENT_MATCH;
-			}
-			return ret;
+		if (len == 1) /* the "/" */
+			break;
 
-		}
+		/* Cut the last path component off */
+		while (len > 1 && path[len - 1] != '/')
+			len--;
+		if (len > 1)
+			len--;
 	}
 
 	return NO_MATCH;
@@ -261,43 +342,63 @@ static inline char *strip(char *str)
  * Currently this function only supports properties that have a string value
  * under 1024 chars.
  */
-static int read_cgroup_prop(struct cgroup_prop *property, const char *fullpath)
+static void stat_cgroup_prop(struct cgroup_prop *property, const struct stat *sb)
+{
+	property->mode = sb->st_mode;
+	property->uid = sb->st_uid;
+	property->gid = sb->st_gid;
+}
+
+/*
+ * The property is looked up relative to the cgroup's @dirfd, the
+ * @fullpath is for messages only. Returns 1 if there's no such
+ * file in the cgroup.
+ */
+static int read_cgroup_prop(struct cgroup_prop *property, int dirfd, const char *fullpath)
 {
 	char buf[1024];
 	int fd, ret;
 	struct stat sb;
 
-	fd = open(fullpath, O_RDONLY);
-	if (fd == -1) {
-		property->value = NULL;
-		pr_perror("Failed opening %s", fullpath);
-		return -1;
-	}
-
-	if (fstat(fd, &sb) < 0) {
-		pr_perror("failed statting cgroup prop %s", fullpath);
-		close(fd);
-		return -1;
-	}
-
-	property->mode = sb.st_mode;
-	property->uid = sb.st_uid;
-	property->gid = sb.st_gid;
+	property->value = NULL;
 
 	/* skip dumping the value of these, since it doesn't make sense (we
 	 * just want to restore the perms) */
 	if (!strcmp(property->name, "cgroup.procs") || !strcmp(property->name, "tasks")) {
-		ret = 0;
+		if (fstatat(dirfd, property->name, &sb, 0) < 0) {
+			if (errno == ENOENT)
+				return 1;
+			pr_perror("failed statting cgroup prop %s", fullpath);
+			return -1;
+		}
+
+		stat_cgroup_prop(property, &sb);
+
 		/* libprotobuf segfaults if we leave a null pointer in a
 		 * string, so let's not do that */
 		property->value = xstrdup("");
 		if (!property->value)
-			ret = -1;
+			return -1;
+
+		return 0;
+	}
+
+	fd = openat(dirfd, property->name, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 1;
+		pr_perror("Failed opening %s", fullpath);
+		return -1;
+	}
 
+	if (fstat(fd, &sb) < 0) {
+		pr_perror("failed statting cgroup prop %s", fullpath);
 		close(fd);
-		return ret;
+		return -1;
 	}
 
+	stat_cgroup_prop(property, &sb);
+
 	ret = read(fd, buf, sizeof(buf) - 1);
 	if (ret == -1) {
 		pr_err("Failed scanning %s\n", fullpath);
@@ -355,22 +456,74 @@ static void free_all_cgroup_props(struct cgroup_dir *ncd)
 	ncd->n_properties = 0;
 }
 
-static int dump_cg_props_array(const char *fpath, struct cgroup_dir *ncd, const cgp_t *cgp)
+/*
+ * Properties of the controllers being walked. The set of files is
+ * the same in all non-root cgroups of a v1 hierarchy, so once some
+ * property is found missing there, it's not looked for any more.
+ */
+struct cg_walk_props {
+	const cgp_t	*cgp;
+	bool		*missing;
+};
+
+static struct cg_walk_props	*walk_props;
+static unsigned int		n_walk_props;
+
+static void free_walk_props(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_walk_props; i++)
+		xfree(walk_props[i].missing);
+	xfree(walk_props);
+	walk_props = NULL;
+	n_walk_props = 0;
+}
+
+static int prepare_walk_props(struct cg_controller *controller)
 {
-	int j;
-	char buf[PATH_MAX];
-	struct cgroup_prop *prop;
+	unsigned int i;
 
-	for (j = 0; cgp && j < cgp->nr_props; j++) {
-		if (snprintf(buf, PATH_MAX, "%s/%s", fpath, cgp->props[j]) >= PATH_MAX) {
-			pr_err("snprintf output was truncated\n");
+	free_walk_props();
+
+	/* The controllers' own properties go first, then the global ones */
+	walk_props = xzalloc((controller->n_controllers + 1) * sizeof(*walk_props));
+	if (!walk_props)
+		return -1;
+
+	n_walk_props = controller->n_controllers + 1;
+	for (i = 0; i < n_walk_props; i++) {
+		const cgp_t *cgp;
+
+		if (i < controller->n_controllers)
+			cgp = cgp_get_props(controller->controllers[i]);
+		else
+			cgp = &cgp_global;
+
+		walk_props[i].cgp = cgp;
+		if (!cgp || !cgp->nr_props)
+			continue;
+
+		walk_props[i].missing = xzalloc(cgp->nr_props * sizeof(bool));
+		if (!walk_props[i].missing) {
+			free_walk_props();
 			return -1;
 		}
+	}
+
+	return 0;
+}
+
+static int dump_cg_props_array(int dirfd, const char *fpath, const char *path,
+			       struct cgroup_dir *ncd, struct cg_walk_props *wp)
+{
+	const cgp_t *cgp = wp->cgp;
+	int j, ret;
+	struct cgroup_prop *prop;
 
-		if (access(buf, F_OK) < 0 && errno == ENOENT) {
-			pr_info("Couldn't open %s. This cgroup property may not exist on this kernel\n", buf);
+	for (j = 0; cgp && j < cgp->nr_props; j++) {
+		if (wp->missing[j])
 			continue;
-		}
 
 		prop = create_cgroup_prop(cgp->props[j]);
 		if (!prop) {
@@ -378,12 +531,22 @@ static int dump_cg_props_array(const char *fpath, struct cgroup_dir *ncd, const
 			return -1;
 		}
 
-		if (read_cgroup_prop(prop, buf) < 0) {
+		ret = read_cgroup_prop(prop, dirfd, fpath);
+		if (ret < 0) {
 			free_cgroup_prop(prop);
 			free_all_cgroup_props(ncd);
 			return -1;
 		}
 
+		if (ret > 0) {
+			pr_info("Couldn't open %s/%s. This cgroup property may not exist on this kernel\n",
+				fpath, cgp->props[j]);
+			if (strcmp(path, "/"))
+				wp->missing[j] = true;
+			free_cgroup_prop(prop);
+			continue;
+		}
+
 		if (!strcmp("memory.oom_control", cgp->props[j])) {
 			char *new;
 			int disable;
@@ -414,26 +577,28 @@ static int dump_cg_props_array(const char *fpath, struct cgroup_dir *ncd, const
 	return 0;
 }
 
-static int add_cgroup_properties(const char *fpath, struct cgroup_dir *ncd,
-				 struct cg_controller *controller)
+static int add_cgroup_properties(const char *fpath, struct cgroup_dir *ncd)
 {
-	int i;
-
-	for (i = 0; i < controller->n_controllers; ++i) {
-		const cgp_t *cgp = cgp_get_props(controller->controllers[i]);
+	unsigned int i;
+	int dirfd, ret = 0;
 
-		if (dump_cg_props_array(fpath, ncd, cgp) < 0) {
-			pr_err("dumping known properties failed");
-			return -1;
-		}
+	dirfd = open(fpath, O_RDONLY | O_DIRECTORY);
+	if (dirfd < 0) {
+		pr_perror("Can't open cgroup %s", fpath);
+		return -1;
+	}
 
-		if (dump_cg_props_array(fpath, ncd, &cgp_global) < 0) {
-			pr_err("dumping global properties failed");
-			return -1;
+	for (i = 0; i < n_walk_props; i++) {
+		ret = dump_cg_props_array(dirfd, fpath, ncd->path, ncd, &walk_props[i]);
+		if (ret < 0) {
+			pr_err("dumping %s properties failed\n",
+			       i < n_walk_props - 1 ? "known" : "global");
+			break;
 		}
 	}
 
-	return 0;
+	close(dirfd);
+	return ret;
 }
 
 static int add_cgroup(const char *fpath, const struct stat *sb, int typeflag)
@@ -463,7 +628,7 @@ static int add_cgroup(const char *fpath, const struct stat *sb, int typeflag)
 		if (!ncd->path)
 			goto out;
 
-		mtype = find_dir(ncd->path, &current_controller->heads, &match);
+		mtype = find_dir(ncd->path, current_controller, &match);
 
 		switch (mtype) {
 		/* ignore co-mounted cgroups and already dumped cgroups */
@@ -482,12 +647,15 @@ static int add_cgroup(const char *fpath, const struct stat *sb, int typeflag)
 			BUG();
 		}
 
+		cg_dir_hash(ncd, current_controller);
+
 		INIT_LIST_HEAD(&ncd->children);
 		ncd->n_children = 0;
 
 		INIT_LIST_HEAD(&ncd->properties);
 		ncd->n_properties = 0;
-		if (add_cgroup_properties(fpath, ncd, current_controller) < 0) {
+		if (add_cgroup_properties(fpath, ncd) < 0) {
+			hlist_del(&ncd->hash);
 			list_del(&ncd->siblings);
 			if (mtype == PARENT_MATCH)
 				match->n_children--;
@@ -601,6 +769,11 @@ static int collect_cgroups(struct list_head *ctls)
 		if (fd < 0)
 			return -1;
 
+		if (prepare_walk_props(current_controller)) {
+			close(fd);
+			return -1;
+		}
+
 		path_pref_len = snprintf(path, PATH_MAX, "/proc/self/fd/%d", fd);
 		snprintf(path + path_pref_len, PATH_MAX - path_pref_len, "%s", cc->path);
 
@@ -608,6 +781,7 @@ static int collect_cgroups(struct list_head *ctls)
 		if (ret < 0)
 			pr_perror("failed walking %s for empty cgroups", path);
 
+		free_walk_props();
 		close_safe(&fd);
 
 		if (ret < 0)
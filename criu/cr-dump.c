@@ -1095,6 +1095,63 @@ err:
 	return ret;
 }
 
+/*
+ * Parasites are removed from the tasks all at once after
+ * they are dumped, see parasite_cure_remote_batch().
+ */
+static LIST_HEAD(cure_ctls);
+
+static int cure_dumped_tasks(bool local)
+{
+	struct parasite_ctl *ctl, *n;
+	int ret;
+
+	if (list_empty(&cure_ctls))
+		return 0;
+
+	ret = parasite_cure_remote_batch(&cure_ctls);
+	if (ret)
+		pr_err("Can't cure tasks from parasite\n");
+
+	list_for_each_entry_safe(ctl, n, &cure_ctls, cure_list) {
+		list_del(&ctl->cure_list);
+		if (local)
+			parasite_cure_local(ctl);
+	}
+
+	return ret;
+}
+
+/*
+ * Parasite daemons of all the dumped tasks are stopped with one batch,
+ * then the threads are dumped with the parasites still in place and
+ * the parasites are removed with another batch.
+ */
+static int dump_threads_and_cure(void)
+{
+	struct pstree_item *item;
+
+	if (parasite_stop_daemons(&cure_ctls)) {
+		pr_err("Can't stop parasite daemons\n");
+		return -1;
+	}
+
+	for_each_pstree_item(item) {
+		struct parasite_ctl *ctl = dmpi(item)->parasite_ctl;
+
+		if (!ctl)
+			continue;
+
+		dmpi(item)->parasite_ctl = NULL;
+		if (dump_task_threads(ctl, item)) {
+			pr_err("Can't dump threads\n");
+			return -1;
+		}
+	}
+
+	return cure_dumped_tasks(true);
+}
+
 static int pre_dump_one_task(struct pstree_item *item, struct list_head *ctls)
 {
 	pid_t pid = item->pid.real;
@@ -1155,8 +1212,7 @@ static int pre_dump_one_task(struct pstree_item *item, struct list_head *ctls)
 	if (ret)
 		goto err_cure;
 
-	if (parasite_cure_remote(parasite_ctl))
-		pr_err("Can't cure (pid: %d) from parasite\n", pid);
+	list_add_tail(&parasite_ctl->cure_list, &cure_ctls);
 	list_add_tail(&parasite_ctl->pre_list, ctls);
 err_free:
 	free_mappings(&vmas);
@@ -1193,6 +1249,8 @@ static int dump_one_task(struct pstree_item *item)
 		 */
 		return 0;
 
+	timing_start(TIME_PROC_PARSE);
+
 	pr_info("Obtaining task stat ... \n");
 	ret = parse_pid_stat(pid, &pps_buf);
 	if (ret < 0)
@@ -1226,6 +1284,8 @@ static int dump_one_task(struct pstree_item *item)
 
 	parasite_ensure_args_size(posix_timers_dump_size(proc_args.timer_n));
 
+	timing_stop(TIME_PROC_PARSE);
+
 	ret = dump_task_signals(pid, item);
 	if (ret) {
 		pr_err("Dump %d signals failed %d\n", pid, ret);
@@ -1301,11 +1361,19 @@ static int dump_one_task(struct pstree_item *item)
 	}
 
 	if (dfds) {
+		timing_start(TIME_FILES_DUMP);
 		ret = dump_task_files_seized(parasite_ctl, item, dfds);
 		if (ret) {
 			pr_err("Dump files (pid: %d) failed with %d\n", pid, ret);
 			goto err_cure;
 		}
+		timing_stop(TIME_FILES_DUMP);
+
+		ret = cpt_lock_tcp_connections();
+		if (ret) {
+			pr_err("Can't lock TCP connections (pid: %d)\n", pid);
+			goto err_cure;
+		}
 	}
 
 	ret = parasite_dump_pages_seized(parasite_ctl, &vmas, NULL);
@@ -1336,23 +1404,12 @@ static int dump_one_task(struct pstree_item *item)
 		goto err_cure;
 	}
 
-	ret = parasite_stop_daemon(parasite_ctl);
-	if (ret) {
-		pr_err("Can't cure (pid: %d) from parasite\n", pid);
-		goto err;
-	}
-
-	ret = dump_task_threads(parasite_ctl, item);
-	if (ret) {
-		pr_err("Can't dump threads\n");
-		goto err;
-	}
-
-	ret = parasite_cure_seized(parasite_ctl);
-	if (ret) {
-		pr_err("Can't cure (pid: %d) from parasite\n", pid);
-		goto err;
-	}
+	/*
+	 * The daemon is stopped and the threads are dumped for all
+	 * the tasks at once, see dump_threads_and_cure().
+	 */
+	list_add_tail(&parasite_ctl->cure_list, &cure_ctls);
+	dmpi(item)->parasite_ctl = parasite_ctl;
 
 	ret = dump_task_mm(pid, &pps_buf, &misc, &vmas, cr_imgset);
 	if (ret) {
@@ -1417,10 +1474,141 @@ static int setup_alarm_handler()
 	return 0;
 }
 
+/*
+ * After tasks are thawed their page pipes are written by several
+ * workers, each gets one task out of nr_workers, when there are
+ * more than PRE_DUMP_TASKS_PER_WORKER ones.
+ */
+#define PRE_DUMP_TASKS_PER_WORKER	4
+#define PRE_DUMP_MAX_WORKERS		16
+
+static int pre_dump_write_one(struct parasite_ctl *ctl)
+{
+	struct page_xfer xfer;
+	int ret;
+
+	pr_info("\tPre-dumping %d\n", ctl->pid.virt);
+
+	ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, ctl->pid.virt);
+	if (ret < 0)
+		return -1;
+
+	ret = page_xfer_dump_pages(&xfer, ctl->mem_pp, 0);
+
+	xfer.close(&xfer);
+	return ret;
+}
+
+static int pre_dump_write_part(struct list_head *ctls, unsigned long ids,
+			       int worker, int nr_workers)
+{
+	struct parasite_ctl *ctl;
+	int i = 0;
+
+	list_for_each_entry(ctl, ctls, pre_list) {
+		/* Pages were written while tasks were frozen */
+		if (!ctl->mem_pp)
+			continue;
+
+		if (i++ % nr_workers != worker)
+			continue;
+
+		set_page_ids(ids + i - 1);
+		if (pre_dump_write_one(ctl))
+			return -1;
+	}
+
+	return bfd_flush_images();
+}
+
+static int pre_dump_write_pages(struct list_head *ctls)
+{
+	struct parasite_ctl *ctl;
+	int nr = 0, nr_workers, i, ret = 0;
+	pid_t pids[PRE_DUMP_MAX_WORKERS];
+	sigset_t blockmask, oldmask;
+	unsigned long ids;
+	long nr_cpus;
+
+	list_for_each_entry(ctl, ctls, pre_list)
+		if (ctl->mem_pp)
+			nr++;
+
+	if (!nr)
+		return 0;
+
+	ids = reserve_page_ids(nr);
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_workers = DIV_ROUND_UP(nr, PRE_DUMP_TASKS_PER_WORKER);
+	nr_workers = min_t(long, nr_workers, max(nr_cpus, 1L));
+	nr_workers = min(nr_workers, PRE_DUMP_MAX_WORKERS);
+
+	/* Page server serves one connection, it's fed by one writer */
+	if (opts.use_page_server)
+		nr_workers = 1;
+
+	pr_info("Pre-dumping memory of %d tasks with %d workers\n", nr, nr_workers);
+
+	if (nr_workers == 1)
+		return pre_dump_write_part(ctls, ids, 0, 1);
+
+	/*
+	 * Same as cr_system() does, the writers are waited for right
+	 * here and shouldn't get into the SIGCHLD handler.
+	 */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &blockmask, &oldmask) == -1) {
+		pr_perror("Can not set mask of blocked signals");
+		return -1;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			pr_perror("Can't fork pre-dump writer");
+			ret = -1;
+			nr_workers = i;
+			break;
+		}
+
+		if (pids[i] == 0) {
+			ret = pre_dump_write_part(ctls, ids, i, nr_workers);
+			exit(ret ? 1 : 0);
+		}
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		int status;
+
+		if (waitpid(pids[i], &status, 0) < 0) {
+			pr_perror("Can't wait pre-dump writer");
+			ret = -1;
+			continue;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			pr_err("Pre-dump writer finished with error %d\n", status);
+			ret = -1;
+		}
+	}
+
+	if (sigprocmask(SIG_SETMASK, &oldmask, NULL) == -1) {
+		pr_perror("Can not unset mask of blocked signals");
+		ret = -1;
+	}
+
+	return ret;
+}
+
 static int cr_pre_dump_finish(struct list_head *ctls, int ret)
 {
 	struct parasite_ctl *ctl, *n;
 
+	if (cure_dumped_tasks(false))
+		ret = -1;
+
 	pstree_switch_state(root_item, TASK_ALIVE);
 	free_pstree(root_item);
 
@@ -1430,25 +1618,15 @@ static int cr_pre_dump_finish(struct list_head *ctls, int ret)
 		goto err;
 
 	pr_info("Pre-dumping tasks' memory\n");
-	list_for_each_entry_safe(ctl, n, ctls, pre_list) {
-		struct page_xfer xfer;
-
-		pr_info("\tPre-dumping %d\n", ctl->pid.virt);
-		timing_start(TIME_MEMWRITE);
-		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, ctl->pid.virt);
-		if (ret < 0)
-			goto err;
-
-		ret = page_xfer_dump_pages(&xfer, ctl->mem_pp, 0);
-
-		xfer.close(&xfer);
-
-		if (ret)
-			goto err;
-
-		timing_stop(TIME_MEMWRITE);
+	timing_start(TIME_MEMWRITE);
+	ret = pre_dump_write_pages(ctls);
+	if (ret)
+		goto err;
+	timing_stop(TIME_MEMWRITE);
 
-		destroy_page_pipe(ctl->mem_pp);
+	list_for_each_entry_safe(ctl, n, ctls, pre_list) {
+		if (ctl->mem_pp)
+			destroy_page_pipe(ctl->mem_pp);
 		list_del(&ctl->pre_list);
 		parasite_cure_local(ctl);
 	}
@@ -1544,6 +1722,9 @@ static int cr_dump_finish(int ret)
 {
 	int post_dump_ret = 0;
 
+	if (cure_dumped_tasks(true))
+		ret = -1;
+
 	if (disconnect_from_page_server())
 		ret = -1;
 
@@ -1690,6 +1871,13 @@ int cr_dump_tasks(pid_t pid)
 	if (collect_pstree())
 		goto err;
 
+	/*
+	 * Parasites kept by pre-dumps would otherwise get into
+	 * the images as tasks' mappings.
+	 */
+	if (parasite_drop_kept(true))
+		goto err;
+
 	if (collect_pstree_ids())
 		goto err;
 
@@ -1714,6 +1902,15 @@ int cr_dump_tasks(pid_t pid)
 			goto err;
 	}
 
+	if (dump_threads_and_cure())
+		goto err;
+
+	if (dump_tcp_conns())
+		goto err;
+
+	if (dump_ghost_files())
+		goto err;
+
 	/*
 	 * It may happen that a process has completed but its files in
 	 * /proc/PID/ are still open by another process. If the PID has been
@@ -1724,8 +1921,10 @@ int cr_dump_tasks(pid_t pid)
 		goto err;
 
 	/* MNT namespaces are dumped after files to save remapped links */
+	timing_start(TIME_MNT_DUMP);
 	if (dump_mnt_namespaces() < 0)
 		goto err;
+	timing_stop(TIME_MNT_DUMP);
 
 	if (dump_file_locks())
 		goto err;
@@ -1739,9 +1938,12 @@ int cr_dump_tasks(pid_t pid)
 	if (dump_pstree(root_item))
 		goto err;
 
-	if (root_ns_mask)
+	if (root_ns_mask) {
+		timing_start(TIME_NS_DUMP);
 		if (dump_namespaces(root_item, root_ns_mask) < 0)
 			goto err;
+		timing_stop(TIME_NS_DUMP);
+	}
 
 	ret = dump_cgroups();
 	if (ret)
@@ -18,11 +18,13 @@
 #include <sys/file.h>
 #include <sys/shm.h>
 #include <sys/mount.h>
+#include <sys/time.h>
 #include <sys/prctl.h>
 
 #include <sched.h>
 
 #include <sys/sendfile.h>
+#include <sys/syscall.h>
 
 #include "ptrace.h"
 #include "compiler.h"
@@ -76,6 +78,8 @@
 #include "seccomp.h"
 #include "fault-injection.h"
 #include "sk-queue.h"
+#include "clone3.h"
+#include "syscall-codes.h"
 
 #include "parasite-syscall.h"
 
@@ -413,10 +417,209 @@ static int collect_zombie_pids(struct task_restore_args *ta)
 	return collect_child_pids(TASK_DEAD, &ta->zombies_n);
 }
 
+/*
+ * Core images are tiny, but there's one per thread and all of them
+ * used to be opened and read one by one in the forking path. Before
+ * forking anything criu reads them with a few workers into a shared
+ * mapping, which all the restored tasks inherit, and open_core() just
+ * unpacks the entry from there. Cores that don't fit the mapping (or
+ * all of them if preloading fails) are read from images as before.
+ */
+#define CORE_PRELOAD_AVG_SIZE		(16 << 10)
+#define CORE_PRELOAD_PER_WORKER		256
+#define CORE_PRELOAD_MAX_WORKERS	8
+
+struct core_blob {
+	pid_t		pid;
+	u32		len;	/* zero if not preloaded */
+	unsigned long	off;
+};
+
+static struct core_blob *core_blobs;
+static unsigned int core_blobs_nr;
+static void *core_blobs_data;
+static size_t core_blobs_size;
+
+static int core_blob_cmp(const void *a, const void *b)
+{
+	const struct core_blob *x = a, *y = b;
+
+	return x->pid - y->pid;
+}
+
+static struct core_blob *core_blob_lookup(pid_t pid)
+{
+	struct core_blob key = { .pid = pid };
+
+	if (!core_blobs)
+		return NULL;
+
+	return bsearch(&key, core_blobs, core_blobs_nr, sizeof(key), core_blob_cmp);
+}
+
+static int preload_cores_part(unsigned int from, unsigned int to)
+{
+	void *pos = core_blobs_data + from * CORE_PRELOAD_AVG_SIZE;
+	void *end = core_blobs_data + to * CORE_PRELOAD_AVG_SIZE;
+	unsigned int i;
+
+	for (i = from; i < to; i++) {
+		struct core_blob *b = &core_blobs[i];
+		struct cr_img *img;
+		u32 len;
+		int ret;
+
+		img = open_image(CR_FD_CORE, O_RSTR, b->pid);
+		if (!img)
+			return -1;
+
+		ret = read_img_buf(img, &len, sizeof(len));
+		if (ret > 0 && pos + len <= end) {
+			ret = read_img_buf(img, pos, len);
+			b->off = pos - core_blobs_data;
+			b->len = len;
+			pos += len;
+		}
+		close_image(img);
+
+		if (ret < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+static int preload_cores_run(void)
+{
+	pid_t pids[CORE_PRELOAD_MAX_WORKERS];
+	sigset_t blockmask, oldmask;
+	unsigned int nr_workers, per, i;
+	long nr_cpus;
+	int ret = 0;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_workers = DIV_ROUND_UP(core_blobs_nr, CORE_PRELOAD_PER_WORKER);
+	nr_workers = min_t(long, nr_workers, max(nr_cpus, 1L));
+	nr_workers = min_t(unsigned int, nr_workers, CORE_PRELOAD_MAX_WORKERS);
+	per = DIV_ROUND_UP(core_blobs_nr, nr_workers);
+
+	pr_info("Preloading %u cores with %u workers\n", core_blobs_nr, nr_workers);
+
+	if (nr_workers == 1)
+		return preload_cores_part(0, core_blobs_nr);
+
+	/* Workers are waited for right here, as in cr_system() */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &blockmask, &oldmask) == -1) {
+		pr_perror("Can not set mask of blocked signals");
+		return -1;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			pr_perror("Can't fork core preload worker");
+			ret = -1;
+			nr_workers = i;
+			break;
+		}
+
+		if (pids[i] == 0) {
+			unsigned int from = i * per;
+
+			ret = preload_cores_part(min(from, core_blobs_nr),
+						 min(from + per, core_blobs_nr));
+			exit(ret ? 1 : 0);
+		}
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		int status;
+
+		if (waitpid(pids[i], &status, 0) < 0) {
+			pr_perror("Can't wait core preload worker");
+			ret = -1;
+			continue;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			pr_err("Core preload worker finished with error %d\n", status);
+			ret = -1;
+		}
+	}
+
+	if (sigprocmask(SIG_SETMASK, &oldmask, NULL) == -1) {
+		pr_perror("Can not unset mask of blocked signals");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static void preload_cores_fini(void)
+{
+	if (core_blobs)
+		munmap(core_blobs, core_blobs_size);
+	core_blobs = NULL;
+	core_blobs_nr = 0;
+}
+
+static int preload_cores(void)
+{
+	struct pstree_item *item;
+	unsigned int nr = 0, i;
+	size_t hdr;
+
+	for_each_pstree_item(item)
+		if (item->pid.state != TASK_HELPER)
+			nr += item->nr_threads;
+	if (!nr)
+		return 0;
+
+	hdr = round_up(nr * sizeof(*core_blobs), page_size());
+	core_blobs_size = hdr + (size_t)nr * CORE_PRELOAD_AVG_SIZE;
+	core_blobs = mmap(NULL, core_blobs_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (core_blobs == MAP_FAILED) {
+		pr_warn("Can't map %zu bytes to preload cores\n", core_blobs_size);
+		core_blobs = NULL;
+		return 0;
+	}
+	core_blobs_data = (void *)core_blobs + hdr;
+
+	for_each_pstree_item(item) {
+		if (item->pid.state == TASK_HELPER)
+			continue;
+		for (i = 0; i < item->nr_threads; i++)
+			core_blobs[core_blobs_nr++].pid = item->threads[i].virt;
+	}
+	qsort(core_blobs, core_blobs_nr, sizeof(*core_blobs), core_blob_cmp);
+
+	if (preload_cores_run()) {
+		pr_warn("Can't preload cores, will read them on demand\n");
+		preload_cores_fini();
+	}
+
+	return 0;
+}
+
 static int open_core(int pid, CoreEntry **pcore)
 {
 	int ret;
 	struct cr_img *img;
+	struct core_blob *b;
+
+	b = core_blob_lookup(pid);
+	if (b && b->len) {
+		*pcore = core_entry__unpack(NULL, b->len, core_blobs_data + b->off);
+		if (*pcore == NULL) {
+			pr_err("Can't unpack preloaded core for %d\n", pid);
+			return -1;
+		}
+
+		return 0;
+	}
 
 	img = open_image(CR_FD_CORE, O_RSTR, pid);
 	if (!img) {
@@ -502,6 +705,7 @@ static int restore_one_alive_task(int pid, CoreEntry *core)
 {
 	unsigned args_len;
 	struct task_restore_args *ta;
+	struct timeval start;
 	pr_info("Restoring resources\n");
 
 	rst_mem_switch_to_private();
@@ -514,8 +718,10 @@ static int restore_one_alive_task(int pid, CoreEntry *core)
 
 	memzero(ta, args_len);
 
+	gettimeofday(&start, NULL);
 	if (prepare_fds(current))
 		return -1;
+	cnt_add(CNT_FILES_RESTORE_USEC, usec_since(&start));
 
 	if (prepare_file_locks(pid))
 		return -1;
@@ -828,11 +1034,35 @@ static void maybe_clone_parent(struct pstree_item *item,
 	}
 }
 
+/*
+ * Ask for the pid right in clone3(). Unlike the ns_last_pid way this
+ * doesn't need the global lock, so tasks fork their children in
+ * parallel. There's no CLONE_VM, so the child just goes on with a
+ * copy of our stack like after fork().
+ */
+static int clone3_with_pid(struct cr_clone_arg *ca, pid_t pid)
+{
+	struct cr_clone_args args = { };
+	long ret;
+
+	args.flags = ca->clone_flags & ~(CLONE_NEWNET | CLONE_NEWCGROUP);
+	args.exit_signal = SIGCHLD;
+	args.set_tid = (unsigned long)&pid;
+	args.set_tid_size = 1;
+
+	ret = syscall(__NR_clone3, &args, sizeof(args));
+	if (ret == 0)
+		_exit(restore_task_with_children(ca));
+
+	return ret;
+}
+
 static inline int fork_with_pid(struct pstree_item *item)
 {
 	struct cr_clone_arg ca;
 	int ret = -1;
 	pid_t pid = item->pid.virt;
+	bool use_clone3;
 
 	if (item->pid.state != TASK_HELPER) {
 		if (open_core(pid, &ca.core))
@@ -871,7 +1101,9 @@ static inline int fork_with_pid(struct pstree_item *item)
 
 	pr_info("Forking task with %d pid (flags 0x%lx)\n", pid, ca.clone_flags);
 
-	if (!(ca.clone_flags & CLONE_NEWPID)) {
+	use_clone3 = !(ca.clone_flags & CLONE_NEWPID) && kdat.has_clone3_set_tid;
+
+	if (!(ca.clone_flags & CLONE_NEWPID) && !use_clone3) {
 		char buf[32];
 		int len;
 
@@ -894,7 +1126,7 @@ static inline int fork_with_pid(struct pstree_item *item)
 		}
 	} else {
 		ca.fd = -1;
-		BUG_ON(pid != INIT_PID);
+		BUG_ON(!use_clone3 && pid != INIT_PID);
 	}
 
 	/*
@@ -909,15 +1141,17 @@ static inline int fork_with_pid(struct pstree_item *item)
 	 * The cgroup namespace is also unshared explicitly in the
 	 * move_in_cgroup(), so drop this flag here as well.
 	 */
-	ret = clone(restore_task_with_children, ca.stack_ptr,
-		    (ca.clone_flags & ~(CLONE_NEWNET | CLONE_NEWCGROUP)) | SIGCHLD, &ca);
+	if (use_clone3)
+		ret = clone3_with_pid(&ca, pid);
+	else
+		ret = clone(restore_task_with_children, ca.stack_ptr,
+			    (ca.clone_flags & ~(CLONE_NEWNET | CLONE_NEWCGROUP)) | SIGCHLD, &ca);
 
 	if (ret < 0) {
 		pr_perror("Can't fork for %d", pid);
 		goto err_unlock;
 	}
 
-
 	if (item == root_item) {
 		item->pid.real = ret;
 		pr_debug("PID: real %d virt %d\n",
@@ -1282,8 +1516,10 @@ static int restore_task_with_children(void *_arg)
 		if (mount_proc())
 			goto err;
 
+		timing_start(TIME_NS_RESTORE);
 		if (prepare_namespace(current, ca->clone_flags))
 			goto err;
+		timing_stop(TIME_NS_RESTORE);
 
 		if (root_prepare_shared())
 			goto err;
@@ -1309,6 +1545,8 @@ static int restore_task_with_children(void *_arg)
 	if (create_children_and_session())
 		goto err;
 
+	if (restore_deferred_vma_content(current))
+		goto err;
 
 	if (unmap_guard_pages(current))
 		goto err;
@@ -1373,17 +1611,61 @@ static int restore_wait_inprogress_tasks()
 	return 0;
 }
 
+/*
+ * See restore_finish_stage() for how the waiters are woken up. When
+ * not all the tasks have reached the barrier (failure) or some may
+ * have gone away already (completion), all the groups are woken up.
+ */
+static void restore_wake_stage(int stage, bool wake_all)
+{
+	int i;
+
+	futex_set(&task_entries->start, stage);
+	for (i = 0; i < NR_STAGE_WAITERS; i++)
+		futex_set(&task_entries->waiters[i].start, stage);
+
+	for (i = 0; i < (wake_all ? NR_STAGE_WAITERS : 1); i++)
+		futex_wake(&task_entries->waiters[i].start);
+}
+
 static void __restore_switch_stage(int next_stage)
 {
 	futex_set(&task_entries->nr_in_progress,
 			stage_participants(next_stage));
-	futex_set_and_wake(&task_entries->start, next_stage);
+	restore_wake_stage(next_stage, next_stage == CR_STATE_FAIL);
+}
+
+static int stage_timing(int stage)
+{
+	switch (stage) {
+	case CR_STATE_RESTORE_NS:
+		return TIME_STAGE_RESTORE_NS;
+	case CR_STATE_FORKING:
+		return TIME_STAGE_FORKING;
+	case CR_STATE_RESTORE:
+		return TIME_STAGE_RESTORE;
+	case CR_STATE_RESTORE_SIGCHLD:
+		return TIME_STAGE_RESTORE_SIGCHLD;
+	case CR_STATE_RESTORE_CREDS:
+		return TIME_STAGE_RESTORE_CREDS;
+	}
+
+	return -1;
 }
 
 static int restore_switch_stage(int next_stage)
 {
+	int ret, t = stage_timing(next_stage);
+
+	if (t >= 0)
+		timing_start(t);
+
 	__restore_switch_stage(next_stage);
-	return restore_wait_inprogress_tasks();
+	ret = restore_wait_inprogress_tasks();
+
+	if (t >= 0)
+		timing_stop(t);
+	return ret;
 }
 
 static int attach_to_tasks(bool root_seized)
@@ -1657,6 +1939,7 @@ static int restore_root_task(struct pstree_item *init)
 	futex_set(&task_entries->nr_in_progress,
 			stage_participants(CR_STATE_RESTORE_NS));
 
+	timing_start(TIME_STAGE_RESTORE_NS);
 	ret = fork_with_pid(init);
 	if (ret < 0)
 		goto out;
@@ -1698,6 +1981,8 @@ static int restore_root_task(struct pstree_item *init)
 	if (ret)
 		goto out_kill;
 
+	timing_stop(TIME_STAGE_RESTORE_NS);
+
 	if (root_ns_mask & CLONE_NEWNS) {
 		mnt_ns_fd = open_proc(init->pid.real, "ns/mnt");
 		if (mnt_ns_fd < 0) {
@@ -1793,7 +2078,7 @@ static int restore_root_task(struct pstree_item *init)
 	ret = catch_tasks(root_seized, &flag);
 
 	pr_info("Restore finished successfully. Resuming tasks.\n");
-	futex_set_and_wake(&task_entries->start, CR_STATE_COMPLETE);
+	restore_wake_stage(CR_STATE_COMPLETE, true);
 
 	if (ret == 0)
 		ret = parasite_stop_on_syscall(task_entries->nr_threads,
@@ -1860,6 +2145,8 @@ out:
 
 static int prepare_task_entries(void)
 {
+	int i;
+
 	task_entries_pos = rst_mem_align_cpos(RM_SHREMAP);
 	task_entries = rst_mem_alloc(sizeof(*task_entries), RM_SHREMAP);
 	if (!task_entries) {
@@ -1871,6 +2158,10 @@ static int prepare_task_entries(void)
 	task_entries->nr_tasks = 0;
 	task_entries->nr_helpers = 0;
 	futex_set(&task_entries->start, CR_STATE_RESTORE_NS);
+	for (i = 0; i < NR_STAGE_WAITERS; i++) {
+		futex_set(&task_entries->waiters[i].start, CR_STATE_RESTORE_NS);
+		atomic_set(&task_entries->waiters[i].woken, CR_STATE_RESTORE_NS);
+	}
 	mutex_init(&task_entries->userns_sync_lock);
 
 	return 0;
@@ -1911,6 +2202,9 @@ int cr_restore_tasks(void)
 	if (prepare_pstree() < 0)
 		goto err;
 
+	if (preload_cores() < 0)
+		goto err;
+
 	if (crtools_prepare_shared() < 0)
 		goto err;
 
@@ -1919,6 +2213,7 @@ int cr_restore_tasks(void)
 
 	ret = restore_root_task(root_item);
 err:
+	preload_cores_fini();
 	cr_plugin_fini(CR_PLUGIN_STAGE__RESTORE, ret);
 	return ret;
 }
@@ -39,6 +39,8 @@
 
 #include "cr-errno.h"
 #include "namespaces.h"
+#include "stats.h"
+#include "parasite-syscall.h"
 
 unsigned int service_sk_ino = -1;
 
@@ -126,6 +128,25 @@ static void send_criu_err(int sk, char *msg)
 	send_criu_msg(sk, &resp);
 }
 
+static void fill_resp_stats(int what, CriuStat ***stats, size_t *n_stats)
+{
+	static struct stats_value vals[STATS_MAX_VALUES];
+	static CriuStat st[STATS_MAX_VALUES];
+	static CriuStat *pst[STATS_MAX_VALUES];
+	int i, nr;
+
+	nr = get_stats(what, vals);
+	for (i = 0; i < nr; i++) {
+		criu_stat__init(&st[i]);
+		st[i].name = (char *)vals[i].name;
+		st[i].value = vals[i].val;
+		pst[i] = &st[i];
+	}
+
+	*stats = pst;
+	*n_stats = nr;
+}
+
 int send_criu_dump_resp(int socket_fd, bool success, bool restored)
 {
 	CriuResp msg = CRIU_RESP__INIT;
@@ -141,6 +162,8 @@ int send_criu_dump_resp(int socket_fd, bool success, bool restored)
 
 	resp.has_restored = true;
 	resp.restored = restored;
+	if (success && !restored)
+		fill_resp_stats(DUMP_STATS, &resp.stats, &resp.n_stats);
 
 	return send_criu_msg(socket_fd, &msg);
 }
@@ -173,6 +196,8 @@ int send_criu_restore_resp(int socket_fd, bool success, int pid)
 	msg.restore = &resp;
 
 	resp.pid = pid;
+	if (success)
+		fill_resp_stats(RESTORE_STATS, &resp.stats, &resp.n_stats);
 
 	return send_criu_msg(socket_fd, &msg);
 }
@@ -486,6 +511,9 @@ static int setup_opts_from_req(int sk, CriuOpts *req)
 	if (req->has_ghost_limit)
 		opts.ghost_limit = req->ghost_limit;
 
+	if (req->has_pre_dump_mem_limit)
+		opts.pre_dump_mem_limit = req->pre_dump_mem_limit;
+
 	if (req->has_empty_ns) {
 		opts.empty_ns = req->empty_ns;
 		if (req->empty_ns & ~(CLONE_NEWNET))
@@ -649,24 +677,38 @@ static int pre_dump_loop(int sk, CriuReq *msg)
 {
 	int ret;
 
+	/*
+	 * Pre-dumps of one session may leave parasites in tasks
+	 * for the next ones, see parasite_reuse_kept().
+	 */
+	if (msg->opts->has_keep_parasite && msg->opts->keep_parasite &&
+	    parasite_keep_init())
+		return -1;
+
 	do {
 		ret = pre_dump_using_req(sk, msg->opts);
 		if (ret < 0)
-			return ret;
+			goto out;
 
 		criu_req__free_unpacked(msg, NULL);
 		if (recv_criu_msg(sk, &msg) == -1) {
 			pr_perror("Can't recv request");
-			return -1;
+			ret = -1;
+			goto out;
 		}
 	} while (msg->type == CRIU_REQ_TYPE__PRE_DUMP);
 
 	if (msg->type != CRIU_REQ_TYPE__DUMP) {
 		send_criu_err(sk, "Bad req seq");
-		return -1;
+		ret = -1;
+		goto out;
 	}
 
-	return dump_using_req(sk, msg->opts);
+	ret = dump_using_req(sk, msg->opts);
+out:
+	if (parasite_drop_kept(false))
+		ret = -1;
+	return ret;
 }
 
 struct ps_info {
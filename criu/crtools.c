@@ -279,6 +279,7 @@ int main(int argc, char *argv[], char *envp[])
 		{ "cgroup-props-file",		required_argument,	0, 1081	},
 		{ "cgroup-dump-controller",	required_argument,	0, 1082	},
 		{ SK_INFLIGHT_PARAM,		no_argument,		0, 1083	},
+		{ "pre-dump-mem-limit",		required_argument,	0, 1084	},
 		{ },
 	};
 
@@ -587,6 +588,9 @@ int main(int argc, char *argv[], char *envp[])
 			pr_msg("Will skip in-flight TCP connections\n");
 			opts.tcp_skip_in_flight = true;
 			break;
+		case 1084:
+			opts.pre_dump_mem_limit = parse_size(optarg);
+			break;
 		case 'V':
 			pr_msg("Version: %s\n", CRIU_VERSION);
 			if (strcmp(CRIU_GITID, "0"))
@@ -892,6 +896,9 @@ usage:
 "* Memory dumping options:\n"
 "  --track-mem           turn on memory changes tracker in kernel\n"
 "  --prev-images-dir DIR path to images from previous dump (relative to -D)\n"
+"  --pre-dump-mem-limit size\n"
+"                        limit memory pre-dump keeps pages in till tasks are\n"
+"                        unfrozen, the rest is written while they are frozen\n"
 "  --page-server         send pages to page server (see options below as well)\n"
 "  --auto-dedup          when used on dump it will deduplicate \"old\" data in\n"
 "                        pages images of previous dump\n"
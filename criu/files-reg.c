@@ -6,8 +6,11 @@
 #include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <sys/vfs.h>
 #include <sys/prctl.h>
+#include <sys/ioctl.h>
 #include <ctype.h>
 #include <sched.h>
 
@@ -35,6 +38,16 @@
 #include "files-reg.h"
 #include "plugin.h"
 
+#ifndef FICLONERANGE
+struct file_clone_range {
+	s64 src_fd;
+	u64 src_offset;
+	u64 src_length;
+	u64 dest_offset;
+};
+#define FICLONERANGE	_IOW(0x94, 13, struct file_clone_range)
+#endif
+
 int setfsuid(uid_t fsuid);
 
 /*
@@ -122,15 +135,142 @@ static int trim_last_parent(char *path)
 	return 0;
 }
 
-static int mkreg_ghost(char *path, u32 mode, struct ghost_file *gf, struct cr_img *img)
+/*
+ * Ghost contents are put into the file right from the image. When both
+ * are on the same filesystem the blocks are cloned (shared, if it's a
+ * CoW one), otherwise, or for the unaligned tail, they are copied with
+ * copy_file_range() by the kernel, so the data doesn't go through criu.
+ */
+struct ghost_xfer {
+	int		img_fd;
+	int		fd;
+	bool		clone;
+	unsigned long	blksize;
+};
+
+static int ghost_xfer_init(struct ghost_xfer *gx, int img_fd, int fd)
+{
+	struct stat ist, st;
+
+	if (fstat(img_fd, &ist) < 0 || fstat(fd, &st) < 0) {
+		pr_perror("Can't stat ghost file or image");
+		return -1;
+	}
+
+	gx->img_fd = img_fd;
+	gx->fd = fd;
+	gx->clone = ist.st_dev == st.st_dev;
+	gx->blksize = max_t(unsigned long, st.st_blksize, ist.st_blksize);
+	return 0;
+}
+
+static int ghost_xfer_part(struct ghost_xfer *gx, off_t img_off, off_t off, u64 len)
+{
+	if (gx->clone && !(img_off % gx->blksize) && !(off % gx->blksize) &&
+	    len >= gx->blksize) {
+		struct file_clone_range fcr = {
+			.src_fd		= gx->img_fd,
+			.src_offset	= img_off,
+			.src_length	= len - len % gx->blksize,
+			.dest_offset	= off,
+		};
+
+		if (!ioctl(gx->fd, FICLONERANGE, &fcr)) {
+			img_off += fcr.src_length;
+			off += fcr.src_length;
+			len -= fcr.src_length;
+		} else if (errno == EOPNOTSUPP || errno == ENOTTY ||
+			   errno == EXDEV || errno == EINVAL) {
+			pr_debug("Can't clone ghost data, will copy it: %m\n");
+			gx->clone = false;
+		} else {
+			pr_perror("Can't clone ghost data");
+			return -1;
+		}
+	}
+
+	if (!len)
+		return 0;
+
+	return copy_file_part(gx->img_fd, img_off, gx->fd, off, len);
+}
+
+static int restore_ghost_chunks(int fd, struct cr_img *img, GhostFileEntry *gfe)
+{
+	int img_fd = img_raw_fd(img), ret;
+	struct ghost_xfer gx;
+	GhostChunkEntry *gce;
+	off_t img_off;
+
+	if (ftruncate(fd, gfe->size) < 0) {
+		pr_perror("Can't set ghost file size");
+		return -1;
+	}
+
+	if (ghost_xfer_init(&gx, img_fd, fd))
+		return -1;
+
+	while (1) {
+		ret = pb_read_one_eof(img, &gce, PB_GHOST_CHUNK);
+		if (ret <= 0)
+			return ret;
+
+		img_off = lseek(img_fd, 0, SEEK_CUR);
+		if (img_off < 0) {
+			pr_perror("Can't get ghost image position");
+			ret = -1;
+		} else {
+			if (gce->has_pad)
+				img_off += gce->pad;
+			ret = ghost_xfer_part(&gx, img_off, gce->off, gce->len);
+		}
+
+		if (!ret && lseek(img_fd, img_off + gce->len, SEEK_SET) < 0) {
+			pr_perror("Can't seek ghost image");
+			ret = -1;
+		}
+
+		ghost_chunk_entry__free_unpacked(gce, NULL);
+		if (ret)
+			return -1;
+	}
+}
+
+/* Images without chunks carry the whole file after the entry */
+static int restore_ghost_data(int fd, struct cr_img *img)
+{
+	int img_fd = img_raw_fd(img);
+	struct ghost_xfer gx;
+	struct stat st;
+	off_t img_off;
+
+	img_off = lseek(img_fd, 0, SEEK_CUR);
+	if (img_off < 0 || fstat(img_fd, &st) < 0) {
+		pr_perror("Can't get ghost image position");
+		return -1;
+	}
+
+	if (st.st_size <= img_off)
+		return 0;
+
+	if (ghost_xfer_init(&gx, img_fd, fd))
+		return -1;
+
+	return ghost_xfer_part(&gx, img_off, 0, st.st_size - img_off);
+}
+
+static int mkreg_ghost(char *path, GhostFileEntry *gfe, struct ghost_file *gf, struct cr_img *img)
 {
 	int gfd, ret;
 
-	gfd = open(path, O_WRONLY | O_CREAT | O_EXCL, mode);
+	gfd = open(path, O_WRONLY | O_CREAT | O_EXCL, gfe->mode);
 	if (gfd < 0)
 		return -1;
 
-	ret = copy_file(img_raw_fd(img), gfd, 0);
+	if (gfe->chunks)
+		ret = restore_ghost_chunks(gfd, img, gfe);
+	else
+		ret = restore_ghost_data(gfd, img);
 	if (ret < 0)
 		unlink(path);
 	close(gfd);
@@ -200,7 +340,7 @@ again:
 			goto err;
 		}
 	} else {
-		if ((ret = mkreg_ghost(path, gfe->mode, gf, img)) < 0)
+		if ((ret = mkreg_ghost(path, gfe, gf, img)) < 0)
 			msg = "Can't create ghost regfile";
 	}
 
@@ -604,11 +744,98 @@ static struct collect_image_info remap_cinfo = {
 	.collect = collect_one_remap,
 };
 
-static int dump_ghost_file(int _fd, u32 id, const struct stat *st, dev_t phys_dev)
+static int dump_ghost_chunk(int fd, struct cr_img *img, off_t off, off_t len)
+{
+	GhostChunkEntry gce = GHOST_CHUNK_ENTRY__INIT;
+	int img_fd = img_raw_fd(img);
+	off_t img_off;
+
+	img_off = lseek(img_fd, 0, SEEK_CUR);
+	if (img_off < 0) {
+		pr_perror("Can't get ghost image position");
+		return -1;
+	}
+
+	gce.off = off;
+	gce.len = len;
+
+	/*
+	 * Put the data at a page boundary in the image, so that restore
+	 * can clone it into the file. The pad is fixed32 in the entry, so
+	 * its value doesn't change the entry's size.
+	 */
+	if (len >= PAGE_SIZE) {
+		gce.has_pad = true;
+		img_off += sizeof(u32) + ghost_chunk_entry__get_packed_size(&gce);
+		gce.pad = (PAGE_SIZE - img_off % PAGE_SIZE) % PAGE_SIZE;
+	}
+
+	if (pb_write_one(img, &gce, PB_GHOST_CHUNK))
+		return -1;
+
+	img_off = lseek(img_fd, gce.pad, SEEK_CUR);
+	if (img_off < 0) {
+		pr_perror("Can't get ghost image position");
+		return -1;
+	}
+
+	if (copy_file_part(fd, off, img_fd, img_off, len))
+		return -1;
+
+	if (lseek(img_fd, img_off + len, SEEK_SET) < 0) {
+		pr_perror("Can't seek ghost image");
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Only the data extents of the file get into the image,
+ * the holes are found with SEEK_DATA/SEEK_HOLE and skipped.
+ */
+static int dump_ghost_chunks(int fd, struct cr_img *img, off_t size)
+{
+	off_t off = 0, end;
+
+	while (off < size) {
+		off = lseek(fd, off, SEEK_DATA);
+		if (off < 0) {
+			if (errno == ENXIO)
+				break;
+			if (errno != EINVAL) {
+				pr_perror("Can't find data in ghost file");
+				return -1;
+			}
+
+			/* No SEEK_DATA support, dump the whole file */
+			return dump_ghost_chunk(fd, img, 0, size);
+		}
+
+		if (off >= size)
+			break;
+
+		end = lseek(fd, off, SEEK_HOLE);
+		if (end < 0) {
+			pr_perror("Can't find hole in ghost file");
+			return -1;
+		}
+
+		end = min(end, size);
+		if (dump_ghost_chunk(fd, img, off, end - off))
+			return -1;
+		off = end;
+	}
+
+	return 0;
+}
+
+static int do_dump_ghost_file(int fd, u32 id, const struct stat *st, dev_t phys_dev)
 {
 	struct cr_img *img;
 	GhostFileEntry gfe = GHOST_FILE_ENTRY__INIT;
 	Timeval atim = TIMEVAL__INIT, mtim = TIMEVAL__INIT;
+	int ret = 0;
 
 	pr_info("Dumping ghost file contents (id %#x)\n", id);
 
@@ -636,33 +863,226 @@ static int dump_ghost_file(int _fd, u32 id, const struct stat *st, dev_t phys_de
 		gfe.rdev = st->st_rdev;
 	}
 
+	if (S_ISREG(st->st_mode)) {
+		gfe.has_chunks = gfe.has_size = true;
+		gfe.chunks = true;
+		gfe.size = st->st_size;
+	}
+
 	if (pb_write_one(img, &gfe, PB_GHOST_FILE))
+		ret = -1;
+	else if (S_ISREG(st->st_mode))
+		ret = dump_ghost_chunks(fd, img, st->st_size);
+
+	close_image(img);
+	return ret;
+}
+
+/*
+ * Contents of big ghost files are dumped after all the tasks by
+ * several workers. The files are handed out biggest first, so that
+ * a huge one started last doesn't make the rest wait for it.
+ */
+#define GHOST_DEFER_SIZE	(1 << 20)
+#define GHOST_BYTES_PER_WORKER	(64 << 20)
+#define GHOST_MAX_WORKERS	16
+
+struct ghost_dump_job {
+	struct list_head	list;
+	int			fd;
+	u32			id;
+	dev_t			phys_dev;
+	struct stat		st;
+};
+
+static LIST_HEAD(ghost_dump_jobs);
+static unsigned int nr_ghost_dump_jobs;
+
+static inline unsigned long ghost_data_size(const struct stat *st)
+{
+	return st->st_blocks * 512;
+}
+
+static int dump_ghost_file(int _fd, u32 id, const struct stat *st, dev_t phys_dev)
+{
+	struct ghost_dump_job *job;
+	char lpath[PSFDS];
+	int fd, ret;
+
+	if (!S_ISREG(st->st_mode))
+		return do_dump_ghost_file(-1, id, st, phys_dev);
+
+	/*
+	 * Reopen file locally since it may have no read
+	 * permissions when drained
+	 */
+	sprintf(lpath, "/proc/self/fd/%d", _fd);
+	fd = open(lpath, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("Can't open ghost original file");
 		return -1;
+	}
 
-	if (S_ISREG(st->st_mode)) {
-		int fd, ret;
-		char lpath[PSFDS];
+	if (ghost_data_size(st) < GHOST_DEFER_SIZE) {
+		ret = do_dump_ghost_file(fd, id, st, phys_dev);
+		close(fd);
+		return ret;
+	}
 
-		/*
-		 * Reopen file locally since it may have no read
-		 * permissions when drained
-		 */
-		sprintf(lpath, "/proc/self/fd/%d", _fd);
-		fd = open(lpath, O_RDONLY);
-		if (fd < 0) {
-			pr_perror("Can't open ghost original file");
-			return -1;
-		}
-		ret = copy_file(fd, img_raw_fd(img), st->st_size);
+	job = xmalloc(sizeof(*job));
+	if (!job) {
 		close(fd);
-		if (ret)
+		return -1;
+	}
+
+	job->fd = fd;
+	job->id = id;
+	job->phys_dev = phys_dev;
+	job->st = *st;
+	list_add_tail(&job->list, &ghost_dump_jobs);
+	nr_ghost_dump_jobs++;
+
+	pr_info("Ghost file %#x of %lu bytes is queued\n", id, ghost_data_size(st));
+	return 0;
+}
+
+static int ghost_job_cmp(const void *a, const void *b)
+{
+	const struct ghost_dump_job *ja = *(struct ghost_dump_job **)a;
+	const struct ghost_dump_job *jb = *(struct ghost_dump_job **)b;
+	unsigned long sa = ghost_data_size(&ja->st), sb = ghost_data_size(&jb->st);
+
+	return sa < sb ? 1 : (sa > sb ? -1 : 0);
+}
+
+static int dump_ghost_part(struct ghost_dump_job **jobs, int nr, atomic_t *next)
+{
+	while (1) {
+		struct ghost_dump_job *job;
+		int i;
+
+		i = atomic_inc_return(next) - 1;
+		if (i >= nr)
+			break;
+
+		job = jobs[i];
+		if (do_dump_ghost_file(job->fd, job->id, &job->st, job->phys_dev))
 			return -1;
 	}
 
-	close_image(img);
 	return 0;
 }
 
+int dump_ghost_files(void)
+{
+	struct ghost_dump_job **jobs, *job, *t;
+	int nr = nr_ghost_dump_jobs, nr_workers, i, ret = 0;
+	pid_t pids[GHOST_MAX_WORKERS];
+	sigset_t blockmask, oldmask;
+	unsigned long total = 0;
+	atomic_t *next;
+	long nr_cpus;
+
+	if (!nr)
+		return 0;
+
+	jobs = xmalloc(nr * sizeof(*jobs));
+	if (!jobs) {
+		ret = -1;
+		goto out;
+	}
+
+	i = 0;
+	list_for_each_entry(job, &ghost_dump_jobs, list) {
+		jobs[i++] = job;
+		total += ghost_data_size(&job->st);
+	}
+
+	qsort(jobs, nr, sizeof(*jobs), ghost_job_cmp);
+
+	next = mmap(NULL, sizeof(*next), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (next == MAP_FAILED) {
+		pr_perror("Can't map ghost files queue");
+		ret = -1;
+		goto out;
+	}
+	atomic_set(next, 0);
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_workers = DIV_ROUND_UP(total, GHOST_BYTES_PER_WORKER);
+	nr_workers = min(nr_workers, nr);
+	nr_workers = min_t(long, nr_workers, max(nr_cpus, 1L));
+	nr_workers = min(nr_workers, GHOST_MAX_WORKERS);
+
+	pr_info("Dumping %d ghost files (%lu bytes) with %d workers\n",
+			nr, total, nr_workers);
+
+	if (nr_workers == 1) {
+		ret = dump_ghost_part(jobs, nr, next);
+		goto out_unmap;
+	}
+
+	/*
+	 * Same as cr_system() does, the workers are waited for right
+	 * here and shouldn't get into the SIGCHLD handler.
+	 */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &blockmask, &oldmask) == -1) {
+		pr_perror("Can not set mask of blocked signals");
+		ret = -1;
+		goto out_unmap;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			pr_perror("Can't fork ghost files dumper");
+			ret = -1;
+			nr_workers = i;
+			break;
+		}
+
+		if (pids[i] == 0) {
+			ret = dump_ghost_part(jobs, nr, next);
+			exit(ret ? 1 : 0);
+		}
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		int status;
+
+		if (waitpid(pids[i], &status, 0) < 0) {
+			pr_perror("Can't wait ghost files dumper");
+			ret = -1;
+			continue;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			pr_err("Ghost files dumping finished with error %d\n", status);
+			ret = -1;
+		}
+	}
+
+	if (sigprocmask(SIG_SETMASK, &oldmask, NULL) == -1) {
+		pr_perror("Can not unset mask of blocked signals");
+		ret = -1;
+	}
+
+out_unmap:
+	munmap(next, sizeof(*next));
+out:
+	xfree(jobs);
+	list_for_each_entry_safe(job, t, &ghost_dump_jobs, list) {
+		list_del(&job->list);
+		close(job->fd);
+		xfree(job);
+	}
+	nr_ghost_dump_jobs = 0;
+	return ret;
+}
+
 void remap_put(struct file_remap *remap)
 {
 	mutex_lock(ghost_file_mutex);
@@ -12,7 +12,9 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <stdlib.h>
+#include <poll.h>
 
+#include "asm/bitops.h"
 #include "files.h"
 #include "file-ids.h"
 #include "files-reg.h"
@@ -159,6 +161,12 @@ out:
  *    the transport socket, then close the socket and dup() the
  *    received file descriptor into its place.
  *
+ * Files for fdinfo-s, whose master lives in another task, don't
+ * get a transport socket each. Instead every task binds a single
+ * one before the steps above, the masters collect the files per
+ * recipient and send them in batches at the end of each step, see
+ * the fd_batch code below.
+ *
  * There's the 4th step in the states[] array -- the post_open
  * one. This one is not about file-sharing resolving, but about
  * doing something with a file using it's 'desired' fd. The
@@ -674,6 +682,7 @@ static int collect_fd(int pid, FdinfoEntry *e, struct rst_info *rst_info)
 		return -1;
 
 	futex_init(&new_le->real_pid);
+	new_le->task_transport = &rst_info->fd_transport;
 	new_le->pid = pid;
 	new_le->fe = e;
 
@@ -868,6 +877,341 @@ static void transport_name_gen(struct sockaddr_un *addr, int *len,
 	*addr->sun_path = '\0';
 }
 
+/*
+ * Batched files transport.
+ *
+ * A message carries up to CR_SCM_MAX_FD files in SCM_RIGHTS and
+ * an array of fd_batch_ent-s telling where to put each of them.
+ */
+struct fd_batch_ent {
+	s32	fd;
+	u32	flags;
+};
+
+struct fd_batch {
+	struct hlist_node	hash;
+	int			pid;
+	futex_t			*ready;
+	int			nr;
+	int			fds[CR_SCM_MAX_FD];
+	struct fd_batch_ent	ents[CR_SCM_MAX_FD];
+};
+
+#define FD_BATCH_HASH_SIZE	64
+
+static struct hlist_head fd_batch_hash[FD_BATCH_HASH_SIZE];
+static int fd_batch_sk = -1;
+
+/* The fds we wait to receive, see prepare_fd_transport() */
+static unsigned long *fd_pending;
+static int fd_pending_max = -1;
+
+static void fd_transport_name(struct sockaddr_un *addr, int *len, int pid)
+{
+	addr->sun_family = AF_UNIX;
+	snprintf(addr->sun_path, UNIX_PATH_MAX, "x/crtools-fds-%d", pid);
+	*len = SUN_LEN(addr);
+	*addr->sun_path = '\0';
+}
+
+static inline bool fle_is_peer(int pid, struct fdinfo_list_entry *fle)
+{
+	return file_master(fle->desc)->pid != pid;
+}
+
+static int recv_fd_batch(int flags)
+{
+	struct fd_batch_ent ents[CR_SCM_MAX_FD];
+	char cbuf[CMSG_SPACE(sizeof(int) * CR_SCM_MAX_FD)];
+	struct iovec iov = { .iov_base = ents, .iov_len = sizeof(ents), };
+	struct msghdr h = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cbuf,
+		.msg_controllen	= sizeof(cbuf),
+	};
+	struct cmsghdr *cmsg;
+	int *fds, nr, i, ret;
+
+	ret = recvmsg(get_service_fd(FD_TRANSPORT_OFF), &h, flags);
+	if (ret < 0) {
+		if (errno == EAGAIN && (flags & MSG_DONTWAIT))
+			return 0;
+		pr_perror("Can't receive files batch");
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&h);
+	if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS || (h.msg_flags & MSG_CTRUNC)) {
+		pr_err("Bad files batch received\n");
+		return -1;
+	}
+
+	fds = (int *)CMSG_DATA(cmsg);
+	nr = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (ret != nr * sizeof(ents[0])) {
+		pr_err("Files batch header mismatch %d/%d\n", ret, nr);
+		return -1;
+	}
+
+	for (i = 0; i < nr; i++) {
+		int fd = ents[i].fd;
+
+		if (fd > fd_pending_max || !test_bit(fd, fd_pending)) {
+			pr_err("Unexpected file for fd %d\n", fd);
+			return -1;
+		}
+
+		close(fd);
+		if (reopen_fd_as(fd, fds[i]) < 0)
+			return -1;
+
+		if (fcntl(fd, F_SETFD, ents[i].flags) == -1) {
+			pr_perror("Unable to set file descriptor flags");
+			return -1;
+		}
+
+		clear_bit(fd, fd_pending);
+	}
+
+	pr_info("\t\tReceived %d files\n", nr);
+	return nr;
+}
+
+/*
+ * Reserve the places for the files from other tasks with the
+ * transport socket duplicates. This is done for all the lists
+ * at once, so that a batch can be received at any step.
+ */
+static int prepare_fd_transport(struct pstree_item *me)
+{
+	struct list_head *lists[] = {
+		&rsti(me)->fds, &rsti(me)->tty_slaves,
+		&rsti(me)->eventpoll, &rsti(me)->tty_ctty,
+	};
+	struct fdinfo_list_entry *fle;
+	struct sockaddr_un saddr;
+	int i, sk, tsk, len;
+
+	for (i = 0; i < ARRAY_SIZE(lists); i++)
+		list_for_each_entry(fle, lists[i], ps_list)
+			if (fle_is_peer(me->pid.virt, fle))
+				fd_pending_max = max_t(int, fd_pending_max, fle->fe->fd);
+
+	if (fd_pending_max < 0)
+		return 0;
+
+	fd_pending = xzalloc(BITS_TO_LONGS(fd_pending_max + 1) * sizeof(long));
+	if (!fd_pending)
+		return -1;
+
+	sk = socket(PF_UNIX, SOCK_DGRAM, 0);
+	if (sk < 0) {
+		pr_perror("Can't create socket");
+		return -1;
+	}
+
+	fd_transport_name(&saddr, &len, getpid());
+	pr_info("\tCreate files transport %s\n", saddr.sun_path + 1);
+	if (bind(sk, (struct sockaddr *)&saddr, len) < 0) {
+		pr_perror("Can't bind unix socket %s", saddr.sun_path + 1);
+		close(sk);
+		return -1;
+	}
+
+	tsk = install_service_fd(FD_TRANSPORT_OFF, sk);
+	close(sk);
+	if (tsk < 0)
+		return -1;
+
+	for (i = 0; i < ARRAY_SIZE(lists); i++)
+		list_for_each_entry(fle, lists[i], ps_list) {
+			if (!fle_is_peer(me->pid.virt, fle))
+				continue;
+
+			sk = dup(tsk);
+			if (sk < 0) {
+				pr_perror("Can't dup transport socket");
+				return -1;
+			}
+
+			if (reopen_fd_as(fle->fe->fd, sk) < 0)
+				return -1;
+
+			set_bit(fle->fe->fd, fd_pending);
+		}
+
+	want_recv_stage();
+	futex_set_and_wake(&rsti(me)->fd_transport, getpid());
+	return 0;
+}
+
+static void fini_fd_transport(void)
+{
+	struct fd_batch *b;
+	struct hlist_node *n;
+	int i;
+
+	for (i = 0; i < FD_BATCH_HASH_SIZE; i++)
+		hlist_for_each_entry_safe(b, n, &fd_batch_hash[i], hash) {
+			hlist_del(&b->hash);
+			xfree(b);
+		}
+
+	close_safe(&fd_batch_sk);
+	close_service_fd(FD_TRANSPORT_OFF);
+	xfree(fd_pending);
+	fd_pending = NULL;
+	fd_pending_max = -1;
+}
+
+/*
+ * The sending socket is connected to the recipient, so POLLOUT on it
+ * waits for room in the recipient's queue. The recipient may be some
+ * master sending files to us, so our own queue is drained meanwhile.
+ */
+static int send_fd_batch(struct msghdr *h)
+{
+	struct pollfd pfd[2];
+	int ret, nr = 1;
+
+	pfd[0].fd = fd_batch_sk;
+	pfd[0].events = POLLOUT;
+	pfd[1].fd = get_service_fd(FD_TRANSPORT_OFF);
+	pfd[1].events = POLLIN;
+	if (pfd[1].fd >= 0)
+		nr = 2;
+
+	while (sendmsg(fd_batch_sk, h, MSG_DONTWAIT) < 0) {
+		if (errno != EAGAIN) {
+			pr_perror("Can't send files batch");
+			return -1;
+		}
+
+		if (poll(pfd, nr, -1) < 0 && errno != EINTR) {
+			pr_perror("Can't wait for files transport");
+			return -1;
+		}
+
+		if (nr == 2 && (pfd[1].revents & POLLIN)) {
+			while ((ret = recv_fd_batch(MSG_DONTWAIT)) > 0)
+				;
+			if (ret < 0)
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int flush_fd_batch(struct fd_batch *b)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * CR_SCM_MAX_FD)];
+	struct iovec iov = {
+		.iov_base	= b->ents,
+		.iov_len	= b->nr * sizeof(b->ents[0]),
+	};
+	struct sockaddr_un saddr;
+	struct msghdr h = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+		.msg_control	= cbuf,
+		.msg_controllen	= CMSG_SPACE(sizeof(int) * b->nr),
+	};
+	struct cmsghdr *cmsg;
+	int len;
+
+	if (!b->nr)
+		return 0;
+
+	if (fd_batch_sk < 0) {
+		fd_batch_sk = socket(PF_UNIX, SOCK_DGRAM, 0);
+		if (fd_batch_sk < 0) {
+			pr_perror("Can't create socket");
+			return -1;
+		}
+	}
+
+	pr_info("\t\tWait files transport of %d\n", b->pid);
+	futex_wait_while(b->ready, 0);
+	fd_transport_name(&saddr, &len, futex_get(b->ready));
+	if (connect(fd_batch_sk, (struct sockaddr *)&saddr, len) < 0) {
+		pr_perror("Can't connect to %s", saddr.sun_path + 1);
+		return -1;
+	}
+
+	cmsg = CMSG_FIRSTHDR(&h);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * b->nr);
+	memcpy(CMSG_DATA(cmsg), b->fds, sizeof(int) * b->nr);
+
+	pr_info("\t\tSend %d files to %s\n", b->nr, saddr.sun_path + 1);
+	if (send_fd_batch(&h))
+		return -1;
+
+	b->nr = 0;
+	return 0;
+}
+
+/*
+ * The sending socket is closed right after the flush, so that it
+ * doesn't occupy any fd the task's files are to be put into.
+ */
+static int flush_fd_batches(void)
+{
+	struct fd_batch *b;
+	int i, ret = 0;
+
+	for (i = 0; i < FD_BATCH_HASH_SIZE && !ret; i++)
+		hlist_for_each_entry(b, &fd_batch_hash[i], hash) {
+			ret = flush_fd_batch(b);
+			if (ret)
+				break;
+		}
+
+	close_safe(&fd_batch_sk);
+	return ret;
+}
+
+/*
+ * The @fd stays in its place till the end of the current
+ * step, so it's only remembered here and sent in a batch.
+ */
+static int queue_fd_to_peer(int fd, struct fdinfo_list_entry *fle)
+{
+	struct hlist_head *chain;
+	struct fd_batch *b;
+
+	chain = &fd_batch_hash[fle->pid % FD_BATCH_HASH_SIZE];
+	hlist_for_each_entry(b, chain, hash)
+		if (b->pid == fle->pid)
+			goto found;
+
+	b = xmalloc(sizeof(*b));
+	if (!b)
+		return -1;
+
+	b->pid = fle->pid;
+	b->ready = fle->task_transport;
+	b->nr = 0;
+	hlist_add_head(&b->hash, chain);
+found:
+	pr_info("\t\tQueue fd %d to %d:%d\n", fd, fle->pid, fle->fe->fd);
+	b->fds[b->nr] = fd;
+	b->ents[b->nr].fd = fle->fe->fd;
+	b->ents[b->nr].flags = fle->fe->flags;
+	if (++b->nr == CR_SCM_MAX_FD) {
+		int ret;
+
+		ret = flush_fd_batch(b);
+		close_safe(&fd_batch_sk);
+		return ret;
+	}
+
+	return 0;
+}
+
 static int should_open_transport(FdinfoEntry *fe, struct file_desc *fd)
 {
 	if (fd->ops->want_transport)
@@ -885,20 +1229,22 @@ static int open_transport_fd(int pid, struct fdinfo_list_entry *fle)
 
 	flem = file_master(fle->desc);
 
-	if (flem->pid == pid) {
-		if (flem->fe->fd != fle->fe->fd)
-			/* dup-ed file. Will be opened in the open_fd */
-			return 0;
+	if (flem->pid != pid)
+		/* reserved by prepare_fd_transport() */
+		return 0;
 
-		if (!should_open_transport(fle->fe, fle->desc))
-			/* pure master file */
-			return 0;
+	if (flem->fe->fd != fle->fe->fd)
+		/* dup-ed file. Will be opened in the open_fd */
+		return 0;
 
-		/*
-		 * some master file, that wants a transport, e.g.
-		 * a pipe or unix socket pair 'slave' end
-		 */
-	}
+	if (!should_open_transport(fle->fe, fle->desc))
+		/* pure master file */
+		return 0;
+
+	/*
+	 * some master file, that wants a transport, e.g.
+	 * a pipe or unix socket pair 'slave' end
+	 */
 
 	transport_name_gen(&saddr, &sun_len, getpid(), fle->fe->fd);
 
@@ -943,7 +1289,7 @@ int send_fd_to_peer(int fd, struct fdinfo_list_entry *fle, int sock)
 	return send_fd(sock, &saddr, len, fd);
 }
 
-static int send_fd_to_self(int fd, struct fdinfo_list_entry *fle, int *sock)
+static int send_fd_to_self(int fd, struct fdinfo_list_entry *fle)
 {
 	int dfd = fle->fe->fd;
 
@@ -955,9 +1301,6 @@ static int send_fd_to_self(int fd, struct fdinfo_list_entry *fle, int *sock)
 		return -1;
 
 	pr_info("\t\t\tGoing to dup %d into %d\n", fd, dfd);
-	if (move_fd_from(sock, dfd))
-		return -1;
-
 	if (dup2(fd, dfd) != dfd) {
 		pr_perror("Can't dup local fd %d -> %d", fd, dfd);
 		return -1;
@@ -990,33 +1333,24 @@ static int post_open_fd(int pid, struct fdinfo_list_entry *fle)
 
 static int serve_out_fd(int pid, int fd, struct file_desc *d)
 {
-	int sock, ret;
+	int ret;
 	struct fdinfo_list_entry *fle;
 
-	sock = socket(PF_UNIX, SOCK_DGRAM, 0);
-	if (sock < 0) {
-		pr_perror("Can't create socket");
-		return -1;
-	}
-
 	pr_info("\t\tCreate fd for %d\n", fd);
 
 	list_for_each_entry(fle, &d->fd_info_head, desc_list) {
 		if (pid == fle->pid)
-			ret = send_fd_to_self(fd, fle, &sock);
+			ret = send_fd_to_self(fd, fle);
 		else
-			ret = send_fd_to_peer(fd, fle, sock);
+			ret = queue_fd_to_peer(fd, fle);
 
 		if (ret) {
 			pr_err("Can't sent fd %d to %d\n", fd, fle->pid);
-			goto out;
+			return -1;
 		}
 	}
 
-	ret = 0;
-out:
-	close(sock);
-	return ret;
+	return 0;
 }
 
 static int open_fd(int pid, struct fdinfo_list_entry *fle)
@@ -1047,29 +1381,15 @@ static int open_fd(int pid, struct fdinfo_list_entry *fle)
 
 static int receive_fd(int pid, struct fdinfo_list_entry *fle)
 {
-	int tmp;
-	struct fdinfo_list_entry *flem;
-
-	flem = file_master(fle->desc);
-	if (flem->pid == pid)
+	if (!fle_is_peer(pid, fle))
 		return 0;
 
 	pr_info("\tReceive fd for %d\n", fle->fe->fd);
 
-	tmp = recv_fd(fle->fe->fd);
-	if (tmp < 0) {
-		pr_err("Can't get fd %d\n", tmp);
-		return -1;
-	}
-	close(fle->fe->fd);
-
-	if (reopen_fd_as(fle->fe->fd, tmp) < 0)
-		return -1;
-
-	if (fcntl(fle->fe->fd, F_SETFD, fle->fe->flags) == -1) {
-		pr_perror("Unable to set file descriptor flags");
-		return -1;
-	}
+	/* The batch may bring files for other fds as well */
+	while (test_bit(fle->fe->fd, fd_pending))
+		if (recv_fd_batch(0) < 0)
+			return -1;
 
 	return 0;
 }
@@ -1162,6 +1482,10 @@ int prepare_fds(struct pstree_item *me)
 		}
 	}
 
+	ret = prepare_fd_transport(me);
+	if (ret)
+		goto out_w;
+
 	for (state = 0; state < ARRAY_SIZE(states); state++) {
 		if (!states[state].required) {
 			pr_debug("Skipping %s fd stage\n", states[state].name);
@@ -1188,6 +1512,10 @@ int prepare_fds(struct pstree_item *me)
 		ret = open_fdinfos(me->pid.virt, &rsti(me)->eventpoll, state);
 		if (ret)
 			break;
+
+		ret = flush_fd_batches();
+		if (ret)
+			break;
 	}
 
 	if (ret)
@@ -1206,8 +1534,13 @@ int prepare_fds(struct pstree_item *me)
 		ret = open_fdinfos(me->pid.virt, &rsti(me)->tty_ctty, state);
 		if (ret)
 			break;
+
+		ret = flush_fd_batches();
+		if (ret)
+			break;
 	}
 out_w:
+	fini_fd_transport();
 	if (rsti(me)->fdt)
 		futex_inc_and_wake(&rsti(me)->fdt->fdt_lock);
 out:
@@ -453,6 +453,23 @@ void up_page_ids_base(void)
 	page_ids += 0x10000;
 }
 
+/*
+ * Pages images may be opened by forked writers, so the parent
+ * reserves ids for them and each writer sets the one it uses.
+ */
+unsigned long reserve_page_ids(unsigned long nr)
+{
+	unsigned long id = page_ids;
+
+	page_ids += nr;
+	return id;
+}
+
+void set_page_ids(unsigned long id)
+{
+	page_ids = id;
+}
+
 struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi)
 {
 	unsigned id;
@@ -46,6 +46,10 @@ struct cgroup_dir {
 	/* more cgroup_dirs */
 	struct list_head	children;
 	unsigned int		n_children;
+
+	/* path index of the controller's dirs, see find_dir() */
+	struct hlist_node	hash;
+	struct cg_controller	*controller;
 };
 
 /* This describes a particular cgroup controller, e.g. blkio or cpuset.
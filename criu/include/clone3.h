@@ -0,0 +1,23 @@
+#ifndef __CR_CLONE3_H__
+#define __CR_CLONE3_H__
+
+#include "asm/int.h"
+
+/*
+ * The struct clone_args from linux/sched.h up to set_tid_size,
+ * system headers may be too old to have it.
+ */
+struct cr_clone_args {
+	u64	flags;
+	u64	pidfd;
+	u64	child_tid;
+	u64	parent_tid;
+	u64	exit_signal;
+	u64	stack;
+	u64	stack_size;
+	u64	tls;
+	u64	set_tid;
+	u64	set_tid_size;
+};
+
+#endif /* __CR_CLONE3_H__ */
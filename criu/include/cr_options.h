@@ -104,6 +104,7 @@ struct cr_options {
 	bool			aufs;		/* auto-deteced, not via cli */
 	bool			overlayfs;
 	size_t			ghost_limit;
+	size_t			pre_dump_mem_limit;
 	struct list_head	irmap_scan_paths;
 	bool			lsm_supplied;
 	char			*lsm_profile;
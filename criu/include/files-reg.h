@@ -57,5 +57,6 @@ extern int strip_deleted(struct fd_link *link);
 
 extern int prepare_procfs_remaps(void);
 extern int dead_pid_conflict(void);
+extern int dump_ghost_files(void);
 
 #endif /* __CR_FILES_REG_H__ */
@@ -71,6 +71,7 @@ struct fdinfo_list_entry {
 	struct list_head	used_list;	/* To chain per-task used fds */
 	int			pid;
 	futex_t			real_pid;
+	futex_t			*task_transport; /* rst_info->fd_transport of @pid */
 	FdinfoEntry		*fe;
 };
 
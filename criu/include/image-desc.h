@@ -50,6 +50,7 @@ enum {
 
 	CR_FD_PSTREE,
 	CR_FD_SHMEM_PAGEMAP,
+	CR_FD_SYSVSHM_PAGEMAP,
 	CR_FD_GHOST_FILE,
 	CR_FD_TCP_STREAM,
 	CR_FD_FDINFO,
@@ -85,6 +86,8 @@ enum {
 
 	CR_FD_TMPFS_IMG,
 	CR_FD_TMPFS_DEV,
+	CR_FD_TMPFS_FILES,
+	CR_FD_TMPFS_DATA,
 	CR_FD_BINFMT_MISC,
 	CR_FD_PAGES,
 
@@ -152,6 +152,8 @@ extern int open_image_lazy(struct cr_img *img);
 extern struct cr_img *open_pages_image(unsigned long flags, struct cr_img *pmi);
 extern struct cr_img *open_pages_image_at(int dfd, unsigned long flags, struct cr_img *pmi);
 extern void up_page_ids_base(void);
+extern unsigned long reserve_page_ids(unsigned long nr);
+extern void set_page_ids(unsigned long id);
 
 extern struct cr_img *img_from_fd(int fd); /* for cr-show mostly */
 
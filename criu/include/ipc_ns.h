@@ -1,6 +1,12 @@
 #ifndef __CR_IPC_NS_H__
 #define __CR_IPC_NS_H__
 
+/*
+ * Each SysV shm segment gets its own pages image, so the forked
+ * dumper of an IPC namespace takes this many page ids (IPCMNI).
+ */
+#define IPC_NS_PAGE_IDS		32768
+
 extern int dump_ipc_ns(int ns_id);
 extern int prepare_ipc_ns(int pid);
 
@@ -35,6 +35,7 @@ struct kerndat_s {
 	bool has_loginuid;
 	enum pagemap_func pmap;
 	unsigned int has_xtlocks;
+	bool has_clone3_set_tid;
 };
 
 extern struct kerndat_s kdat;
@@ -72,6 +72,12 @@ static inline void futex_set(futex_t *f, u32 v)
 		}						\
 	} while (0)
 
+/* Wake up all waiters of futex @f */
+static inline void futex_wake(futex_t *f)
+{
+	BUG_ON(sys_futex((u32 *)&f->raw.counter, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) < 0);
+}
+
 /* Set futex @f to @v and wake up all waiters */
 static inline void futex_set_and_wake(futex_t *f, u32 v)
 {
@@ -93,6 +99,27 @@ static inline void futex_dec_and_wake(futex_t *f)
 	BUG_ON(sys_futex((u32 *)&f->raw.counter, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) < 0);
 }
 
+/*
+ * Decrement and wake up the waiters only when the counter drops to zero.
+ * An aborted futex is left as is, its waiters were already woken up.
+ * Returns the new value of the counter.
+ */
+static inline u32 futex_dec_and_wake_last(futex_t *f)
+{
+	int old, new;
+
+	do {
+		old = atomic_read(&f->raw);
+		if ((u32)old & FUTEX_ABORT_FLAG)
+			return old;
+		new = old - 1;
+	} while (atomic_cmpxchg(&f->raw, old, new) != old);
+
+	if (new == 0)
+		futex_wake(f);
+	return new;
+}
+
 /* Increment futex @f value and wake up all waiters */
 static inline void futex_inc_and_wake(futex_t *f)
 {
@@ -29,4 +29,5 @@ int open_vmas(struct pstree_item *t);
 int prepare_vmas(struct pstree_item *t, struct task_restore_args *ta);
 int unmap_guard_pages(struct pstree_item *t);
 int prepare_mappings(struct pstree_item *t);
+int restore_deferred_vma_content(struct pstree_item *t);
 #endif /* __CR_MEM_H__ */
@@ -8,6 +8,11 @@ extern int nf_unlock_connection(struct inet_sk_desc *);
 struct inet_sk_info;
 extern int nf_unlock_connection_info(struct inet_sk_info *);
 
+struct list_head;
+extern int nf_lock_connections(struct list_head *);
+extern int nf_unlock_connections(struct list_head *);
+extern int nf_unlock_connections_info(struct list_head *);
+
 extern void preload_netfilter_modules(void);
 
 #endif /* __CR_NETFILTER_H__ */
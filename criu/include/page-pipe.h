@@ -93,6 +93,10 @@ struct page_pipe {
 
 	bool chunk_mode;	/* Restrict the maximum buffer size of pipes
 				   and dump memory for a few iterations */
+
+	unsigned long nr_pages;	/* how many pages are in bufs */
+	unsigned long max_pages;	/* stop adding pages when there are
+					   that many in bufs (0 -- no limit) */
 };
 
 extern struct page_pipe *create_page_pipe(unsigned int nr,
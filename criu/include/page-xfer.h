@@ -33,6 +33,13 @@ struct page_xfer {
 	};
 
 	struct page_read *parent;
+
+	/*
+	 * SysV shm segments mostly have no parent pages, so their
+	 * parent is only opened when the first hole is written.
+	 */
+	bool lazy_parent;
+	long id;
 };
 
 extern int open_page_xfer(struct page_xfer *xfer, int fd_type, long id);
@@ -52,6 +52,8 @@ struct page_read {
 	void (*put_pagemap)(struct page_read *);
 	void (*close)(struct page_read *);
 	int (*seek_page)(struct page_read *pr, unsigned long vaddr, bool warn);
+	/* skips len bytes of the current pagemap */
+	void (*skip_pages)(struct page_read *, unsigned long len);
 
 	/* Private data of reader */
 	struct cr_img *pmi;
@@ -76,6 +78,7 @@ struct page_read {
 
 #define PR_SHMEM	0x1
 #define PR_TASK		0x2
+#define PR_SYSVSHM	0x3
 
 #define PR_TYPE_MASK	0x3
 #define PR_MOD		0x4	/* Will need to modify */
@@ -1,6 +1,8 @@
 #ifndef __CR_PARASITE_SYSCALL_H__
 #define __CR_PARASITE_SYSCALL_H__
 
+#include <sys/types.h>
+
 #include "asm/types.h"
 #include "pid.h"
 #include "list.h"
@@ -55,6 +57,14 @@ struct parasite_ctl {
 
 	struct list_head	pre_list;
 	struct page_pipe	*mem_pp;
+
+	struct list_head	cure_list;				/* see parasite_cure_remote_batch() */
+	bool			unmapping;
+
+	bool			keep;					/* leave the blob mapped on cure */
+	dev_t			keep_dev;
+	ino_t			keep_ino;
+
 };
 
 extern int parasite_dump_sigacts_seized(struct parasite_ctl *ctl, struct cr_imgset *cr_imgset);
@@ -96,12 +106,16 @@ extern int parasite_drain_fds_seized(struct parasite_ctl *ctl,
 extern int parasite_get_proc_fd_seized(struct parasite_ctl *ctl);
 
 extern int parasite_cure_remote(struct parasite_ctl *ctl);
+extern int parasite_stop_daemons(struct list_head *ctls);
+extern int parasite_cure_remote_batch(struct list_head *ctls);
 extern int parasite_cure_local(struct parasite_ctl *ctl);
 extern int parasite_cure_seized(struct parasite_ctl *ctl);
 extern struct parasite_ctl *parasite_infect_seized(pid_t pid,
 						   struct pstree_item *item,
 						   struct vm_area_list *vma_area_list);
 extern void parasite_ensure_args_size(unsigned long sz);
+extern int parasite_keep_init(void);
+extern int parasite_drop_kept(bool in_tree);
 extern struct parasite_ctl *parasite_prep_ctl(pid_t pid,
 					      struct vm_area_list *vma_area_list);
 extern int parasite_map_exchange(struct parasite_ctl *ctl, unsigned long size);
@@ -15,6 +15,7 @@ extern int do_pb_read_one(struct cr_img *, void **objp, int type, bool eof);
 #define pb_read_one_eof(fd, objp, type) do_pb_read_one(fd, (void **)objp, type, true)
 
 extern int pb_write_one(struct cr_img *, void *obj, int type);
+extern int pb_pack_one(void *obj, int type, void *buf, int len);
 
 #define pb_pksize(__obj, __proto_message_name)						\
 	(__proto_message_name ##__get_packed_size(__obj) + sizeof(u32))
@@ -36,8 +36,10 @@ static inline struct rst_info *rsti(struct pstree_item *i)
 }
 
 struct ns_id;
+struct parasite_ctl;
 struct dmp_info {
 	struct ns_id *netns;
+	struct parasite_ctl *parasite_ctl;	/* until threads are dumped */
 	/*
 	 * We keep the creds here so that we can compare creds while seizing
 	 * threads. Dumping tasks with different creds is not supported.
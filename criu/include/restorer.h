@@ -211,11 +211,47 @@ enum {
 	CR_STATE_COMPLETE
 };
 
-#define restore_finish_stage(__stage) ({				\
-		futex_dec_and_wake(&task_entries->nr_in_progress);	\
-		futex_wait_while(&task_entries->start, __stage);	\
-		(s32) futex_get(&task_entries->start);			\
-	})
+/*
+ * The last task to finish the stage wakes criu up. Then waiters
+ * sleep in groups, the group is picked by the arrival order. When
+ * the next stage starts criu sets the stage in all the groups, but
+ * wakes up the first one only, and the first awoken task in each
+ * group wakes up two more groups.
+ *
+ * When all the tasks have reached the barrier, groups from 0 to
+ * min(nr, NR_STAGE_WAITERS) - 1 are not empty, so the tree is
+ * complete. On failures criu wakes up all the groups itself.
+ */
+static inline void stage_wake_children(struct task_entries *te, int i, s32 stage)
+{
+	struct stage_waiters *w = &te->waiters[i];
+	int c, woken;
+
+	woken = atomic_read(&w->woken);
+	if (woken == stage || atomic_cmpxchg(&w->woken, woken, stage) != woken)
+		return;
+
+	for (c = 2 * i + 1; c <= 2 * i + 2 && c < NR_STAGE_WAITERS; c++)
+		futex_wake(&te->waiters[c].start);
+}
+
+static inline s32 __restore_finish_stage(struct task_entries *te, s32 stage)
+{
+	struct stage_waiters *w;
+	s32 next;
+	int i;
+
+	i = futex_dec_and_wake_last(&te->nr_in_progress) % NR_STAGE_WAITERS;
+	w = &te->waiters[i];
+
+	futex_wait_while(&w->start, stage);
+	next = (s32) futex_get(&w->start);
+	stage_wake_children(te, i, next);
+
+	return next;
+}
+
+#define restore_finish_stage(__stage)	__restore_finish_stage(task_entries, __stage)
 
 
 /* the restorer_blob_offset__ prefix is added by gen_offsets.sh */
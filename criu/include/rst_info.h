@@ -5,10 +5,24 @@
 #include "list.h"
 #include "vma.h"
 
+/*
+ * Tasks waiting for the next restore stage are spread over
+ * several futexes, which are woken up as a binary tree, see
+ * restore_finish_stage(). This way criu doesn't wake up all
+ * the tasks and threads itself on every stage switch.
+ */
+#define NR_STAGE_WAITERS	16
+
+struct stage_waiters {
+	futex_t		start;
+	atomic_t	woken;	/* the stage this group woke its children for */
+};
+
 struct task_entries {
 	int nr_threads, nr_tasks, nr_helpers;
 	futex_t nr_in_progress;
 	futex_t start;
+	struct stage_waiters waiters[NR_STAGE_WAITERS];
 	atomic_t cr_err;
 	mutex_t userns_sync_lock;
 };
@@ -40,6 +54,7 @@ struct rst_info {
 
 	int service_fd_id;
 	struct fdt		*fdt;
+	futex_t			fd_transport;	/* real pid, once files can be sent to us */
 
 	struct vm_area_list	vmas;
 	struct _MmEntry		*mm;
@@ -19,6 +19,7 @@ enum sfd_type {
 	CGROUP_YARD,
 	USERNSD_SK,	/* Socket for usernsd */
 	NS_FD_OFF,	/* Node's net namespace fd */
+	FD_TRANSPORT_OFF, /* Socket to receive files from other tasks */
 
 	SERVICE_FD_MAX
 };
@@ -1,6 +1,7 @@
 #ifndef __CR_SHMEM_H__
 #define __CR_SHMEM_H__
 
+#include "asm/types.h"
 #include "lock.h"
 #include "images/vma.pb-c.h"
 
@@ -12,6 +13,9 @@ extern int collect_sysv_shmem(unsigned long shmid, unsigned long size);
 extern int cr_dump_shmem(void);
 extern int add_shmem_area(pid_t pid, VmaEntry *vma);
 extern int fixup_sysv_shmems(void);
+extern int dump_sysv_shmem(void *addr, unsigned long size, unsigned long shmid,
+			   u64 *csums, const u64 *pcsums, unsigned long nr_pcsums);
+extern int restore_sysv_shmem_content(void *addr, unsigned long size, unsigned long shmid);
 
 #define SYSV_SHMEM_SKIP_FD	(0x7fffffff)
 
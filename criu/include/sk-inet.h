@@ -51,6 +51,8 @@ struct inet_sk_info {
 
 extern int inet_bind(int sk, struct inet_sk_info *);
 extern int inet_connect(int sk, struct inet_sk_info *);
+extern void inet_port_lock(struct inet_sk_info *);
+extern void inet_port_unlock(struct inet_sk_info *);
 
 #ifdef CR_NOGLIBC
 #define setsockopt	sys_setsockopt
@@ -66,9 +68,11 @@ static inline void tcp_repair_off(int fd)
 
 extern void tcp_locked_conn_add(struct inet_sk_info *);
 extern void rst_unlock_tcp_connections(void);
+extern int cpt_lock_tcp_connections(void);
 extern void cpt_unlock_tcp_connections(void);
 
 extern int dump_one_tcp(int sk, struct inet_sk_desc *sd);
+extern int dump_tcp_conns(void);
 extern int restore_one_tcp(int sk, struct inet_sk_info *si);
 
 #define SK_EST_PARAM	"tcp-established"
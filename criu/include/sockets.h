@@ -20,7 +20,6 @@ struct cr_img;
 struct socket_desc {
 	unsigned int		family;
 	unsigned int		ino;
-	struct socket_desc	*next;
 	int			already_dumped;
 };
 
@@ -34,6 +33,7 @@ extern void preload_socket_modules();
 extern bool socket_test_collect_bit(unsigned int family, unsigned int proto);
 
 extern int sk_collect_one(unsigned ino, int family, struct socket_desc *d);
+extern unsigned long sk_collected_nr(void);
 struct ns_id;
 extern int collect_sockets(struct ns_id *);
 extern int collect_inet_sockets(void);
@@ -1,12 +1,21 @@
 #ifndef __CR_STATS_H__
 #define __CR_STATS_H__
 
+#include "asm/types.h"
+
 enum {
 	TIME_FREEZING,
 	TIME_FROZEN,
 	TIME_MEMDUMP,
 	TIME_MEMWRITE,
 	TIME_IRMAP_RESOLVE,
+	TIME_TCP_CONNS,
+	TIME_PROC_PARSE,
+	TIME_FILES_DUMP,
+	TIME_SOCKETS_COLLECT,
+	TIME_MNT_DUMP,
+	TIME_NS_DUMP,
+	TIME_PAGE_SERVER,
 
 	DUMP_TIME_NR_STATS,
 };
@@ -14,6 +23,13 @@ enum {
 enum {
 	TIME_FORK,
 	TIME_RESTORE,
+	TIME_NS_RESTORE,
+	TIME_MNT_RESTORE,
+	TIME_STAGE_RESTORE_NS,
+	TIME_STAGE_FORKING,
+	TIME_STAGE_RESTORE,
+	TIME_STAGE_RESTORE_SIGCHLD,
+	TIME_STAGE_RESTORE_CREDS,
 
 	RESTORE_TIME_NS_STATS,
 };
@@ -21,10 +37,21 @@ enum {
 extern void timing_start(int t);
 extern void timing_stop(int t);
 
+struct timeval;
+extern unsigned long usec_since(const struct timeval *from);
+
 enum {
 	CNT_PAGES_SCANNED,
 	CNT_PAGES_SKIPPED_PARENT,
 	CNT_PAGES_WRITTEN,
+	CNT_TCP_CONNS,
+	CNT_TCP_CONNS_USEC,
+	CNT_SOCKETS_COLLECTED,
+	CNT_SOCKET_LOOKUPS,
+	CNT_SOCKET_LOOKUP_PROBES,
+	CNT_PAGE_SERVER_BYTES,
+	CNT_NS_DUMPED,
+	CNT_NS_DUMP_USEC,
 
 	DUMP_CNT_NR_STATS,
 };
@@ -33,6 +60,9 @@ enum {
 	CNT_PAGES_COMPARED,
 	CNT_PAGES_SKIPPED_COW,
 	CNT_PAGES_RESTORED,
+	CNT_TCP_CONNS_RESTORED,
+	CNT_TCP_CONNS_RESTORE_USEC,
+	CNT_FILES_RESTORE_USEC,
 
 	RESTORE_CNT_NR_STATS,
 };
@@ -45,4 +75,17 @@ extern void cnt_add(int c, unsigned long val);
 extern int init_stats(int what);
 extern void write_stats(int what);
 
+/*
+ * Flat name/value view of the collected stats, timings
+ * are reported in microseconds. Used to ship stats over RPC.
+ */
+struct stats_value {
+	const char	*name;
+	u64		val;
+};
+
+#define STATS_MAX_VALUES	(DUMP_TIME_NR_STATS + DUMP_CNT_NR_STATS)
+
+extern int get_stats(int what, struct stats_value *vals);
+
 #endif /* __CR_STATS_H__ */
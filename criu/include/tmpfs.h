@@ -0,0 +1,7 @@
+#ifndef __CR_TMPFS_H__
+#define __CR_TMPFS_H__
+
+extern int tmpfs_dump_files(int root_fd, unsigned int id);
+extern int tmpfs_restore_files(const char *mountpoint, unsigned int id);
+
+#endif /* __CR_TMPFS_H__ */
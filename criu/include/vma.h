@@ -64,6 +64,7 @@ struct vma_area {
 			unsigned long	*page_bitmap;	/* existent pages */
 			unsigned long	*ppage_bitmap;	/* parent's existent pages */
 			unsigned long	premmaped_addr;	/* restore only */
+			bool		defer_content;	/* not needed for forking */
 		};
 	};
 };
@@ -15,6 +15,7 @@
 #include "sysctl.h"
 #include "ipc_ns.h"
 #include "shmem.h"
+#include "servicefd.h"
 
 #include "protobuf.h"
 #include "images/ipc-var.pb-c.h"
@@ -326,29 +327,123 @@ static int ipc_sysctl_req(IpcVarEntry *e, int op)
 }
 
 /*
- * TODO: Function below should be later improved to locate and dump only dirty
- * pages via updated sys_mincore().
+ * Segments from the parent images. Pages that have the same
+ * checksums as there are dumped as holes in the parent.
  */
-static int dump_ipc_shm_pages(struct cr_img *img, const IpcShmEntry *shm)
+static IpcShmEntry **parent_shms;
+static int nr_parent_shms;
+
+static int collect_parent_shms(int ns_id)
+{
+	struct cr_img *img;
+	int pfd, ret;
+
+	if (!opts.track_mem || !opts.img_parent)
+		return 0;
+
+	pfd = openat(get_service_fd(IMG_FD_OFF), CR_PARENT_LINK, O_RDONLY);
+	if (pfd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		pr_perror("Can't open parent images");
+		return -1;
+	}
+
+	img = open_image_at(pfd, CR_FD_IPCNS_SHM, O_RSTR, ns_id);
+	close(pfd);
+	if (!img)
+		return -1;
+
+	while (1) {
+		IpcShmEntry *shm, **n;
+
+		ret = pb_read_one_eof(img, &shm, PB_IPC_SHM);
+		if (ret <= 0)
+			break;
+
+		/* Contents of old images are inline and can't be referred to */
+		if (!shm->in_pagemaps) {
+			ipc_shm_entry__free_unpacked(shm, NULL);
+			break;
+		}
+
+		n = xrealloc(parent_shms, (nr_parent_shms + 1) * sizeof(*n));
+		if (!n) {
+			ipc_shm_entry__free_unpacked(shm, NULL);
+			ret = -1;
+			break;
+		}
+
+		parent_shms = n;
+		parent_shms[nr_parent_shms++] = shm;
+	}
+
+	close_image(img);
+	return ret;
+}
+
+static void free_parent_shms(void)
+{
+	int i;
+
+	for (i = 0; i < nr_parent_shms; i++)
+		ipc_shm_entry__free_unpacked(parent_shms[i], NULL);
+	xfree(parent_shms);
+	parent_shms = NULL;
+	nr_parent_shms = 0;
+}
+
+static IpcShmEntry *find_parent_shm(const IpcShmEntry *shm)
 {
+	int i;
+
+	for (i = 0; i < nr_parent_shms; i++)
+		if (parent_shms[i]->desc->id == shm->desc->id)
+			return parent_shms[i];
+
+	return NULL;
+}
+
+/*
+ * Contents go to pagemap images, so that non-resident pages are
+ * skipped and, with memory tracking, unchanged ones are taken from
+ * the parent images.
+ */
+static int dump_ipc_shm_pages(IpcShmEntry *shm)
+{
+	IpcShmEntry *pshm = NULL;
 	void *data;
 	int ret;
 
+	if (opts.track_mem) {
+		shm->n_page_csums = DIV_ROUND_UP(shm->size, PAGE_SIZE);
+		shm->page_csums = xzalloc(shm->n_page_csums * sizeof(*shm->page_csums));
+		if (!shm->page_csums)
+			return -1;
+
+		pshm = find_parent_shm(shm);
+	}
+
 	data = shmat(shm->desc->id, NULL, SHM_RDONLY);
 	if (data == (void *)-1) {
 		pr_perror("Failed to attach IPC shared memory");
 		return -errno;
 	}
-	ret = write_img_buf(img, data, round_up(shm->size, sizeof(u32)));
-	if (ret < 0) {
+
+	ret = dump_sysv_shmem(data, shm->size, shm->desc->id, shm->page_csums,
+			      pshm ? pshm->page_csums : NULL,
+			      pshm ? pshm->n_page_csums : 0);
+	if (ret < 0)
 		pr_err("Failed to write IPC shared memory data\n");
-		return ret;
-	}
+
 	if (shmdt(data)) {
 		pr_perror("Failed to detach IPC shared memory");
 		return -errno;
 	}
-	return 0;
+
+	shm->has_in_pagemaps = true;
+	shm->in_pagemaps = true;
+	return ret;
 }
 
 static int dump_ipc_shm_seg(struct cr_img *img, int id, const struct shmid_ds *ds)
@@ -362,12 +457,16 @@ static int dump_ipc_shm_seg(struct cr_img *img, int id, const struct shmid_ds *d
 	fill_ipc_desc(id, shm.desc, &ds->shm_perm);
 	pr_info_ipc_shm(&shm);
 
+	ret = dump_ipc_shm_pages(&shm);
+	if (ret < 0)
+		goto out;
+
 	ret = pb_write_one(img, &shm, PB_IPC_SHM);
-	if (ret < 0) {
+	if (ret < 0)
 		pr_err("Failed to write IPC shared memory segment\n");
-		return ret;
-	}
-	return dump_ipc_shm_pages(img, &shm);
+out:
+	xfree(shm.page_csums);
+	return ret;
 }
 
 static int dump_ipc_shm(struct cr_img *img)
@@ -382,6 +481,11 @@ static int dump_ipc_shm(struct cr_img *img)
 	}
 
 	pr_info("IPC shared memory segments: %d\n", info.used_ids);
+	if (info.used_ids > IPC_NS_PAGE_IDS) {
+		pr_err("Too many IPC shared memory segments\n");
+		return -E2BIG;
+	}
+
 	for (i = 0, slot = 0; i <= maxid; i++) {
 		struct shmid_ds ds;
 		int id, ret;
@@ -462,6 +566,10 @@ int dump_ipc_ns(int ns_id)
 	if (imgset == NULL)
 		return -1;
 
+	ret = collect_parent_shms(ns_id);
+	if (ret < 0)
+		goto err;
+
 	ret = dump_ipc_data(imgset);
 	if (ret < 0) {
 		pr_err("Failed to write IPC namespace data\n");
@@ -469,6 +577,7 @@ int dump_ipc_ns(int ns_id)
 	}
 
 err:
+	free_parent_shms();
 	close_cr_imgset(&imgset);
 	return ret < 0 ? -1 : 0;
 }
@@ -740,7 +849,10 @@ static int prepare_ipc_shm_pages(struct cr_img *img, const IpcShmEntry *shm)
 		pr_perror("Failed to attach IPC shared memory");
 		return -errno;
 	}
-	ret = read_img_buf(img, data, round_up(shm->size, sizeof(u32)));
+	if (shm->in_pagemaps)
+		ret = restore_sysv_shmem_content(data, shm->size, shm->desc->id);
+	else
+		ret = read_img_buf(img, data, round_up(shm->size, sizeof(u32)));
 	if (ret < 0) {
 		pr_err("Failed to read IPC shared memory data\n");
 		return ret;
@@ -22,6 +22,7 @@
 #include "proc_parse.h"
 #include "config.h"
 #include "syscall-codes.h"
+#include "clone3.h"
 
 struct kerndat_s kdat = {
 };
@@ -347,6 +348,40 @@ static bool kerndat_has_memfd_create(void)
 	return 0;
 }
 
+/*
+ * With set_tid clone3() creates a task with the given pid, so
+ * there's no need to go through ns_last_pid and its lock.
+ */
+static int kerndat_has_clone3_set_tid(void)
+{
+	struct cr_clone_args args = { };
+	int ret;
+
+	/*
+	 * Non-zero set_tid with zero set_tid_size is EINVAL if the
+	 * kernel knows about set_tid, otherwise the arguments are
+	 * too big (E2BIG) or there's no clone3() at all (ENOSYS).
+	 */
+	args.set_tid = -1;
+	ret = syscall(__NR_clone3, &args, sizeof(args));
+
+	if (ret == -1 && errno == EINVAL)
+		kdat.has_clone3_set_tid = true;
+	else {
+		/*
+		 * It's an optional fast path, so anything else (e.g. EPERM
+		 * from seccomp) just makes restore use ns_last_pid.
+		 */
+		if (ret != -1 || (errno != ENOSYS && errno != E2BIG))
+			pr_warn("Unexpected result from clone3(set_tid): %d %m\n", ret);
+		kdat.has_clone3_set_tid = false;
+	}
+
+	pr_debug("clone3() with set_tid is %ssupported\n",
+			kdat.has_clone3_set_tid ? "" : "not ");
+	return 0;
+}
+
 static int get_task_size(void)
 {
 	kdat.task_size = task_size();
@@ -493,6 +528,8 @@ int kerndat_init_rst(void)
 		ret = get_last_cap();
 	if (!ret)
 		ret = kerndat_has_memfd_create();
+	if (!ret)
+		ret = kerndat_has_clone3_set_tid();
 	if (!ret)
 		ret = get_task_size();
 	if (!ret)
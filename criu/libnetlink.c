@@ -62,7 +62,12 @@ int do_rtnl_req(int nl, void *req, int size,
 	struct msghdr msg;
 	struct sockaddr_nl nladdr;
 	struct iovec iov;
-	static char buf[16384];
+	/*
+	 * Kernel puts up to 32K of dump messages into one skb when
+	 * the reader's buffer is that big, so the big dumps (sockets
+	 * in particular) take half the recvmsg-s the 16K one needs.
+	 */
+	static char buf[32768];
 	int err;
 
 	if (!error_callback)
@@ -257,6 +257,21 @@ static int dump_pages(struct page_pipe *pp, struct parasite_ctl *ctl,
 	return ret;
 }
 
+/*
+ * Pages pre-dump keeps vmspliced in page pipes till tasks are thawed.
+ */
+static unsigned long pre_dump_pinned_pages;
+
+static unsigned long pre_dump_pages_left(void)
+{
+	unsigned long limit = opts.pre_dump_mem_limit / PAGE_SIZE;
+
+	if (pre_dump_pinned_pages >= limit)
+		return 0;
+
+	return limit - pre_dump_pinned_pages;
+}
+
 static int __parasite_dump_pages_seized(struct parasite_ctl *ctl,
 		struct parasite_dump_pages_args *args,
 		struct vm_area_list *vma_area_list,
@@ -266,6 +281,8 @@ static int __parasite_dump_pages_seized(struct parasite_ctl *ctl,
 	struct page_pipe *pp;
 	struct vma_area *vma_area;
 	struct page_xfer xfer = { .parent = NULL };
+	bool delayed_dump = pp_ret != NULL;
+	unsigned long pages_left = 0;
 	int ret = -1;
 
 	pr_info("\n");
@@ -285,13 +302,26 @@ static int __parasite_dump_pages_seized(struct parasite_ctl *ctl,
 		     vma_area_list->longest * PAGE_SIZE))
 		return -1;
 
+	/*
+	 * Pre-dump with memory limit keeps pages in pipes while
+	 * they fit the limit. After that the task's pages are
+	 * written in chunks while it's still frozen.
+	 */
+	if (pp_ret && opts.pre_dump_mem_limit) {
+		pages_left = pre_dump_pages_left();
+		if (!pages_left)
+			delayed_dump = false;
+	}
+
 	ret = -1;
 	pp = create_page_pipe(vma_area_list->priv_size,
-			      pargs_iovs(args), pp_ret == NULL);
+			      pargs_iovs(args), !delayed_dump);
 	if (!pp)
 		goto out;
 
-	if (pp_ret == NULL) {
+	pp->max_pages = pages_left;
+
+	if (!delayed_dump) {
 		ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, ctl->pid.virt);
 		if (ret < 0)
 			goto out_pp;
@@ -327,7 +357,18 @@ static int __parasite_dump_pages_seized(struct parasite_ctl *ctl,
 again:
 		ret = generate_iovs(vma_area, pp, map, &off, has_parent);
 		if (ret == -EAGAIN) {
-			BUG_ON(pp_ret);
+			if (delayed_dump) {
+				pr_info("Pre-dump memory limit reached, "
+					"writing pages of %d now\n", ctl->pid.real);
+
+				ret = open_page_xfer(&xfer, CR_FD_PAGEMAP, ctl->pid.virt);
+				if (ret < 0)
+					goto out_xfer;
+
+				delayed_dump = false;
+				pp->chunk_mode = true;
+				pp->max_pages = 0;
+			}
 
 			ret = dump_pages(pp, ctl, args, &xfer);
 			if (ret)
@@ -339,14 +380,17 @@ again:
 			goto out_xfer;
 	}
 
-	ret = dump_pages(pp, ctl, args, pp_ret ? NULL : &xfer);
+	ret = dump_pages(pp, ctl, args, delayed_dump ? NULL : &xfer);
 	if (ret)
 		goto out_xfer;
 
 	timing_stop(TIME_MEMDUMP);
 
-	if (pp_ret)
+	if (delayed_dump) {
+		pre_dump_pinned_pages += pp->nr_pages;
 		*pp_ret = pp;
+	} else if (pp_ret)
+		*pp_ret = NULL;
 
 	/*
 	 * Step 4 -- clean up
@@ -354,10 +398,10 @@ again:
 
 	ret = task_reset_dirty_track(ctl->pid.real);
 out_xfer:
-	if (pp_ret == NULL)
+	if (!delayed_dump)
 		xfer.close(&xfer);
 out_pp:
-	if (ret || !pp_ret)
+	if (ret || !delayed_dump)
 		destroy_page_pipe(pp);
 out:
 	pmc_fini(&pmc);
@@ -647,7 +691,42 @@ static int premap_priv_vmas(struct pstree_item *t, struct vm_area_list *vmas, vo
 	return ret;
 }
 
-static int restore_priv_vma_content(struct pstree_item *t)
+/*
+ * Contents of the private vmas, that are neither inherited from
+ * the parent, nor going to be inherited by any of the children,
+ * are not needed for forking. Such vmas are filled after children
+ * are forked, concurrently with the restore of their subtrees.
+ */
+static void mark_deferred_vmas(struct pstree_item *t)
+{
+	struct list_head *vmas = &rsti(t)->vmas.h;
+	struct pstree_item *child;
+	struct vma_area *vma, *cvma;
+
+	list_for_each_entry(vma, vmas, list)
+		vma->defer_content = vma_area_is_private(vma, kdat.task_size) &&
+					vma->ppage_bitmap == NULL;
+
+	/* See map_private_vma() for how children pick up the parent vmas */
+	list_for_each_entry(child, &t->children, sibling) {
+		vma = list_first_entry(vmas, struct vma_area, list);
+
+		list_for_each_entry(cvma, &rsti(child)->vmas.h, list) {
+			while (&vma->list != vmas && vma->e->start < cvma->e->start)
+				vma = list_entry(vma->list.next, struct vma_area, list);
+
+			if (&vma->list == vmas)
+				break;
+
+			if (vma->e->start == cvma->e->start &&
+			    vma->e->end == cvma->e->end &&
+			    vma_area_is_private(cvma, kdat.task_size))
+				vma->defer_content = false;
+		}
+	}
+}
+
+static int restore_priv_vma_content(struct pstree_item *t, bool deferred)
 {
 	struct vma_area *vma;
 	int ret = 0;
@@ -707,6 +786,17 @@ static int restore_priv_vma_content(struct pstree_item *t)
 				goto err_addr;
 			}
 
+			if (vma->defer_content != deferred) {
+				int nr;
+
+				/* Restored in the other pass */
+				nr = min_t(int, nr_pages - i, (vma->e->end - va) / PAGE_SIZE);
+				pr.skip_pages(&pr, nr * PAGE_SIZE);
+				va += nr * PAGE_SIZE;
+				i += nr - 1;
+				continue;
+			}
+
 			off = (va - vma->e->start) / PAGE_SIZE;
 			p = decode_pointer((off) * PAGE_SIZE +
 					vma->premmaped_addr);
@@ -770,7 +860,8 @@ err_read:
 		unsigned long size, i = 0;
 		void *addr = decode_pointer(vma->premmaped_addr);
 
-		if (vma->ppage_bitmap == NULL)
+		/* Inherited vmas are never deferred */
+		if (vma->ppage_bitmap == NULL || deferred)
 			continue;
 
 		size = vma_entry_len(vma->e) / PAGE_SIZE;
@@ -796,6 +887,7 @@ err_read:
 	cnt_add(CNT_PAGES_SKIPPED_COW, nr_shared);
 	cnt_add(CNT_PAGES_RESTORED, nr_restored);
 
+	pr_info("%s pages:\n", deferred ? "Deferred" : "Premapped");
 	pr_info("nr_restored_pages: %d\n", nr_restored);
 	pr_info("nr_shared_pages:   %d\n", nr_shared);
 	pr_info("nr_droped_pages:   %d\n", nr_droped);
@@ -838,7 +930,9 @@ int prepare_mappings(struct pstree_item *t)
 	if (ret < 0)
 		goto out;
 
-	ret = restore_priv_vma_content(t);
+	mark_deferred_vmas(t);
+
+	ret = restore_priv_vma_content(t, false);
 	if (ret < 0)
 		goto out;
 
@@ -853,6 +947,20 @@ out:
 	return ret;
 }
 
+/*
+ * Called after the children are forked, see mark_deferred_vmas().
+ */
+int restore_deferred_vma_content(struct pstree_item *t)
+{
+	struct vma_area *vma;
+
+	list_for_each_entry(vma, &rsti(t)->vmas.h, list)
+		if (vma->defer_content)
+			return restore_priv_vma_content(t, true);
+
+	return 0;
+}
+
 /*
  * A gard page must be unmapped after restoring content and
  * forking children to restore COW memory.
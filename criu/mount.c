@@ -30,6 +30,7 @@
 #include "sysfs_parse.h"
 #include "path.h"
 #include "autofs.h"
+#include "tmpfs.h"
 
 #include "images/mnt.pb-c.h"
 #include "images/binfmt-misc.pb-c.h"
@@ -74,8 +75,114 @@ static struct ext_mount *ext_mount_lookup(char *key)
  */
 struct mount_info *mntinfo;
 
+/*
+ * Mounts are looked up by mnt_id and s_dev for every file, VMA and
+ * mountpoint, and there can be thousands of them, so the global list
+ * gets open-addressed hash indexes. They are built lazily on the first
+ * lookup and dropped whenever the list changes. When keys collide the
+ * first mount in the list wins, as the plain list walk did.
+ */
+#define MNT_HASH_MIN_SIZE	64
+
+struct mnt_index {
+	struct mount_info	**slots;
+	unsigned int		size;
+};
+
+static inline unsigned int mnt_hash(unsigned int key, unsigned int size)
+{
+	return (key * 2654435761U) & (size - 1);
+}
+
+static int mnt_index_build(struct mnt_index *idx, struct mount_info *list,
+			   unsigned int (*key)(struct mount_info *))
+{
+	struct mount_info *m;
+	unsigned int nr = 0, size = MNT_HASH_MIN_SIZE;
+
+	for (m = list; m != NULL; m = m->next)
+		nr++;
+	while (size < nr * 2)
+		size <<= 1;
+
+	idx->slots = xzalloc(size * sizeof(*idx->slots));
+	if (!idx->slots)
+		return -1;
+	idx->size = size;
+
+	for (m = list; m != NULL; m = m->next) {
+		unsigned int i;
+
+		for (i = mnt_hash(key(m), size); idx->slots[i]; i = (i + 1) & (size - 1))
+			if (key(idx->slots[i]) == key(m))
+				break;
+		if (!idx->slots[i])
+			idx->slots[i] = m;
+	}
+
+	return 0;
+}
+
+static void mnt_index_free(struct mnt_index *idx)
+{
+	xfree(idx->slots);
+	idx->slots = NULL;
+	idx->size = 0;
+}
+
+static struct mount_info *mnt_index_lookup(struct mnt_index *idx, unsigned int k,
+					   unsigned int (*key)(struct mount_info *))
+{
+	unsigned int i;
+
+	for (i = mnt_hash(k, idx->size); idx->slots[i]; i = (i + 1) & (idx->size - 1))
+		if (key(idx->slots[i]) == k)
+			return idx->slots[i];
+
+	return NULL;
+}
+
+static unsigned int mnt_key_id(struct mount_info *m)
+{
+	return m->mnt_id;
+}
+
+static unsigned int mnt_key_sdev(struct mount_info *m)
+{
+	return m->s_dev;
+}
+
+static struct mount_info *mnt_index_list;
+static struct mnt_index mnt_id_index, mnt_sdev_index;
+
+static void mnt_index_drop(void)
+{
+	mnt_index_free(&mnt_id_index);
+	mnt_index_free(&mnt_sdev_index);
+	mnt_index_list = NULL;
+}
+
+static bool mnt_index_ready(void)
+{
+	if (mnt_index_list != mntinfo)
+		mnt_index_drop();
+	if (!mntinfo || mnt_id_index.slots)
+		return mnt_id_index.slots != NULL;
+
+	if (mnt_index_build(&mnt_id_index, mntinfo, mnt_key_id) ||
+	    mnt_index_build(&mnt_sdev_index, mntinfo, mnt_key_sdev)) {
+		mnt_index_drop();
+		return false;
+	}
+
+	mnt_index_list = mntinfo;
+	return true;
+}
+
 static void mntinfo_add_list(struct mount_info *new)
 {
+	mnt_index_drop();
+
 	if (!mntinfo)
 		mntinfo = new;
 	else {
@@ -189,6 +296,9 @@ static struct mount_info *__lookup_mnt_id(struct mount_info *list, int id)
 
 struct mount_info *lookup_mnt_id(unsigned int id)
 {
+	if (mnt_index_ready())
+		return mnt_index_lookup(&mnt_id_index, id, mnt_key_id);
+
 	return __lookup_mnt_id(mntinfo, id);
 }
 
@@ -196,6 +306,9 @@ struct mount_info *lookup_mnt_sdev(unsigned int s_dev)
 {
 	struct mount_info *m;
 
+	if (mnt_index_ready())
+		return mnt_index_lookup(&mnt_sdev_index, s_dev, mnt_key_sdev);
+
 	for (m = mntinfo; m != NULL; m = m->next)
 		if (m->s_dev == s_dev)
 			return m;
@@ -203,11 +316,208 @@ struct mount_info *lookup_mnt_sdev(unsigned int s_dev)
 	return NULL;
 }
 
+/*
+ * Path resolution descends the tree one mount at a time and at every
+ * level picks the first child (in siblings order) whose mountpoint is a
+ * prefix of the path. Instead of scanning all the children at each
+ * level, every child is put into a hash keyed by its parent and its
+ * mountpoint together with its position among siblings. A level then
+ * costs one lookup per path component, whatever the number of mounts.
+ *
+ * Trees are indexed on first resolution and the whole index is dropped
+ * when any tree is rebuilt or reordered, or when mounts are freed.
+ */
+struct mnt_path_node {
+	struct mount_info	*parent;
+	struct mount_info	*child;
+	unsigned int		pos;
+	unsigned int		hash;
+};
+
+static struct mnt_path_node *mnt_path_slots;
+static unsigned int mnt_path_size, mnt_path_nr;
+static struct mount_info *mnt_path_roots[8];
+
+static void mnt_path_index_drop(void)
+{
+	xfree(mnt_path_slots);
+	mnt_path_slots = NULL;
+	mnt_path_size = mnt_path_nr = 0;
+	memset(mnt_path_roots, 0, sizeof(mnt_path_roots));
+}
+
+static unsigned int mnt_path_hash(struct mount_info *parent, const char *path, size_t len)
+{
+	unsigned int h = 2166136261U ^ (unsigned int)((unsigned long)parent >> 4);
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char)path[i]) * 16777619U;
+
+	return h;
+}
+
+static void mnt_path_insert(struct mnt_path_node *tbl, unsigned int size,
+			    struct mnt_path_node *n)
+{
+	unsigned int i;
+
+	for (i = n->hash & (size - 1); tbl[i].child; i = (i + 1) & (size - 1))
+		;
+	tbl[i] = *n;
+}
+
+static int mnt_path_grow(unsigned int nr)
+{
+	struct mnt_path_node *tbl;
+	unsigned int size, i;
+
+	size = mnt_path_size ? : MNT_HASH_MIN_SIZE;
+	while (size < nr * 2)
+		size <<= 1;
+	if (size == mnt_path_size)
+		return 0;
+
+	tbl = xzalloc(size * sizeof(*tbl));
+	if (!tbl)
+		return -1;
+
+	for (i = 0; i < mnt_path_size; i++)
+		if (mnt_path_slots[i].child)
+			mnt_path_insert(tbl, size, &mnt_path_slots[i]);
+
+	xfree(mnt_path_slots);
+	mnt_path_slots = tbl;
+	mnt_path_size = size;
+	return 0;
+}
+
+static int mnt_path_add_tree(struct mount_info *m)
+{
+	struct mount_info *c;
+	unsigned int pos = 0;
+
+	list_for_each_entry(c, &m->children, siblings) {
+		struct mnt_path_node n = {
+			.parent = m,
+			.child	= c,
+			.pos	= pos++,
+		};
+		const char *mp = c->mountpoint + 1;
+
+		if (mnt_path_grow(mnt_path_nr + 1))
+			return -1;
+
+		n.hash = mnt_path_hash(m, mp, strlen(mp));
+		mnt_path_insert(mnt_path_slots, mnt_path_size, &n);
+		mnt_path_nr++;
+
+		if (mnt_path_add_tree(c))
+			return -1;
+	}
+
+	return 0;
+}
+
+static bool mnt_path_index_ready(struct mount_info *tree)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(mnt_path_roots); i++) {
+		if (mnt_path_roots[i] == tree)
+			return true;
+		if (!mnt_path_roots[i])
+			break;
+	}
+
+	if (i == ARRAY_SIZE(mnt_path_roots)) {
+		mnt_path_index_drop();
+		i = 0;
+	}
+
+	if (mnt_path_add_tree(tree)) {
+		mnt_path_index_drop();
+		return false;
+	}
+
+	mnt_path_roots[i] = tree;
+	return true;
+}
+
+/*
+ * Several siblings may share a mountpoint (overmounts). Rehashing
+ * doesn't keep their order in the probe chain, so the whole chain
+ * is scanned and the first one in siblings order is returned, as
+ * the list walk does.
+ */
+static struct mount_info *mnt_path_lookup(struct mount_info *m, const char *path,
+					  size_t len, unsigned int *pos)
+{
+	struct mount_info *found = NULL;
+	unsigned int h, i;
+
+	if (!mnt_path_size)
+		return NULL;
+
+	h = mnt_path_hash(m, path, len);
+	for (i = h & (mnt_path_size - 1); mnt_path_slots[i].child;
+			i = (i + 1) & (mnt_path_size - 1)) {
+		struct mnt_path_node *n = &mnt_path_slots[i];
+		const char *mp = n->child->mountpoint + 1;
+
+		if (n->hash == h && n->parent == m &&
+		    !strncmp(mp, path, len) && mp[len] == '\0' &&
+		    (!found || n->pos < *pos)) {
+			found = n->child;
+			*pos = n->pos;
+		}
+	}
+
+	return found;
+}
+
+static struct mount_info *mount_resolve_path_indexed(struct mount_info *m, const char *path)
+{
+	size_t pathlen = strlen(path);
+
+	while (1) {
+		struct mount_info *best = NULL, *c;
+		unsigned int best_pos = 0, pos;
+		size_t n;
+
+		/*
+		 * Candidate mountpoints are the path itself and all
+		 * its prefixes ending right before a slash.
+		 */
+		for (n = 1; n <= pathlen; n++) {
+			if (n < pathlen && path[n] != '/')
+				continue;
+
+			c = mnt_path_lookup(m, path, n, &pos);
+			if (c && (!best || pos < best_pos)) {
+				best = c;
+				best_pos = pos;
+			}
+		}
+
+		if (!best)
+			break;
+		m = best;
+	}
+
+	return m;
+}
+
 static struct mount_info *mount_resolve_path(struct mount_info *mntinfo_tree, const char *path)
 {
 	size_t pathlen = strlen(path);
 	struct mount_info *m = mntinfo_tree, *c;
 
+	if (mnt_path_index_ready(mntinfo_tree)) {
+		m = mount_resolve_path_indexed(m, path);
+		goto out;
+	}
+
 	while (1) {
 		list_for_each_entry(c, &m->children, siblings) {
 			size_t n;
@@ -228,6 +538,7 @@ static struct mount_info *mount_resolve_path(struct mount_info *mntinfo_tree, co
 			break;
 	}
 
+out:
 	pr_debug("Path `%s' resolved to `%s' mountpoint\n", path, m->mountpoint);
 	return m;
 }
@@ -321,6 +632,14 @@ static char *mnt_roots;
 static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mount_info *tmp_root_mount)
 {
 	struct mount_info *m, *root = NULL;
+	struct mnt_index idx = { };
+
+	/*
+	 * Can't go with the global index here, the list is not always
+	 * the mntinfo one. If there's no memory for the local index, the
+	 * plain list walk still does the job, only slower.
+	 */
+	mnt_index_build(&idx, list, mnt_key_id);
 
 	/*
 	 * Just resolve the mnt_id:parent_mnt_id relations
@@ -333,7 +652,9 @@ static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mou
 		pr_debug("\t\tWorking on %d->%d\n", m->mnt_id, m->parent_mnt_id);
 
 		if (m->mnt_id != m->parent_mnt_id)
-			parent = __lookup_mnt_id(list, m->parent_mnt_id);
+			parent = idx.slots ?
+				mnt_index_lookup(&idx, m->parent_mnt_id, mnt_key_id) :
+				__lookup_mnt_id(list, m->parent_mnt_id);
 		else /* a circular mount reference. It's rootfs or smth like it. */
 			parent = NULL;
 
@@ -354,7 +675,7 @@ static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mou
 					       "roots %d (@%s %s) %d (@%s %s) are not supported yet\n",
 					       root->mnt_id, root->mountpoint, root->root,
 					       m->mnt_id, m->mountpoint, m->root);
-					return NULL;
+					goto err;
 				}
 
 				/*
@@ -367,7 +688,7 @@ static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mou
 				if (unlikely(!tmp_root_mount)) {
 					pr_err("Nested mount %d (@%s %s) w/o root insertion detected\n",
 					       m->mnt_id, m->mountpoint, m->root);
-					return NULL;
+					goto err;
 				}
 
 				pr_debug("Mountpoint %d (@%s) get parent %d (@%s)\n",
@@ -376,7 +697,7 @@ static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mou
 			} else {
 				pr_err("No root found for mountpoint %d (@%s)\n",
 					m->mnt_id, m->mountpoint);
-				return NULL;
+				goto err;
 			}
 		}
 
@@ -386,7 +707,7 @@ static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mou
 
 	if (!root) {
 		pr_err("No root found for tree\n");
-		return NULL;
+		goto err;
 	}
 
 	if (tmp_root_mount) {
@@ -394,7 +715,12 @@ static struct mount_info *mnt_build_ids_tree(struct mount_info *list, struct mou
 		list_add_tail(&tmp_root_mount->siblings, &root->children);
 	}
 
+	mnt_index_free(&idx);
 	return root;
+
+err:
+	mnt_index_free(&idx);
+	return NULL;
 }
 
 static unsigned int mnt_depth(struct mount_info *m)
@@ -601,6 +927,9 @@ static int validate_shared(struct mount_info *m)
 		list_move(&cm->siblings, &children);
 	}
 
+	/* Children may come back in t's order */
+	mnt_path_index_drop();
+
 	if (!list_empty(&m->children))
 		goto err;
 
@@ -952,6 +1281,7 @@ static struct mount_info *mnt_build_tree(struct mount_info *list, struct mount_i
 	 */
 
 	pr_info("Building mountpoints tree\n");
+	mnt_path_index_drop();
 	tree = mnt_build_ids_tree(list, roots_mp);
 	if (!tree)
 		return NULL;
@@ -1154,53 +1484,17 @@ static int devpts_parse(struct mount_info *pm)
 
 static int tmpfs_dump(struct mount_info *pm)
 {
-	int ret = -1, fd = -1, userns_pid = -1;
-	char tmpfs_path[PSFDS];
-	struct cr_img *img;
+	int ret, fd;
 
 	fd = open_mountpoint(pm);
 	if (fd < 0)
 		return fd;
 
-	/* if fd happens to be 0 here, we need to move it to something
-	 * non-zero, because cr_system_userns closes STDIN_FILENO as we are not
-	 * interested in passing stdin to tar.
-	 */
-	if (move_fd_from(&fd, STDIN_FILENO) < 0)
-		goto out;
-
-	if (fcntl(fd, F_SETFD, fcntl(fd, F_GETFD) & ~FD_CLOEXEC) == -1) {
-		pr_perror("Can not drop FD_CLOEXEC");
-		goto out;
-	}
-
-	img = open_image(CR_FD_TMPFS_DEV, O_DUMP, pm->s_dev);
-	if (!img)
-		goto out;
-
-	sprintf(tmpfs_path, "/proc/self/fd/%d", fd);
-
-	if (root_ns_mask & CLONE_NEWUSER)
-		userns_pid = root_item->pid.real;
-
-	ret = cr_system_userns(-1, img_raw_fd(img), -1, "tar", (char *[])
-			{ "tar", "--create",
-			"--gzip",
-			"--no-unquote",
-			"--no-wildcards",
-			"--one-file-system",
-			"--check-links",
-			"--preserve-permissions",
-			"--sparse",
-			"--numeric-owner",
-			"--directory", tmpfs_path, ".", NULL }, 0, userns_pid);
-
+	ret = tmpfs_dump_files(fd, pm->s_dev);
 	if (ret)
 		pr_err("Can't dump tmpfs content\n");
 
-	close_image(img);
-out:
-	close_safe(&fd);
+	close(fd);
 	return ret;
 }
 
@@ -1235,6 +1529,14 @@ static int tmpfs_restore(struct mount_info *pm)
 	int ret;
 	struct cr_img *img;
 
+	ret = tmpfs_restore_files(pm->mountpoint, pm->s_dev);
+	if (ret <= 0) {
+		if (ret)
+			pr_err("Can't restore tmpfs content\n");
+		return ret;
+	}
+
+	/* Images from older versions have tarballs with the contents */
 	img = open_image(CR_FD_TMPFS_DEV, O_RSTR, pm->s_dev);
 	if (empty_image(img)) {
 		close_image(img);
@@ -1920,6 +2222,9 @@ static int dump_one_mountpoint(struct mount_info *pm, struct cr_img *img)
 
 static void free_mntinfo(struct mount_info *pms)
 {
+	mnt_index_drop();
+	mnt_path_index_drop();
+
 	while (pms) {
 		struct mount_info *pm;
 
@@ -2019,42 +2324,122 @@ err:
 #define MNT_WALK_NONE	0 &&
 
 
-static int mnt_tree_for_each(struct mount_info *start,
-		int (*fn)(struct mount_info *))
+/*
+ * Mounts that can't be mounted yet (see can_mount_now()) are parked on
+ * the waiting list together with their not yet walked sub-trees. Each of
+ * them is walked again only when something it depends on gets mounted
+ * or gets a bind source, which is what mnt_wake_dependents() reports.
+ * Thus every mount is re-checked a few times at most instead of once
+ * per pass over all the postponed ones.
+ */
+static struct list_head *mnt_ready_list;
+
+static void mnt_wake(struct mount_info *m)
 {
-	struct mount_info *tmp;
-	LIST_HEAD(postpone);
-	LIST_HEAD(postpone2);
-	int progress;
+	/* Only the waiting and the ready mounts are on a list */
+	if (!list_empty(&m->postpone))
+		list_move_tail(&m->postpone, mnt_ready_list);
+}
 
-	pr_debug("Start with %d:%s\n", start->mnt_id, start->mountpoint);
-	list_add(&start->postpone, &postpone);
+static void mnt_wake_dependents(struct mount_info *mi)
+{
+	struct mount_info *t, *c;
 
-again:
-	progress = 0;
+	if (!mnt_ready_list)
+		return;
 
-	list_for_each_entry_safe(start, tmp, &postpone, postpone)
-		MNT_TREE_WALK(start, next, fn, MNT_WALK_NONE, &postpone2, progress);
+	/* Mounted by propagation, its sub-tree is still to be walked */
+	mnt_wake(mi);
 
-	if (!progress) {
-		struct mount_info *m;
+	list_for_each_entry(c, &mi->children, siblings)
+		mnt_wake(c);
 
-		pr_err("A few mount points can't be mounted\n");
-		list_for_each_entry(m, &postpone2, postpone) {
-			pr_err("%d:%d %s %s %s\n", m->mnt_id,
-				m->parent_mnt_id, m->root,
-				m->mountpoint, m->source);
-		}
-		return -1;
+	/* Those may get mi as a bind source */
+	list_for_each_entry(t, &mi->mnt_bind, mnt_bind)
+		mnt_wake(t);
+	list_for_each_entry(t, &mi->mnt_slave_list, mnt_slave)
+		mnt_wake(t);
+
+	/* Children of shared peers wait for all the peers */
+	list_for_each_entry(t, &mi->mnt_share, mnt_share) {
+		mnt_wake(t);
+		list_for_each_entry(c, &t->children, siblings)
+			mnt_wake(c);
 	}
 
-	list_splice_init(&postpone2, &postpone);
+	/* Slaves and binds of the parent wait for all its children */
+	if (mi->parent) {
+		struct mount_info *p = mi->parent;
 
-	if (!list_empty(&postpone))
-		goto again;
+		list_for_each_entry(t, &p->mnt_bind, mnt_bind)
+			mnt_wake(t);
+		list_for_each_entry(t, &p->mnt_share, mnt_share)
+			mnt_wake(t);
+		list_for_each_entry(t, &p->mnt_slave_list, mnt_slave)
+			mnt_wake(t);
+	}
+}
 
-	return 0;
+static int mnt_tree_walk_list(struct list_head *list, struct list_head *waiting,
+		int (*fn)(struct mount_info *))
+{
+	int progress = 0;
 
+	while (!list_empty(list)) {
+		struct mount_info *start;
+
+		start = list_first_entry(list, struct mount_info, postpone);
+		MNT_TREE_WALK(start, next, fn, MNT_WALK_NONE, waiting, progress);
+	}
+
+	return progress;
+}
+
+static int mnt_tree_for_each(struct mount_info *start,
+		int (*fn)(struct mount_info *))
+{
+	LIST_HEAD(ready);
+	LIST_HEAD(waiting);
+	LIST_HEAD(retry);
+	struct mount_info *m;
+	int ret = -1;
+
+	pr_debug("Start with %d:%s\n", start->mnt_id, start->mountpoint);
+	list_add(&start->postpone, &ready);
+	mnt_ready_list = &ready;
+
+	while (1) {
+		if (mnt_tree_walk_list(&ready, &waiting, fn) < 0)
+			goto out;
+
+		if (list_empty(&waiting))
+			break;
+
+		/*
+		 * Nobody woke the rest up. Give them one more chance, in
+		 * case they depend on something the wake-ups don't track.
+		 */
+		pr_debug("Retrying all postponed mounts\n");
+		list_splice_init(&waiting, &retry);
+		ret = mnt_tree_walk_list(&retry, &waiting, fn);
+		if (ret < 0)
+			goto out;
+		if (ret == 0) {
+			pr_err("A few mount points can't be mounted\n");
+			list_for_each_entry(m, &waiting, postpone) {
+				pr_err("%d:%d %s %s %s\n", m->mnt_id,
+					m->parent_mnt_id, m->root,
+					m->mountpoint, m->source);
+			}
+			ret = -1;
+			goto out;
+		}
+	}
+
+	ret = 0;
+out:
+	mnt_ready_list = NULL;
+	return ret;
 }
 
 static int mnt_tree_for_each_reverse(struct mount_info *m,
@@ -2218,6 +2603,7 @@ static int propagate_mount(struct mount_info *mi)
 				c->mounted = true;
 				propagate_siblings(c);
 				umount_from_slaves(c);
+				mnt_wake_dependents(c);
 				found = true;
 			}
 		}
@@ -2677,6 +3063,9 @@ static int do_mount_one(struct mount_info *mi)
 			mi->fstype = find_fstype_by_name("btrfs");
 	}
 
+	if (ret == 0)
+		mnt_wake_dependents(mi);
+
 	return ret;
 }
 
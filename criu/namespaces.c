@@ -11,9 +11,12 @@
 #include <sched.h>
 #include <sys/capability.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/time.h>
 #include <limits.h>
 #include <errno.h>
 
+#include "asm/atomic.h"
 #include "rst-malloc.h"
 #include "cr_options.h"
 #include "imgset.h"
@@ -24,6 +27,7 @@
 #include "namespaces.h"
 #include "net.h"
 #include "cgroup.h"
+#include "stats.h"
 
 #include "protobuf.h"
 #include "images/ns.pb-c.h"
@@ -990,12 +994,62 @@ static int do_dump_namespaces(struct ns_id *ns)
 
 }
 
+/*
+ * Namespaces are dumped by a pool of forked workers, which setns()
+ * from one namespace to another and pick the next one to dump from
+ * the shared queue, so that a slow namespace (e.g. a net one with
+ * lots of iptables rules) doesn't stall the others.
+ */
+#define NS_DUMP_MAX_WORKERS	16
+
+struct ns_dump_job {
+	struct ns_id	*ns;
+	unsigned long	page_ids;
+	unsigned long	usec;
+};
+
+struct ns_dump_queue {
+	atomic_t		next;
+	int			nr;
+	struct ns_dump_job	jobs[0];
+};
+
+static int ns_dump_worker(struct ns_dump_queue *q)
+{
+	while (1) {
+		struct ns_dump_job *job;
+		struct timeval start;
+		int i;
+
+		i = atomic_inc_return(&q->next) - 1;
+		if (i >= q->nr)
+			break;
+
+		job = &q->jobs[i];
+		if (job->page_ids)
+			set_page_ids(job->page_ids);
+
+		gettimeofday(&start, NULL);
+		if (do_dump_namespaces(job->ns))
+			return -1;
+		job->usec = usec_since(&start);
+
+		pr_info("Namespace %d dumped in %lu usec\n", job->ns->id, job->usec);
+	}
+
+	return bfd_flush_images();
+}
+
 int dump_namespaces(struct pstree_item *item, unsigned int ns_flags)
 {
 	struct pid *ns_pid = &item->pid;
+	struct ns_dump_queue *q;
 	struct ns_id *ns;
-	int pid, nr = 0;
-	int ret = 0;
+	int i, nr = 0, nr_workers, ret = 0;
+	pid_t pids[NS_DUMP_MAX_WORKERS];
+	sigset_t blockmask, oldmask;
+	size_t q_size;
+	long nr_cpus;
 
 	/*
 	 * The setns syscall is cool, we can switch to the other
@@ -1015,7 +1069,20 @@ int dump_namespaces(struct pstree_item *item, unsigned int ns_flags)
 		return -1;
 	}
 
+	for (ns = ns_ids; ns; ns = ns->next)
+		nr++;
+
+	q_size = sizeof(*q) + nr * sizeof(q->jobs[0]);
+	q = mmap(NULL, q_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (q == MAP_FAILED) {
+		pr_perror("Can't map namespaces dump queue");
+		return -1;
+	}
+
 	for (ns = ns_ids; ns; ns = ns->next) {
+		struct ns_dump_job *job;
+
 		/* Skip current namespaces, which are in the list too  */
 		if (ns->type == NS_CRIU)
 			continue;
@@ -1030,39 +1097,82 @@ int dump_namespaces(struct pstree_item *item, unsigned int ns_flags)
 				continue;
 		}
 
-		pid = fork();
-		if (pid < 0) {
+		job = &q->jobs[q->nr++];
+		job->ns = ns;
+
+		/* SysV shm contents go to pages images */
+		if (ns->nd->cflag == CLONE_NEWIPC)
+			job->page_ids = reserve_page_ids(IPC_NS_PAGE_IDS);
+	}
+
+	if (!q->nr)
+		goto out;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_workers = min_t(long, q->nr, max(nr_cpus, 1L));
+	nr_workers = min(nr_workers, NS_DUMP_MAX_WORKERS);
+
+	pr_info("Dumping %d namespaces with %d workers\n", q->nr, nr_workers);
+
+	/*
+	 * Same as cr_system() does, the workers are waited for right
+	 * here and shouldn't get into the SIGCHLD handler.
+	 */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &blockmask, &oldmask) == -1) {
+		pr_perror("Can not set mask of blocked signals");
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
 			pr_perror("Can't fork ns dumper");
-			return -1;
+			ret = -1;
+			nr_workers = i;
+			break;
 		}
 
-		if (pid == 0) {
-			ret = do_dump_namespaces(ns);
-			exit(ret);
+		if (pids[i] == 0) {
+			ret = ns_dump_worker(q);
+			exit(ret ? 1 : 0);
 		}
-
-		nr++;
 	}
 
-	while (nr > 0) {
+	for (i = 0; i < nr_workers; i++) {
 		int status;
 
-		ret = waitpid(-1, &status, 0);
-		if (ret < 0) {
+		if (waitpid(pids[i], &status, 0) < 0) {
 			pr_perror("Can't wait ns dumper");
-			return -1;
+			ret = -1;
+			continue;
 		}
 
 		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
 			pr_err("Namespaces dumping finished with error %d\n", status);
-			return -1;
+			ret = -1;
 		}
+	}
 
-		nr--;
+	if (sigprocmask(SIG_SETMASK, &oldmask, NULL) == -1) {
+		pr_perror("Can not unset mask of blocked signals");
+		ret = -1;
+	}
+
+	if (ret)
+		goto out;
+
+	for (i = 0; i < q->nr; i++) {
+		cnt_add(CNT_NS_DUMPED, 1);
+		cnt_add(CNT_NS_DUMP_USEC, q->jobs[i].usec);
 	}
 
 	pr_info("Namespaces dump complete\n");
-	return 0;
+out:
+	munmap(q, q_size);
+	return ret;
 }
 
 static int write_id_map(pid_t pid, UidGidExtent **extents, int n, char *id_map)
@@ -1485,13 +1595,17 @@ int collect_namespaces(bool for_dump)
 	if (ret < 0)
 		return ret;
 
+	timing_start(TIME_MNT_DUMP);
 	ret = collect_mnt_namespaces(for_dump);
 	if (ret < 0)
 		return ret;
+	timing_stop(TIME_MNT_DUMP);
 
+	timing_start(TIME_SOCKETS_COLLECT);
 	ret = collect_net_namespaces(for_dump);
 	if (ret < 0)
 		return ret;
+	timing_stop(TIME_SOCKETS_COLLECT);
 
 	return 0;
 }
@@ -1669,8 +1783,10 @@ int prepare_namespace(struct pstree_item *item, unsigned long clone_flags)
 	 * This one is special -- there can be several mount
 	 * namespaces and prepare_mnt_ns handles them itself.
 	 */
+	timing_start(TIME_MNT_RESTORE);
 	if (prepare_mnt_ns())
 		return -1;
+	timing_stop(TIME_MNT_RESTORE);
 
 	return 0;
 }
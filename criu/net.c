@@ -2,6 +2,7 @@
 #include <sys/socket.h>
 #include <linux/netlink.h>
 #include <linux/rtnetlink.h>
+#include <linux/fib_rules.h>
 #include <linux/netfilter/nfnetlink.h>
 #include <linux/netfilter/nfnetlink_conntrack.h>
 #include <linux/netfilter/nf_conntrack_tcp.h>
@@ -17,6 +18,7 @@
 #include "imgset.h"
 #include "namespaces.h"
 #include "net.h"
+#include "stats.h"
 #include "libnetlink.h"
 #include "cr_options.h"
 #include "sk-inet.h"
@@ -1071,28 +1073,216 @@ static int run_iptables_tool(char *def_cmd, int fdin, int fdout)
 	char *cmd;
 
 	cmd = getenv("CR_IPTABLES");
-	if (!cmd)
-		cmd = def_cmd;
-	pr_debug("\tRunning %s for %s\n", cmd, def_cmd);
-	ret = cr_system(fdin, fdout, -1, "sh", (char *[]) { "sh", "-c", cmd, NULL }, 0);
+	pr_debug("\tRunning %s for %s\n", cmd ? : def_cmd, def_cmd);
+	if (cmd)
+		ret = cr_system(fdin, fdout, -1, "sh", (char *[]) { "sh", "-c", cmd, NULL }, 0);
+	else
+		/* No need in a shell for a plain command */
+		ret = cr_system(fdin, fdout, -1, def_cmd, (char *[]) { def_cmd, NULL }, 0);
 	if (ret)
 		pr_err("%s failed\n", def_cmd);
 
 	return ret;
 }
 
+/*
+ * Addresses, routes and rules are kept in the format of "ip addr save",
+ * "ip route save" and "ip rule save" -- a magic followed by raw netlink
+ * messages as the kernel dumps them. We produce and replay these streams
+ * ourselves, so that neither dump nor restore forks and execs the ip tool
+ * per namespace, and images stay interchangeable with the ip tool ones.
+ * Setting CR_IP_TOOL still makes criu run the given tool instead.
+ */
+#define IPADD_DUMP_MAGIC	0x47361222
+#define ROUTE_DUMP_MAGIC	0x45311224
+#define RULE_DUMP_MAGIC		0x71706986
+
+static bool ip_tool_native(void)
+{
+	return getenv("CR_IP_TOOL") == NULL;
+}
+
+struct ip_dump_arg {
+	struct cr_img	*img;
+	int		family;
+};
+
+static u32 rtm_get_table(struct nlmsghdr *h)
+{
+	struct rtmsg *r = NLMSG_DATA(h);
+	int len = RTM_PAYLOAD(h);
+	struct rtattr *rta;
+
+	for (rta = RTM_RTA(r); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if (rta->rta_type == RTA_TABLE)
+			return *(u32 *)RTA_DATA(rta);
+
+	return r->rtm_table;
+}
+
+static int dump_one_ip_msg(struct nlmsghdr *h, void *arg)
+{
+	struct ip_dump_arg *da = arg;
+
+	if (h->nlmsg_type == RTM_NEWROUTE) {
+		struct rtmsg *r = NLMSG_DATA(h);
+
+		/* Same as "ip route save" does by default */
+		if (r->rtm_family != da->family ||
+		    r->rtm_flags & RTM_F_CLONED ||
+		    rtm_get_table(h) != RT_TABLE_MAIN)
+			return 0;
+	}
+
+	return write_img_buf(da->img, h, h->nlmsg_len) < 0 ? -1 : 0;
+}
+
+static int dump_ip_msgs(struct cr_img *img, int type, int family, u32 magic)
+{
+	struct ip_dump_arg da = { .img = img, .family = family };
+	struct {
+		struct nlmsghdr nlh;
+		struct rtgenmsg g;
+	} req;
+	int sk, ret;
+
+	if (write_img_buf(img, &magic, sizeof(magic)) < 0)
+		return -1;
+
+	sk = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (sk < 0) {
+		pr_perror("Can't open rtnl sock for net dump");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.nlh.nlmsg_len = sizeof(req);
+	req.nlh.nlmsg_type = type;
+	req.nlh.nlmsg_flags = NLM_F_ROOT|NLM_F_MATCH|NLM_F_REQUEST;
+	req.nlh.nlmsg_seq = CR_NLMSG_SEQ;
+	req.g.rtgen_family = family;
+
+	ret = do_rtnl_req(sk, &req, sizeof(req), dump_one_ip_msg, NULL, &da);
+	close(sk);
+
+	return ret;
+}
+
+static int restore_ip_msg_err(int err, void *arg)
+{
+	/* Addresses and routes created by kernel are in images too */
+	if (err == -EEXIST)
+		return 0;
+
+	pr_err("Can't restore ip object: %d\n", err);
+	return err;
+}
+
+static int ip_msg_route_prio(struct nlmsghdr *h)
+{
+	struct rtmsg *r = NLMSG_DATA(h);
+	int len = RTM_PAYLOAD(h);
+	bool gw = false, prefsrc = false;
+	struct rtattr *rta;
+
+	for (rta = RTM_RTA(r); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == RTA_GATEWAY)
+			gw = true;
+		else if (rta->rta_type == RTA_PREFSRC)
+			prefsrc = true;
+	}
+
+	/*
+	 * As "ip route restore" does: routes for local addresses
+	 * go first, then routes to local networks, then the rest,
+	 * so that gateways are reachable when needed.
+	 */
+	if (gw)
+		return 2;
+	if (prefsrc && r->rtm_dst_len)
+		return 1;
+	return 0;
+}
+
+static int restore_ip_msgs(struct cr_img *img, u32 magic, bool route)
+{
+	int sk, prio, ret = -1;
+	off_t size;
+	void *buf;
+
+	size = img_raw_size(img);
+	if (size < 0)
+		return -1;
+	if (size < sizeof(magic)) {
+		pr_err("Truncated ip dump image\n");
+		return -1;
+	}
+
+	buf = xmalloc(size);
+	if (!buf)
+		return -1;
+
+	if (read_img_buf(img, buf, size) < 0)
+		goto free;
+
+	if (*(u32 *)buf != magic) {
+		pr_err("Bad ip dump magic %#x\n", *(u32 *)buf);
+		goto free;
+	}
+
+	sk = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (sk < 0) {
+		pr_perror("Can't open rtnl sock for net restore");
+		goto free;
+	}
+
+	for (prio = 0; prio < (route ? 3 : 1); prio++) {
+		struct nlmsghdr *h = buf + sizeof(magic);
+		int len = size - sizeof(magic);
+
+		for (; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+			if (route && ip_msg_route_prio(h) != prio)
+				continue;
+
+			h->nlmsg_flags = NLM_F_REQUEST|NLM_F_CREATE|NLM_F_ACK;
+			h->nlmsg_seq = CR_NLMSG_SEQ;
+			h->nlmsg_pid = 0;
+
+			if (do_rtnl_req(sk, h, h->nlmsg_len, restore_link_cb,
+					restore_ip_msg_err, NULL))
+				goto close;
+		}
+	}
+
+	ret = 0;
+close:
+	close(sk);
+free:
+	xfree(buf);
+	return ret;
+}
+
 static inline int dump_ifaddr(struct cr_imgset *fds)
 {
 	struct cr_img *img = img_from_set(fds, CR_FD_IFADDR);
+
+	if (ip_tool_native())
+		return dump_ip_msgs(img, RTM_GETADDR, AF_UNSPEC, IPADD_DUMP_MAGIC);
+
 	return run_ip_tool("addr", "save", NULL, -1, img_raw_fd(img), 0);
 }
 
 static inline int dump_route(struct cr_imgset *fds)
 {
 	struct cr_img *img;
+	int ret;
 
 	img = img_from_set(fds, CR_FD_ROUTE);
-	if (run_ip_tool("route", "save", NULL, -1, img_raw_fd(img), 0))
+	if (ip_tool_native())
+		ret = dump_ip_msgs(img, RTM_GETROUTE, AF_INET, ROUTE_DUMP_MAGIC);
+	else
+		ret = run_ip_tool("route", "save", NULL, -1, img_raw_fd(img), 0);
+	if (ret)
 		return -1;
 
 	/* If ipv6 is disabled, "ip -6 route dump" dumps all routes */
@@ -1100,7 +1290,11 @@ static inline int dump_route(struct cr_imgset *fds)
 		return 0;
 
 	img = img_from_set(fds, CR_FD_ROUTE6);
-	if (run_ip_tool("-6", "route", "save", -1, img_raw_fd(img), 0))
+	if (ip_tool_native())
+		ret = dump_ip_msgs(img, RTM_GETROUTE, AF_INET6, ROUTE_DUMP_MAGIC);
+	else
+		ret = run_ip_tool("-6", "route", "save", -1, img_raw_fd(img), 0);
+	if (ret)
 		return -1;
 
 	return 0;
@@ -1110,6 +1304,7 @@ static inline int dump_rule(struct cr_imgset *fds)
 {
 	struct cr_img *img;
 	char *path;
+	int ret;
 
 	img = img_from_set(fds, CR_FD_RULE);
 	path = xstrdup(img->path);
@@ -1117,7 +1312,12 @@ static inline int dump_rule(struct cr_imgset *fds)
 	if (!path)
 		return -1;
 
-	if (run_ip_tool("rule", "save", NULL, -1, img_raw_fd(img), CRS_CAN_FAIL)) {
+	/* "ip rule save" dumps IPv4 rules only */
+	if (ip_tool_native())
+		ret = dump_ip_msgs(img, RTM_GETRULE, AF_INET, RULE_DUMP_MAGIC);
+	else
+		ret = run_ip_tool("rule", "save", NULL, -1, img_raw_fd(img), CRS_CAN_FAIL);
+	if (ret) {
 		pr_warn("Check if \"ip rule save\" is supported!\n");
 		unlinkat(get_service_fd(IMG_FD_OFF), path, 0);
 	}
@@ -1127,6 +1327,12 @@ static inline int dump_rule(struct cr_imgset *fds)
 	return 0;
 }
 
+/*
+ * Unlike addresses, routes and rules, iptables are still saved and
+ * restored with the iptables tools. The kernel only offers the binary
+ * xtables blobs (IPT_SO_GET_ENTRIES), which would change the image
+ * format and miss the rules of the nf_tables backed iptables.
+ */
 static inline int dump_iptables(struct cr_imgset *fds)
 {
 	struct cr_img *img;
@@ -1238,6 +1444,18 @@ err_free:
 	return ret;
 }
 
+static u32 ip_dump_magic(int type)
+{
+	switch (type) {
+	case CR_FD_IFADDR:
+		return IPADD_DUMP_MAGIC;
+	case CR_FD_RULE:
+		return RULE_DUMP_MAGIC;
+	default:
+		return ROUTE_DUMP_MAGIC;
+	}
+}
+
 static int restore_ip_dump(int type, int pid, char *cmd)
 {
 	int ret = -1;
@@ -1249,7 +1467,11 @@ static int restore_ip_dump(int type, int pid, char *cmd)
 		return 0;
 	}
 	if (img) {
-		ret = run_ip_tool(cmd, "restore", NULL, img_raw_fd(img), -1, 0);
+		if (ip_tool_native())
+			ret = restore_ip_msgs(img, ip_dump_magic(type),
+					type == CR_FD_ROUTE || type == CR_FD_ROUTE6);
+		else
+			ret = run_ip_tool(cmd, "restore", NULL, img_raw_fd(img), -1, 0);
 		close_image(img);
 	}
 
@@ -1272,6 +1494,52 @@ static inline int restore_route(int pid)
 	return 0;
 }
 
+static int delete_rule_err(int err, void *arg)
+{
+	/* The rule may be already gone, that's what we want anyway */
+	if (err == -ENOENT || err == -ESRCH)
+		return 0;
+
+	pr_err("Can't delete ip rule: %d\n", err);
+	return err;
+}
+
+/*
+ * Delete 3 default rules to prevent duplicates. See kernel's
+ * function fib_default_rules_init() for the details. As with
+ * "ip rule delete" without arguments, the first IPv4 rule is
+ * removed each time.
+ */
+static int delete_default_rules(void)
+{
+	struct {
+		struct nlmsghdr nlh;
+		struct fib_rule_hdr frh;
+	} req;
+	int sk, i, ret = 0;
+
+	sk = socket(PF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (sk < 0) {
+		pr_perror("Can't open rtnl sock for net restore");
+		return -1;
+	}
+
+	for (i = 0; i < 3 && !ret; i++) {
+		memset(&req, 0, sizeof(req));
+		req.nlh.nlmsg_len = sizeof(req);
+		req.nlh.nlmsg_type = RTM_DELRULE;
+		req.nlh.nlmsg_flags = NLM_F_REQUEST|NLM_F_ACK;
+		req.nlh.nlmsg_seq = CR_NLMSG_SEQ;
+		req.frh.family = AF_INET;
+
+		ret = do_rtnl_req(sk, &req, sizeof(req), restore_link_cb,
+				delete_rule_err, NULL);
+	}
+	close(sk);
+
+	return ret;
+}
+
 static inline int restore_rule(int pid)
 {
 	struct cr_img *img;
@@ -1286,13 +1554,17 @@ static inline int restore_rule(int pid)
 	if (empty_image(img))
 		goto close;
 
-	/*
-	 * Delete 3 default rules to prevent duplicates. See kernel's
-	 * function fib_default_rules_init() for the details.
-	 */
-	run_ip_tool("rule", "delete", NULL, -1, -1, 0);
-	run_ip_tool("rule", "delete", NULL, -1, -1, 0);
-	run_ip_tool("rule", "delete", NULL, -1, -1, 0);
+	/* See delete_default_rules() */
+	if (ip_tool_native()) {
+		if (delete_default_rules()) {
+			ret = -1;
+			goto close;
+		}
+	} else {
+		run_ip_tool("rule", "delete", NULL, -1, -1, 0);
+		run_ip_tool("rule", "delete", NULL, -1, -1, 0);
+		run_ip_tool("rule", "delete", NULL, -1, -1, 0);
+	}
 
 	if (restore_ip_dump(CR_FD_RULE, pid, "rule"))
 		ret = -1;
@@ -1302,32 +1574,41 @@ out:
 	return ret;
 }
 
-static inline int restore_iptables(int pid)
+/*
+ * The tool writes nothing when no tables are loaded in the namespace,
+ * so there is nothing to restore from an empty image.
+ */
+static int restore_iptables_img(int type, int pid, char *cmd)
 {
-	int ret = -1;
 	struct cr_img *img;
+	off_t size;
+	int ret = 0;
 
-	img = open_image(CR_FD_IPTABLES, O_RSTR, pid);
-	if (img) {
-		ret = run_iptables_tool("iptables-restore", img_raw_fd(img), -1);
-		close_image(img);
-	}
-	if (ret)
-		return ret;
-
-	img = open_image(CR_FD_IP6TABLES, O_RSTR, pid);
+	img = open_image(type, O_RSTR, pid);
 	if (img == NULL)
 		return -1;
 	if (empty_image(img))
 		goto out;
 
-	ret = run_iptables_tool("ip6tables-restore", img_raw_fd(img), -1);
+	size = img_raw_size(img);
+	if (size < 0)
+		ret = -1;
+	else if (size > 0)
+		ret = run_iptables_tool(cmd, img_raw_fd(img), -1);
 out:
 	close_image(img);
 
 	return ret;
 }
 
+static inline int restore_iptables(int pid)
+{
+	if (restore_iptables_img(CR_FD_IPTABLES, pid, "iptables-restore"))
+		return -1;
+
+	return restore_iptables_img(CR_FD_IP6TABLES, pid, "ip6tables-restore");
+}
+
 static int restore_netns_conf(int pid, NetnsEntry **netns)
 {
 	int ret = 0;
@@ -1721,8 +2002,14 @@ static int collect_net_ns(struct ns_id *ns, void *oarg)
 
 int collect_net_namespaces(bool for_dump)
 {
-	return walk_namespaces(&net_ns_desc, collect_net_ns,
+	int ret;
+
+	ret = walk_namespaces(&net_ns_desc, collect_net_ns,
 			(void *)(for_dump ? 1UL : 0));
+	if (!ret && for_dump)
+		cnt_add(CNT_SOCKETS_COLLECTED, sk_collected_nr());
+
+	return ret;
 }
 
 struct ns_desc net_ns_desc = NS_DESC_ENTRY(CLONE_NEWNET, "net");
@@ -4,6 +4,7 @@
 #include <string.h>
 #include <sys/wait.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "asm/types.h"
 #include "util.h"
@@ -143,3 +144,205 @@ int nf_unlock_connection_info(struct inet_sk_info *si)
 
 	return ret;
 }
+
+/*
+ * Batched connections (un)locking. Rules for all the connections
+ * of one family are fed into a single iptables-restore --noflush
+ * call, which applies them in one transaction, instead of running
+ * iptables for every rule. If the batch is refused (e.g. the tool
+ * is missing or too old), rules are switched one by one as before.
+ */
+
+static const char *nf_conn_rule = "%s %s --protocol tcp "
+	"--source %s --sport %d --destination %s --dport %d -j DROP\n";
+
+static char *iptable_restore_cmd[] = { "iptables-restore", "ip6tables-restore" };
+
+struct nf_batch {
+	FILE	*f[2];		/* AF_INET, AF_INET6 */
+	int	nr[2];
+	bool	done[2];
+};
+
+static int nf_batch_idx(int family)
+{
+	switch (family) {
+	case AF_INET:
+		return 0;
+	case AF_INET6:
+		return 1;
+	}
+
+	pr_err("Unknown socket family %d\n", family);
+	return -1;
+}
+
+static int nf_batch_add_raw(FILE *f, int family, u32 *src_addr, u16 src_port,
+				u32 *dst_addr, u16 dst_port, bool input, bool lock)
+{
+	char sip[INET_ADDR_LEN], dip[INET_ADDR_LEN];
+
+	if (!inet_ntop(family, (void *)src_addr, sip, INET_ADDR_LEN) ||
+			!inet_ntop(family, (void *)dst_addr, dip, INET_ADDR_LEN)) {
+		pr_perror("nf: Can't translate ip addr");
+		return -1;
+	}
+
+	if (fprintf(f, nf_conn_rule, lock ? "-A" : "-D",
+				input ? "INPUT" : "OUTPUT",
+				dip, (int)dst_port, sip, (int)src_port) < 0) {
+		pr_perror("nf: Can't write rule");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int nf_batch_add(struct nf_batch *b, int family, u32 *src_addr, u16 src_port,
+				u32 *dst_addr, u16 dst_port, bool lock)
+{
+	int i;
+
+	i = nf_batch_idx(family);
+	if (i < 0)
+		return -1;
+
+	if (!b->f[i]) {
+		b->f[i] = tmpfile();
+		if (!b->f[i]) {
+			pr_perror("nf: Can't create rules file");
+			return -1;
+		}
+
+		fprintf(b->f[i], "*filter\n");
+	}
+
+	if (nf_batch_add_raw(b->f[i], family, src_addr, src_port,
+				dst_addr, dst_port, true, lock))
+		return -1;
+	if (nf_batch_add_raw(b->f[i], family, dst_addr, dst_port,
+				src_addr, src_port, false, lock))
+		return -1;
+
+	b->nr[i]++;
+	return 0;
+}
+
+static void nf_batch_commit(struct nf_batch *b)
+{
+	int i, ret;
+
+	for (i = 0; i < ARRAY_SIZE(b->f); i++) {
+		char *argv[4] = { iptable_restore_cmd[i], "--noflush", NULL, NULL };
+		FILE *f = b->f[i];
+
+		if (!f)
+			continue;
+
+		if (kdat.has_xtlocks)
+			argv[2] = "-w";
+
+		if (fprintf(f, "COMMIT\n") < 0 || fflush(f) ||
+				lseek(fileno(f), 0, SEEK_SET)) {
+			pr_perror("nf: Can't prepare rules file");
+			continue;
+		}
+
+		pr_debug("\tRunning %s for %d connections\n", argv[0], b->nr[i]);
+
+		ret = cr_system(fileno(f), -1, -1, argv[0], argv, 0);
+		if (ret < 0 || !WIFEXITED(ret) || WEXITSTATUS(ret)) {
+			pr_warn("%s failed, switching connections one by one\n", argv[0]);
+			continue;
+		}
+
+		b->done[i] = true;
+	}
+}
+
+static bool nf_batch_done(struct nf_batch *b, int family)
+{
+	int i = nf_batch_idx(family);
+
+	return i >= 0 && b->done[i];
+}
+
+static void nf_batch_fini(struct nf_batch *b)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(b->f); i++)
+		if (b->f[i])
+			fclose(b->f[i]);
+}
+
+static int nf_connections_switch(struct list_head *sks, bool lock)
+{
+	struct nf_batch b = { };
+	struct inet_sk_desc *sk;
+	int ret = 0;
+
+	list_for_each_entry(sk, sks, rlist) {
+		if (nf_batch_add(&b, sk->sd.family,
+				sk->src_addr, sk->src_port,
+				sk->dst_addr, sk->dst_port, lock))
+			goto out;
+	}
+
+	nf_batch_commit(&b);
+out:
+	list_for_each_entry(sk, sks, rlist) {
+		if (nf_batch_done(&b, sk->sd.family))
+			continue;
+
+		if (nf_connection_switch(sk, lock)) {
+			ret = -1;
+			if (lock)
+				break;
+		}
+	}
+
+	nf_batch_fini(&b);
+
+	if (ret && lock)
+		/* rollback, whatever has been locked */
+		nf_connections_switch(sks, false);
+
+	return ret;
+}
+
+int nf_lock_connections(struct list_head *sks)
+{
+	return nf_connections_switch(sks, true);
+}
+
+int nf_unlock_connections(struct list_head *sks)
+{
+	return nf_connections_switch(sks, false);
+}
+
+int nf_unlock_connections_info(struct list_head *sis)
+{
+	struct nf_batch b = { };
+	struct inet_sk_info *si;
+	int ret = 0;
+
+	list_for_each_entry(si, sis, rlist) {
+		if (nf_batch_add(&b, si->ie->family,
+				si->ie->src_addr, si->ie->src_port,
+				si->ie->dst_addr, si->ie->dst_port, false))
+			goto out;
+	}
+
+	nf_batch_commit(&b);
+out:
+	list_for_each_entry(si, sis, rlist) {
+		if (nf_batch_done(&b, si->ie->family))
+			continue;
+
+		ret |= nf_unlock_connection_info(si);
+	}
+
+	nf_batch_fini(&b);
+	return ret;
+}
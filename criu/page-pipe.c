@@ -91,7 +91,7 @@ static int page_pipe_grow(struct page_pipe *pp)
 		goto out;
 	}
 
-	if (pp->chunk_mode && pp->nr_pipes == NR_PIPES_PER_CHUNK)
+	if (pp->chunk_mode && pp->nr_pipes >= NR_PIPES_PER_CHUNK)
 		return -EAGAIN;
 
 	ppb = ppb_alloc(pp);
@@ -126,6 +126,9 @@ struct page_pipe *create_page_pipe(unsigned int nr_segs,
 
 		pp->chunk_mode = chunk_mode;
 
+		pp->nr_pages = 0;
+		pp->max_pages = 0;
+
 		if (page_pipe_grow(pp))
 			return NULL;
 	}
@@ -158,6 +161,7 @@ void page_pipe_reinit(struct page_pipe *pp)
 		list_move(&ppb->l, &pp->free_bufs);
 
 	pp->free_hole = 0;
+	pp->nr_pages = 0;
 
 	if (page_pipe_grow(pp))
 		BUG(); /* It can't fail, because ppb is in free_bufs */
@@ -207,9 +211,12 @@ int page_pipe_add_page(struct page_pipe *pp, unsigned long addr)
 {
 	int ret;
 
+	if (pp->max_pages && pp->nr_pages >= pp->max_pages)
+		return -EAGAIN;
+
 	ret = try_add_page(pp, addr);
 	if (ret <= 0)
-		return ret;
+		goto out;
 
 	ret = page_pipe_grow(pp);
 	if (ret < 0)
@@ -217,6 +224,9 @@ int page_pipe_add_page(struct page_pipe *pp, unsigned long addr)
 
 	ret = try_add_page(pp, addr);
 	BUG_ON(ret > 0);
+out:
+	if (ret == 0)
+		pp->nr_pages++;
 	return ret;
 }
 
@@ -15,6 +15,7 @@
 #include "page-pipe.h"
 #include "util.h"
 #include "protobuf.h"
+#include "stats.h"
 #include "images/pagemap.pb-c.h"
 
 static int page_server_sk = -1;
@@ -96,10 +97,13 @@ static int write_pages_to_server(struct page_xfer *xfer,
 {
 	pr_debug("Splicing %lu bytes / %lu pages into socket\n", len, len / PAGE_SIZE);
 
+	timing_start(TIME_PAGE_SERVER);
 	if (splice(p, NULL, xfer->sk, NULL, len, SPLICE_F_MOVE) != len) {
 		pr_perror("Can't write pages to socket");
 		return -1;
 	}
+	timing_stop(TIME_PAGE_SERVER);
+	cnt_add(CNT_PAGE_SERVER_BYTES, len);
 
 	return 0;
 }
@@ -223,10 +227,23 @@ static int check_pagehole_in_parent(struct page_read *p, struct iovec *iov)
 	}
 }
 
+static int open_page_xfer_parent(struct page_xfer *xfer, int fd_type, long id);
+
 static int write_pagehole_loc(struct page_xfer *xfer, struct iovec *iov)
 {
 	PagemapEntry pe = PAGEMAP_ENTRY__INIT;
 
+	if (xfer->lazy_parent) {
+		xfer->lazy_parent = false;
+		if (open_page_xfer_parent(xfer, CR_FD_SYSVSHM_PAGEMAP, xfer->id))
+			return -1;
+		if (!xfer->parent) {
+			pr_err("Hole %p/%zu without parent images\n",
+					iov->iov_base, iov->iov_len);
+			return -1;
+		}
+	}
+
 	if (xfer->parent != NULL) {
 		int ret;
 
@@ -259,6 +276,35 @@ static void close_page_xfer(struct page_xfer *xfer)
 	close_image(xfer->pmi);
 }
 
+static int open_page_xfer_parent(struct page_xfer *xfer, int fd_type, long id)
+{
+	int ret;
+	int pfd;
+
+	pfd = openat(get_service_fd(IMG_FD_OFF), CR_PARENT_LINK, O_RDONLY);
+	if (pfd < 0 && errno == ENOENT)
+		return 0;
+
+	xfer->parent = xmalloc(sizeof(*xfer->parent));
+	if (!xfer->parent) {
+		close(pfd);
+		return -1;
+	}
+
+	ret = open_page_read_at(pfd, id, xfer->parent,
+			fd_type == CR_FD_PAGEMAP ? PR_TASK : PR_SYSVSHM);
+	if (ret <= 0) {
+		/* Pre-dumps don't dump IPC, so SysV shm may well have no parent */
+		if (ret < 0 || fd_type == CR_FD_PAGEMAP)
+			pr_perror("No parent image found, though parent directory is set");
+		xfree(xfer->parent);
+		xfer->parent = NULL;
+	}
+	close(pfd);
+
+	return 0;
+}
+
 static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
 {
 	xfer->pmi = open_image(fd_type, O_DUMP, id);
@@ -279,32 +325,11 @@ static int open_page_local_xfer(struct page_xfer *xfer, int fd_type, long id)
 	 *    to exist in parent (either pagemap or hole)
 	 */
 	xfer->parent = NULL;
-	if (fd_type == CR_FD_PAGEMAP) {
-		int ret;
-		int pfd;
-
-		pfd = openat(get_service_fd(IMG_FD_OFF), CR_PARENT_LINK, O_RDONLY);
-		if (pfd < 0 && errno == ENOENT)
-			goto out;
-
-		xfer->parent = xmalloc(sizeof(*xfer->parent));
-		if (!xfer->parent) {
-			close(pfd);
-			return -1;
-		}
-
-		ret = open_page_read_at(pfd, id, xfer->parent, PR_TASK);
-		if (ret <= 0) {
-			pr_perror("No parent image found, though parent directory is set");
-			xfree(xfer->parent);
-			xfer->parent = NULL;
-			close(pfd);
-			goto out;
-		}
-		close(pfd);
-	}
+	xfer->lazy_parent = fd_type == CR_FD_SYSVSHM_PAGEMAP;
+	xfer->id = id;
+	if (fd_type == CR_FD_PAGEMAP && open_page_xfer_parent(xfer, fd_type, id))
+		return -1;
 
-out:
 	xfer->write_pagemap = write_pagemap_loc;
 	xfer->write_pages = write_pages_loc;
 	xfer->write_hole = write_pagehole_loc;
@@ -425,6 +425,9 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 	case PR_SHMEM:
 		i_typ = CR_FD_SHMEM_PAGEMAP;
 		break;
+	case PR_SYSVSHM:
+		i_typ = CR_FD_SYSVSHM_PAGEMAP;
+		break;
 	default:
 		BUG();
 		return -1;
@@ -467,6 +470,7 @@ int open_page_read_at(int dfd, int pid, struct page_read *pr, int pr_flags)
 	pr->read_pages = read_pagemap_page;
 	pr->close = close_page_read;
 	pr->seek_page = seek_pagemap_page;
+	pr->skip_pages = skip_pagemap_pages;
 	pr->id = ids++;
 
 	pr_debug("Opened page read %u (parent %u)\n",
@@ -869,12 +869,15 @@ static bool task_in_parasite(struct parasite_ctl *ctl, user_regs_struct_t *regs)
 		addr < ctl->remote_map + ctl->map_length;
 }
 
-static int parasite_fini_seized(struct parasite_ctl *ctl)
+/*
+ * Make the daemon finish and let the task go to the rt_sigreturn,
+ * the caller has to trap it there with parasite_stop_on_syscall().
+ */
+static int parasite_fini_start(struct parasite_ctl *ctl, enum trace_flags *flag)
 {
 	pid_t pid = ctl->pid.real;
 	user_regs_struct_t regs;
 	int status, ret = 0;
-	enum trace_flags flag;
 
 	/* stop getting chld from parasite -- we're about to step-by-step it */
 	if (restore_child_handler())
@@ -915,14 +918,24 @@ static int parasite_fini_seized(struct parasite_ctl *ctl)
 		return -1;
 
 	/* Go to sigreturn as closer as we can */
-	ret = ptrace_stop_pie(pid, ctl->sigreturn_addr, &flag);
+	ret = ptrace_stop_pie(pid, ctl->sigreturn_addr, flag);
 	if (ret < 0)
 		return ret;
 
+	return 0;
+}
+
+static int parasite_fini_seized(struct parasite_ctl *ctl)
+{
+	enum trace_flags flag;
+
+	if (parasite_fini_start(ctl, &flag))
+		return -1;
+
 	if (parasite_stop_on_syscall(1, __NR_rt_sigreturn, flag))
 		return -1;
 
-	if (ptrace_flush_breakpoints(pid))
+	if (ptrace_flush_breakpoints(ctl->pid.real))
 		return -1;
 
 	/*
@@ -1075,6 +1088,133 @@ int parasite_cure_remote(struct parasite_ctl *ctl)
 	return ret;
 }
 
+static int parasite_keep(struct parasite_ctl *ctl);
+
+/*
+ * Stop the daemons of many tasks at once, the batched version of
+ * parasite_stop_daemon(). The ctls are linked by their cure_list.
+ * @fatal is set if the tasks are left in an unknown state.
+ */
+static int __parasite_stop_daemons(struct list_head *ctls, bool *fatal)
+{
+	struct parasite_ctl *ctl;
+	enum trace_flags flag = TRACE_ALL, f;
+	int nr = 0, ret = 0;
+
+	*fatal = false;
+
+	list_for_each_entry(ctl, ctls, cure_list) {
+		if (!ctl->daemonized)
+			continue;
+
+		/* See parasite_stop_daemon() */
+		if (ctl->tsock < 0) {
+			ret = -1;
+			continue;
+		}
+
+		if (parasite_fini_start(ctl, &f)) {
+			close_safe(&ctl->tsock);
+			ret = -1;
+			continue;
+		}
+
+		flag = f;
+		ctl->daemonized = false;
+		nr++;
+	}
+
+	if (nr) {
+		pr_info("Stopping %d parasite daemons\n", nr);
+		if (parasite_stop_on_syscall(nr, __NR_rt_sigreturn, flag)) {
+			*fatal = true;
+			return -1;
+		}
+	}
+
+	list_for_each_entry(ctl, ctls, cure_list) {
+		if (ctl->daemonized || !ctl->remote_map)
+			continue;
+
+		if (ptrace_flush_breakpoints(ctl->pid.real)) {
+			*fatal = true;
+			return -1;
+		}
+	}
+
+	return ret;
+}
+
+int parasite_stop_daemons(struct list_head *ctls)
+{
+	bool fatal;
+
+	return __parasite_stop_daemons(ctls, &fatal);
+}
+
+/*
+ * Cure remote parts of many tasks at once. Each step is started in
+ * all the tasks first and then all of them are trapped with a single
+ * parasite_stop_on_syscall() call, so they run it concurrently rather
+ * than one after another. The ctls are linked by their cure_list.
+ */
+int parasite_cure_remote_batch(struct list_head *ctls)
+{
+	struct parasite_ctl *ctl;
+	bool fatal;
+	int nr = 0, ret;
+
+	ret = __parasite_stop_daemons(ctls, &fatal);
+	if (fatal)
+		return -1;
+
+	list_for_each_entry(ctl, ctls, cure_list) {
+		struct parasite_unmap_args *args;
+		user_regs_struct_t regs = ctl->orig.regs;
+
+		if (ctl->daemonized || !ctl->remote_map)
+			continue;
+
+		if (ctl->keep && !parasite_keep(ctl)) {
+			if (restore_thread_ctx(ctl->pid.real, &ctl->orig))
+				ret = -1;
+			continue;
+		}
+
+		*ctl->addr_cmd = PARASITE_CMD_UNMAP;
+
+		args = parasite_args(ctl, struct parasite_unmap_args);
+		args->parasite_start = ctl->remote_map;
+		args->parasite_len = ctl->map_length;
+
+		if (parasite_run(ctl->pid.real, PTRACE_SYSCALL, ctl->parasite_ip,
+				 NULL, &regs, &ctl->orig)) {
+			ret = -1;
+			continue;
+		}
+
+		ctl->unmapping = true;
+		nr++;
+	}
+
+	if (nr) {
+		pr_info("Unmapping %d parasites\n", nr);
+		if (parasite_stop_on_syscall(nr, __NR_munmap, TRACE_ENTER))
+			ret = -1;
+	}
+
+	list_for_each_entry(ctl, ctls, cure_list) {
+		if (!ctl->unmapping)
+			continue;
+
+		ctl->unmapping = false;
+		if (restore_thread_ctx(ctl->pid.real, &ctl->orig))
+			ret = -1;
+	}
+
+	return ret;
+}
+
 int parasite_cure_local(struct parasite_ctl *ctl)
 {
 	int ret = 0;
@@ -1340,6 +1480,322 @@ static int parasite_start_daemon(struct parasite_ctl *ctl, struct pstree_item *i
 	return 0;
 }
 
+static void parasite_put_blob(struct parasite_ctl *ctl)
+{
+	pr_info("Putting parasite blob into %p->%p\n", ctl->local_map, ctl->remote_map);
+	memcpy(ctl->local_map, parasite_blob, sizeof(parasite_blob));
+
+	ELF_RELOCS_APPLY_PARASITE(ctl->local_map, ctl->remote_map);
+
+	ctl->parasite_ip	= (unsigned long)parasite_sym(ctl->remote_map, __export_parasite_head_start);
+	ctl->addr_cmd		= parasite_sym(ctl->local_map, __export_parasite_cmd);
+	ctl->addr_args		= parasite_sym(ctl->local_map, __export_parasite_args);
+}
+
+/*
+ * When a service session runs a series of pre-dumps, parasite blobs
+ * are left mapped in tasks between iterations, so that the next ones
+ * don't need to inject syscalls to map them again. The blobs are marked
+ * with MADV_DONTFORK not to get into children and are checked to be
+ * the same memfd/shmem file when found again. The table of kept blobs
+ * is shared with pre-dump workers forked by the session.
+ */
+#define NR_KEPT_PARASITES	(1 << 15)
+
+struct parasite_kept {
+	pid_t		pid;	/* 0 -- never used, -1 -- forgotten */
+	void		*remote_map;
+	unsigned long	map_length;
+	dev_t		dev;
+	ino_t		ino;
+};
+
+static struct parasite_kept *kept_parasites;
+
+int parasite_keep_init(void)
+{
+	kept_parasites = mmap(NULL, NR_KEPT_PARASITES * sizeof(struct parasite_kept),
+			      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (kept_parasites == MAP_FAILED) {
+		pr_perror("Can't map kept parasites table");
+		kept_parasites = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct parasite_kept *kept_find(pid_t pid, bool add)
+{
+	struct parasite_kept *pk, *slot = NULL;
+	unsigned int i;
+
+	for (i = 0; i < NR_KEPT_PARASITES; i++) {
+		pk = &kept_parasites[(pid + i) & (NR_KEPT_PARASITES - 1)];
+		if (pk->pid == pid)
+			return pk;
+		if (pk->pid <= 0 && !slot)
+			slot = pk;
+		if (pk->pid == 0)
+			break;
+	}
+
+	if (!add || !slot)
+		return NULL;
+
+	slot->pid = pid;
+	return slot;
+}
+
+static inline void kept_forget(struct parasite_kept *pk)
+{
+	pk->pid = -1;
+}
+
+static int parasite_map_stat(struct parasite_ctl *ctl, struct stat *st)
+{
+	int fd;
+
+	fd = open_proc(ctl->pid.real, "map_files/%p-%p",
+		       ctl->remote_map, ctl->remote_map + ctl->map_length);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, st)) {
+		pr_perror("Can't stat parasite map");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/*
+ * Map the kept blob locally. Returns 1 if the task
+ * doesn't have it anymore (e.g. after execve).
+ */
+static int kept_map_local(struct parasite_ctl *ctl, struct parasite_kept *pk)
+{
+	struct stat st;
+	int fd;
+
+	fd = __open_proc(ctl->pid.real, ENOENT, O_RDWR, "map_files/%p-%p",
+			 pk->remote_map, pk->remote_map + pk->map_length);
+	if (fd < 0)
+		return errno == ENOENT ? 1 : -1;
+
+	if (fstat(fd, &st)) {
+		pr_perror("Can't stat kept parasite map");
+		close(fd);
+		return -1;
+	}
+
+	if (st.st_dev != pk->dev || st.st_ino != pk->ino) {
+		close(fd);
+		return 1;
+	}
+
+	ctl->local_map = mmap(NULL, pk->map_length, PROT_READ | PROT_WRITE,
+			      MAP_SHARED | MAP_FILE, fd, 0);
+	close(fd);
+	if (ctl->local_map == MAP_FAILED) {
+		ctl->local_map = NULL;
+		pr_perror("Can't map kept parasite");
+		return -1;
+	}
+
+	ctl->remote_map = pk->remote_map;
+	ctl->map_length = pk->map_length;
+	ctl->keep_dev = pk->dev;
+	ctl->keep_ino = pk->ino;
+	return 0;
+}
+
+/* The task should be stopped */
+static int parasite_drop_one(pid_t pid, struct parasite_kept *pk)
+{
+	struct parasite_unmap_args *args;
+	struct parasite_ctl *ctl;
+	int ret;
+
+	ctl = parasite_prep_ctl(pid, NULL);
+	if (!ctl)
+		return -1;
+
+	ret = kept_map_local(ctl, pk);
+	if (ret == 0) {
+		pr_info("Dropping kept parasite in %d\n", pid);
+		parasite_put_blob(ctl);
+
+		*ctl->addr_cmd = PARASITE_CMD_UNMAP;
+
+		args = parasite_args(ctl, struct parasite_unmap_args);
+		args->parasite_start = ctl->remote_map;
+		args->parasite_len = ctl->map_length;
+		ret = parasite_unmap(ctl, ctl->parasite_ip);
+	} else if (ret > 0)
+		ret = 0;
+
+	if (ret == 0)
+		kept_forget(pk);
+
+	parasite_cure_local(ctl);
+	return ret;
+}
+
+static int parasite_drop_seize(pid_t pid, struct parasite_kept *pk)
+{
+	int status, ret;
+
+	if (ptrace(PTRACE_SEIZE, pid, NULL, 0)) {
+		if (errno == ESRCH) {
+			kept_forget(pk);
+			return 0;
+		}
+
+		pr_perror("Can't seize %d to drop parasite", pid);
+		return -1;
+	}
+
+	if (ptrace(PTRACE_INTERRUPT, pid, NULL, NULL)) {
+		pr_perror("Can't interrupt %d", pid);
+		ret = -1;
+		goto out;
+	}
+
+	if (wait4(pid, &status, __WALL, NULL) != pid || !WIFSTOPPED(status)) {
+		/* The task has gone and its blob with it */
+		kept_forget(pk);
+		return 0;
+	}
+
+	ret = parasite_drop_one(pid, pk);
+out:
+	if (ptrace(PTRACE_DETACH, pid, NULL, NULL)) {
+		pr_perror("Can't detach from %d", pid);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Remove all kept blobs and stop keeping them. Tasks of the
+ * dumped tree (@in_tree) are already seized, others are seized
+ * for a while here.
+ */
+int parasite_drop_kept(bool in_tree)
+{
+	struct parasite_kept *pk;
+	int i, ret = 0;
+
+	if (!kept_parasites)
+		return 0;
+
+	for (i = 0; i < NR_KEPT_PARASITES; i++) {
+		struct pstree_item *item = NULL;
+
+		pk = &kept_parasites[i];
+		if (pk->pid <= 0)
+			continue;
+
+		if (in_tree)
+			item = pstree_item_by_real(pk->pid);
+
+		if (!item)
+			ret |= parasite_drop_seize(pk->pid, pk);
+		else if (item->pid.state == TASK_DEAD)
+			kept_forget(pk);
+		else
+			ret |= parasite_drop_one(pk->pid, pk);
+	}
+
+	munmap(kept_parasites, NR_KEPT_PARASITES * sizeof(struct parasite_kept));
+	kept_parasites = NULL;
+	return ret;
+}
+
+/*
+ * Returns 1 if the kept blob is used for @ctl and 0
+ * if it is to be mapped as usual.
+ */
+static int parasite_reuse_kept(struct parasite_ctl *ctl, unsigned long size)
+{
+	struct parasite_kept *pk;
+	int ret;
+
+	if (!kept_parasites)
+		return 0;
+
+	pk = kept_find(ctl->pid.real, false);
+	if (!pk)
+		return 0;
+
+	if (pk->map_length < size) {
+		pr_info("Kept parasite in %d is too small\n", ctl->pid.real);
+		return parasite_drop_one(ctl->pid.real, pk);
+	}
+
+	ret = kept_map_local(ctl, pk);
+	if (ret < 0)
+		return -1;
+
+	kept_forget(pk);
+	if (ret > 0) {
+		pr_info("Kept parasite in %d is gone\n", ctl->pid.real);
+		return 0;
+	}
+
+	pr_info("Reusing kept parasite in %d at %p\n", ctl->pid.real, ctl->remote_map);
+	return 1;
+}
+
+static int parasite_prep_keep(struct parasite_ctl *ctl)
+{
+	unsigned long sret = -ENOSYS;
+	struct stat st;
+	int ret;
+
+	ret = syscall_seized(ctl, __NR_madvise, &sret, (unsigned long)ctl->remote_map,
+			     ctl->map_length, MADV_DONTFORK, 0, 0, 0);
+	if (ret < 0 || sret) {
+		pr_err("Can't mark parasite in %d with MADV_DONTFORK (%ld)\n",
+		       ctl->pid.real, (long)sret);
+		return -1;
+	}
+
+	if (parasite_map_stat(ctl, &st))
+		return -1;
+
+	ctl->keep_dev = st.st_dev;
+	ctl->keep_ino = st.st_ino;
+	return 0;
+}
+
+/* Called instead of unmapping the blob on cure */
+static int parasite_keep(struct parasite_ctl *ctl)
+{
+	struct parasite_kept *pk;
+
+	if (!kept_parasites)
+		return -1;
+
+	pk = kept_find(ctl->pid.real, true);
+	if (!pk) {
+		pr_warn("No room to keep parasite in %d\n", ctl->pid.real);
+		return -1;
+	}
+
+	pk->remote_map = ctl->remote_map;
+	pk->map_length = ctl->map_length;
+	pk->dev = ctl->keep_dev;
+	pk->ino = ctl->keep_ino;
+
+	pr_info("Keeping parasite in %d at %p\n", ctl->pid.real, ctl->remote_map);
+	return 0;
+}
+
 struct parasite_ctl *parasite_infect_seized(pid_t pid, struct pstree_item *item,
 		struct vm_area_list *vma_area_list)
 {
@@ -1367,24 +1823,29 @@ struct parasite_ctl *parasite_infect_seized(pid_t pid, struct pstree_item *item,
 	parasite_args_size = PARASITE_ARG_SIZE_MIN; /* reset for next task */
 	map_exchange_size = pie_size(parasite_blob) + ctl->args_size;
 	map_exchange_size += RESTORE_STACK_SIGFRAME + PARASITE_STACK_SIZE;
-	if (item->nr_threads > 1)
+	/* A kept blob may be reused when the task gets more threads */
+	if (item->nr_threads > 1 || kept_parasites)
 		map_exchange_size += PARASITE_STACK_SIZE;
 
 	memcpy(&item->core[0]->tc->blk_sigset, &ctl->orig.sigmask, sizeof(k_rtsigset_t));
 
-	ret = parasite_map_exchange(ctl, map_exchange_size);
-	if (ret)
+	ret = parasite_reuse_kept(ctl, map_exchange_size);
+	if (ret < 0)
 		goto err_restore;
 
-	pr_info("Putting parasite blob into %p->%p\n", ctl->local_map, ctl->remote_map);
-	memcpy(ctl->local_map, parasite_blob, sizeof(parasite_blob));
+	if (ret == 0) {
+		ret = parasite_map_exchange(ctl, map_exchange_size);
+		if (ret)
+			goto err_restore;
 
-	ELF_RELOCS_APPLY_PARASITE(ctl->local_map, ctl->remote_map);
+		if (kept_parasites && parasite_prep_keep(ctl))
+			goto err_restore;
+	}
+
+	ctl->keep = kept_parasites != NULL;
 
 	/* Setup the rest of a control block */
-	ctl->parasite_ip	= (unsigned long)parasite_sym(ctl->remote_map, __export_parasite_head_start);
-	ctl->addr_cmd		= parasite_sym(ctl->local_map, __export_parasite_cmd);
-	ctl->addr_args		= parasite_sym(ctl->local_map, __export_parasite_args);
+	parasite_put_blob(ctl);
 
 	p = pie_size(parasite_blob) + ctl->args_size;
 
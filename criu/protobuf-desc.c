@@ -64,6 +64,7 @@
 #include "images/seccomp.pb-c.h"
 #include "images/binfmt-misc.pb-c.h"
 #include "images/autofs.pb-c.h"
+#include "images/tmpfs.pb-c.h"
 
 struct cr_pb_message_desc cr_pb_descs[PB_MAX];
 
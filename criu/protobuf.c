@@ -172,6 +172,38 @@ err:
 	return ret;
 }
 
+/*
+ * Packs PB record (header + packed object pointed by @obj) into
+ * @buf of @len bytes, so that the caller can write many records
+ * with a single bwritev() call.
+ *
+ * Returns the record size on success, -1 on error
+ */
+int pb_pack_one(void *obj, int type, void *buf, int len)
+{
+	u32 size, packed;
+
+	if (!cr_pb_descs[type].pb_desc) {
+		pr_err("Wrong object requested %d\n", type);
+		return -1;
+	}
+
+	size = cr_pb_descs[type].getpksize(obj);
+	if (size + sizeof(size) > len) {
+		pr_err("No room for PB object %p (%u/%d)\n", obj, size, len);
+		return -1;
+	}
+
+	packed = cr_pb_descs[type].pack(obj, buf + sizeof(size));
+	if (packed != size) {
+		pr_err("Failed packing PB object %p\n", obj);
+		return -1;
+	}
+
+	memcpy(buf, &size, sizeof(size));
+	return size + sizeof(size);
+}
+
 int collect_image(struct collect_image_info *cinfo)
 {
 	int ret;
@@ -4,6 +4,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <sys/wait.h>
@@ -21,29 +22,116 @@
 
 #define NR_ATTEMPTS 5
 
+/*
+ * Freezer state is re-checked after FREEZE_STEP_MIN usec first,
+ * then the step is doubled up to FREEZE_STEP_MAX. The cgroup is
+ * given FREEZE_TIMEOUT usec to freeze in total.
+ */
+#define FREEZE_STEP_MIN		1000
+#define FREEZE_STEP_MAX		100000
+#define FREEZE_TIMEOUT		1500000
+
 static const char frozen[]	= "FROZEN";
 static const char freezing[]	= "FREEZING";
 static const char thawed[]	= "THAWED";
 
+/*
+ * Cgroup-v2 has no freezer.state. Tasks are frozen by writing 1 into
+ * cgroup.freeze and the "frozen" key in cgroup.events shows when all
+ * of them are. Pollers of cgroup.events are notified on its changes.
+ */
+static bool cgroup_v2;
+static int freezer_events_fd = -1;
+
+static int freezer_open(void)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/cgroup.freeze", opts.freeze_cgroup);
+	if (access(path, F_OK) == 0)
+		cgroup_v2 = true;
+	else
+		snprintf(path, sizeof(path), "%s/freezer.state", opts.freeze_cgroup);
+
+	fd = open(path, O_RDWR);
+	if (fd < 0)
+		pr_perror("Unable to open %s", path);
+
+	return fd;
+}
+
+static int freezer_write_state(int fd, const char *state)
+{
+	const char *val = state;
+	size_t len = strlen(state) + 1;
+
+	if (cgroup_v2) {
+		val = (state == thawed) ? "0" : "1";
+		len = 1;
+	}
+
+	lseek(fd, 0, SEEK_SET);
+	if (write(fd, val, len) != len)
+		return -1;
+
+	return 0;
+}
+
+static int freezer_read(int fd, char *buf, int size)
+{
+	int ret;
+
+	lseek(fd, 0, SEEK_SET);
+	ret = read(fd, buf, size - 1);
+	if (ret <= 0) {
+		pr_perror("Unable to get a current state");
+		return -1;
+	}
+	if (buf[ret - 1] == '\n')
+		buf[ret - 1] = 0;
+	else
+		buf[ret] = 0;
+
+	return 0;
+}
+
+static const char *get_freezer_v2_state(int fd)
+{
+	char buf[PAGE_SIZE], *key;
+
+	if (freezer_read(fd, buf, sizeof(buf)))
+		return NULL;
+
+	pr_debug("cgroup.freeze=%s\n", buf);
+	if (strcmp(buf, "0") == 0)
+		return thawed;
+
+	if (freezer_read(freezer_events_fd, buf, sizeof(buf)))
+		return NULL;
+
+	key = strstr(buf, "frozen ");
+	if (!key) {
+		pr_err("No frozen key in cgroup.events\n");
+		return NULL;
+	}
+
+	return key[strlen("frozen ")] == '1' ? frozen : freezing;
+}
+
 static const char *get_freezer_state(int fd)
 {
 	char state[32];
-	int ret;
 
 	BUILD_BUG_ON((sizeof(state) < sizeof(frozen))	||
 		     (sizeof(state) < sizeof(freezing))	||
 		     (sizeof(state) < sizeof(thawed)));
 
-	lseek(fd, 0, SEEK_SET);
-	ret = read(fd, state, sizeof(state) - 1);
-	if (ret <= 0) {
-		pr_perror("Unable to get a current state");
+	if (cgroup_v2)
+		return get_freezer_v2_state(fd);
+
+	if (freezer_read(fd, state, sizeof(state)))
 		goto err;
-	}
-	if (state[ret - 1] == '\n')
-		state[ret - 1] = 0;
-	else
-		state[ret] = 0;
 
 	pr_debug("freezer.state=%s\n", state);
 	if (strcmp(state, frozen) == 0)
@@ -58,6 +146,36 @@ err:
 	return NULL;
 }
 
+/*
+ * Wait for the cgroup to change its state. With v1 there is
+ * no way to wait for it, so sleep with a growing step.
+ */
+static int freezer_wait(unsigned long *step)
+{
+	struct timespec req = {};
+
+	if (cgroup_v2) {
+		struct pollfd pfd = {
+			.fd	= freezer_events_fd,
+			.events	= POLLPRI,
+		};
+
+		if (poll(&pfd, 1, FREEZE_STEP_MAX / 1000) < 0 && errno != EINTR) {
+			pr_perror("Unable to poll cgroup.events");
+			return -1;
+		}
+
+		return 0;
+	}
+
+	req.tv_nsec = (*step % 1000000) * 1000;
+	req.tv_sec = *step / 1000000;
+	nanosleep(&req, NULL);
+
+	*step = min(*step * 2, (unsigned long)FREEZE_STEP_MAX);
+	return 0;
+}
+
 static bool freezer_thawed;
 
 const char *get_real_freezer_state(void)
@@ -68,19 +186,15 @@ const char *get_real_freezer_state(void)
 static int freezer_restore_state(void)
 {
 	int fd;
-	char path[PATH_MAX];
 
 	if (!opts.freeze_cgroup || freezer_thawed)
 		return 0;
 
-	snprintf(path, sizeof(path), "%s/freezer.state", opts.freeze_cgroup);
-	fd = open(path, O_RDWR);
-	if (fd < 0) {
-		pr_perror("Unable to open %s", path);
+	fd = freezer_open();
+	if (fd < 0)
 		return -1;
-	}
 
-	if (write(fd, frozen, sizeof(frozen)) != sizeof(frozen)) {
+	if (freezer_write_state(fd, frozen)) {
 		pr_perror("Unable to freeze tasks");
 		close(fd);
 		return -1;
@@ -100,7 +214,8 @@ static int seize_cgroup_tree(char *root_path, const char *state)
 	 * New tasks can appear while a freezer state isn't
 	 * frozen, so we need to catch all new tasks.
 	 */
-	snprintf(path, sizeof(path), "%s/tasks", root_path);
+	snprintf(path, sizeof(path), "%s/%s", root_path,
+		 cgroup_v2 ? "cgroup.threads" : "tasks");
 	f = fopen(path, "r");
 	if (f == NULL) {
 		pr_perror("Unable to open %s", path);
@@ -245,41 +360,45 @@ static int freezer_detach(void)
 
 static int freeze_processes(void)
 {
-	int i, fd, exit_code = -1;
+	int fd, exit_code = -1;
 	char path[PATH_MAX];
 	const char *state = thawed;
+	unsigned long step = FREEZE_STEP_MIN;
+	struct timeval start;
 
-	snprintf(path, sizeof(path), "%s/freezer.state", opts.freeze_cgroup);
-	fd = open(path, O_RDWR);
-	if (fd < 0) {
-		pr_perror("Unable to open %s", path);
+	fd = freezer_open();
+	if (fd < 0)
 		return -1;
+
+	if (cgroup_v2) {
+		snprintf(path, sizeof(path), "%s/cgroup.events", opts.freeze_cgroup);
+		freezer_events_fd = open(path, O_RDONLY);
+		if (freezer_events_fd < 0) {
+			pr_perror("Unable to open %s", path);
+			close(fd);
+			return -1;
+		}
 	}
+
 	state = get_freezer_state(fd);
-	if (!state) {
-		close(fd);
-		return -1;
-	}
+	if (!state)
+		goto out;
 	if (state == thawed) {
 		freezer_thawed = true;
 
-		lseek(fd, 0, SEEK_SET);
-		if (write(fd, frozen, sizeof(frozen)) != sizeof(frozen)) {
+		if (freezer_write_state(fd, frozen)) {
 			pr_perror("Unable to freeze tasks");
-			close(fd);
-			return -1;
+			goto out;
 		}
 	}
 
 	/*
-	 * There is not way to wait a specified state, so we need to poll the
-	 * freezer.state.
-	 * Here is one extra attempt to check that everything are frozen.
+	 * Wait for the cgroup to get frozen seizing tasks in it.
+	 * Once it is, enumerate all tasks one more time to collect
+	 * new ones, which can be born while the cgroup is being frozen.
 	 */
-	for (i = 0; i <= NR_ATTEMPTS; i++) {
-		struct timespec req = {};
-		u64 timeout;
-
+	gettimeofday(&start, NULL);
+	while (1) {
 		if (seize_cgroup_tree(opts.freeze_cgroup, state) < 0)
 			goto err;
 
@@ -290,38 +409,32 @@ static int freeze_processes(void)
 		if (!state)
 			goto err;
 
-		if (state == frozen) {
-			/*
-			 * Enumerate all tasks one more time to collect all new
-			 * tasks, which can be born while the cgroup is being frozen.
-			 */
-
+		if (state == frozen)
 			continue;
-		}
 
 		if (alarm_timeouted())
 			goto err;
 
-		timeout = 100000000 * (i + 1); /* 100 msec */
-		req.tv_nsec = timeout % 1000000000;
-		req.tv_sec = timeout / 1000000000;
-		nanosleep(&req, NULL);
-	}
+		if (usec_since(&start) >= FREEZE_TIMEOUT) {
+			pr_err("Unable to freeze cgroup %s\n", opts.freeze_cgroup);
+			goto err;
+		}
 
-	if (i > NR_ATTEMPTS) {
-		pr_err("Unable to freeze cgroup %s\n", opts.freeze_cgroup);
-		goto err;
+		if (freezer_wait(&step))
+			goto err;
 	}
 
+	pr_info("Cgroup %s frozen in %lu usec\n", opts.freeze_cgroup, usec_since(&start));
 	exit_code = 0;
 err:
 	if (exit_code == 0 || freezer_thawed) {
-		lseek(fd, 0, SEEK_SET);
-		if (write(fd, thawed, sizeof(thawed)) != sizeof(thawed)) {
+		if (freezer_write_state(fd, thawed)) {
 			pr_perror("Unable to thaw tasks");
 			exit_code = -1;
 		}
 	}
+out:
+	close_safe(&freezer_events_fd);
 	if (close(fd)) {
 		pr_perror("Unable to thaw tasks");
 		return -1;
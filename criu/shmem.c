@@ -2,6 +2,7 @@
 #include <sys/mman.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <string.h>
 
 #include "list.h"
 #include "pid.h"
@@ -357,12 +358,13 @@ static int shmem_wait_and_open(int pid, struct shmem_info *si, VmaEntry *vi)
 	return 0;
 }
 
-static int restore_shmem_content(void *addr, struct shmem_info *si)
+static int do_restore_shmem_content(void *addr, unsigned long size,
+				    unsigned long shmid, int pr_flags)
 {
 	int ret = 0;
 	struct page_read pr;
 
-	ret = open_page_read(si->shmid, &pr, PR_SHMEM);
+	ret = open_page_read(shmid, &pr, pr_flags);
 	if (ret <= 0)
 		return -1;
 
@@ -378,10 +380,12 @@ static int restore_shmem_content(void *addr, struct shmem_info *si)
 		vaddr = (unsigned long)iov.iov_base;
 		nr_pages = iov.iov_len / PAGE_SIZE;
 
-		if (vaddr + nr_pages * PAGE_SIZE > si->size)
+		if (vaddr + nr_pages * PAGE_SIZE > size)
 			break;
 
-		pr.read_pages(&pr, vaddr, nr_pages, addr + vaddr);
+		ret = pr.read_pages(&pr, vaddr, nr_pages, addr + vaddr);
+		if (ret < 0)
+			break;
 
 		if (pr.put_pagemap)
 			pr.put_pagemap(&pr);
@@ -391,6 +395,17 @@ static int restore_shmem_content(void *addr, struct shmem_info *si)
 	return ret;
 }
 
+static int restore_shmem_content(void *addr, struct shmem_info *si)
+{
+	return do_restore_shmem_content(addr, si->size, si->shmid, PR_SHMEM);
+}
+
+int restore_sysv_shmem_content(void *addr, unsigned long size, unsigned long shmid)
+{
+	return do_restore_shmem_content(addr, round_up(size, PAGE_SIZE),
+					shmid, PR_SYSVSHM);
+}
+
 static int open_shmem(int pid, struct vma_area *vma)
 {
 	VmaEntry *vi = vma->e;
@@ -525,35 +540,115 @@ static int dump_pages(struct page_pipe *pp, struct page_xfer *xfer, void *addr)
 	return page_xfer_dump_pages(xfer, pp, (unsigned long)addr);
 }
 
-static int dump_one_shmem(struct shmem_info *si)
+/*
+ * Checksum of a page of SysV shmem. Pages that have the same one as
+ * in the parent images are not dumped again, see dump_shmem_pages().
+ * Zero means there's no page in images.
+ */
+#define CSUM_PRIME1	0x9e3779b185ebca87ULL
+#define CSUM_PRIME2	0xc2b2ae3d27d4eb4fULL
+
+static inline u64 csum_round(u64 acc, u64 val)
+{
+	acc += val * CSUM_PRIME2;
+	acc = (acc << 31) | (acc >> 33);
+	return acc * CSUM_PRIME1;
+}
+
+static u64 shmem_page_csum(const void *page)
+{
+	const u64 *p = page;
+	u64 acc[4] = { CSUM_PRIME1, CSUM_PRIME2, 0, -CSUM_PRIME1 }, h;
+	unsigned int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(u64); i += 4) {
+		acc[0] = csum_round(acc[0], p[i]);
+		acc[1] = csum_round(acc[1], p[i + 1]);
+		acc[2] = csum_round(acc[2], p[i + 2]);
+		acc[3] = csum_round(acc[3], p[i + 3]);
+	}
+
+	h = csum_round(acc[0], acc[1]);
+	h = csum_round(h, acc[2]);
+	h = csum_round(h, acc[3]);
+
+	h ^= h >> 33;
+	h *= CSUM_PRIME2;
+	h ^= h >> 29;
+
+	return h ? : 1;
+}
+
+static int open_shmem_parent(struct page_read *ppr, unsigned long shmid)
+{
+	bool dedup = opts.auto_dedup;
+	int pfd, ret;
+
+	/* With page server the parent's pages are not here to compare */
+	if (opts.use_page_server)
+		return 0;
+
+	pfd = openat(get_service_fd(IMG_FD_OFF), CR_PARENT_LINK, O_RDONLY);
+	if (pfd < 0)
+		return 0;
+
+	/* The parent is only read from, see shmem_page_in_parent() */
+	opts.auto_dedup = false;
+	ret = open_page_read_at(pfd, shmid, ppr, PR_SYSVSHM);
+	opts.auto_dedup = dedup;
+
+	close(pfd);
+	return ret;
+}
+
+/*
+ * Checksums may collide, so a page whose checksum is the same as the
+ * parent's one is also compared with the parent's page byte by byte.
+ * That page is only looked at, thus auto-dedup mustn't punch it out.
+ */
+static int shmem_page_in_parent(struct page_read *ppr, unsigned long vaddr,
+				const void *page, void *buf)
+{
+	bool dedup = opts.auto_dedup;
+	int ret;
+
+	ret = ppr->seek_page(ppr, vaddr, false);
+	if (ret <= 0)
+		return ret;
+
+	opts.auto_dedup = false;
+	ret = ppr->read_pages(ppr, vaddr, 1, buf);
+	opts.auto_dedup = dedup;
+	if (ret < 0)
+		return -1;
+
+	return !memcmp(page, buf, PAGE_SIZE);
+}
+
+/*
+ * Dump pages of shmem mapped at @addr. Non-resident pages are
+ * skipped. If @csums is given, checksums of dumped pages are put
+ * there and pages equal to the parent's ones (their checksums in
+ * @pcsums match and then the contents do) are dumped as holes.
+ */
+static int dump_shmem_pages(void *addr, unsigned long size, int fd_type,
+			    unsigned long shmid, u64 *csums,
+			    const u64 *pcsums, unsigned long nr_pcsums)
 {
 	struct iovec *iovs;
 	struct page_pipe *pp;
 	struct page_xfer xfer;
-	int err, ret = -1, fd;
+	struct page_read ppr;
+	int err, ret = -1;
 	unsigned char *map = NULL;
-	void *addr = NULL;
 	unsigned long pfn, nrpages;
+	void *pbuf = NULL;
 
-	pr_info("Dumping shared memory %ld\n", si->shmid);
-
-	nrpages = (si->size + PAGE_SIZE - 1) / PAGE_SIZE;
+	nrpages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
 	map = xmalloc(nrpages * sizeof(*map));
 	if (!map)
 		goto err;
 
-	fd = open_proc(si->pid, "map_files/%lx-%lx", si->start, si->end);
-	if (fd < 0)
-		goto err;
-
-	addr = mmap(NULL, si->size, PROT_READ, MAP_SHARED, fd, 0);
-	close(fd);
-	if (addr == MAP_FAILED) {
-		pr_err("Can't map shmem 0x%lx (0x%lx-0x%lx)\n",
-				si->shmid, si->start, si->end);
-		goto err;
-	}
-
 	/*
 	 * We can't use pagemap here, because this vma is
 	 * not mapped to us at all, but mincore reports the
@@ -561,27 +656,60 @@ static int dump_one_shmem(struct shmem_info *si)
 	 * this case.
 	 */
 
-	err = mincore(addr, si->size, map);
+	err = mincore(addr, size, map);
 	if (err)
-		goto err_unmap;
+		goto err;
 
 	iovs = xmalloc(((nrpages + 1) / 2) * sizeof(struct iovec));
 	if (!iovs)
-		goto err_unmap;
+		goto err;
 
 	pp = create_page_pipe((nrpages + 1) / 2, iovs, true);
 	if (!pp)
 		goto err_iovs;
 
-	err = open_page_xfer(&xfer, CR_FD_SHMEM_PAGEMAP, si->shmid);
+	if (nr_pcsums) {
+		pbuf = xmalloc(PAGE_SIZE);
+		if (!pbuf)
+			goto err_pp;
+
+		err = open_shmem_parent(&ppr, shmid);
+		if (err < 0)
+			goto err_pp;
+		if (!err)
+			nr_pcsums = 0;
+	}
+
+	err = open_page_xfer(&xfer, fd_type, shmid);
 	if (err)
-		goto err_pp;
+		goto err_ppr;
 
 	for (pfn = 0; pfn < nrpages; pfn++) {
+		unsigned long pgaddr;
+
 		if (!(map[pfn] & PAGE_RSS))
 			continue;
+
+		pgaddr = (unsigned long)addr + pfn * PAGE_SIZE;
+		if (csums) {
+			csums[pfn] = shmem_page_csum((void *)pgaddr);
+			if (pfn < nr_pcsums && pcsums[pfn] == csums[pfn]) {
+				ret = shmem_page_in_parent(&ppr, pfn * PAGE_SIZE,
+							   (void *)pgaddr, pbuf);
+				if (ret < 0)
+					goto err_xfer;
+			} else
+				ret = 0;
+
+			if (ret) {
+				ret = page_pipe_add_hole(pp, pgaddr);
+				if (ret)
+					goto err_xfer;
+				continue;
+			}
+		}
 again:
-		ret = page_pipe_add_page(pp, (unsigned long)addr + pfn * PAGE_SIZE);
+		ret = page_pipe_add_page(pp, pgaddr);
 		if (ret == -EAGAIN) {
 			ret = dump_pages(pp, &xfer, addr);
 			if (ret)
@@ -596,17 +724,53 @@ again:
 
 err_xfer:
 	xfer.close(&xfer);
+err_ppr:
+	if (nr_pcsums)
+		ppr.close(&ppr);
 err_pp:
+	xfree(pbuf);
 	destroy_page_pipe(pp);
 err_iovs:
 	xfree(iovs);
-err_unmap:
-	munmap(addr,  si->size);
 err:
 	xfree(map);
 	return ret;
 }
 
+static int dump_one_shmem(struct shmem_info *si)
+{
+	void *addr;
+	int fd, ret;
+
+	pr_info("Dumping shared memory %ld\n", si->shmid);
+
+	fd = open_proc(si->pid, "map_files/%lx-%lx", si->start, si->end);
+	if (fd < 0)
+		return -1;
+
+	addr = mmap(NULL, si->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		pr_err("Can't map shmem 0x%lx (0x%lx-0x%lx)\n",
+				si->shmid, si->start, si->end);
+		return -1;
+	}
+
+	ret = dump_shmem_pages(addr, si->size, CR_FD_SHMEM_PAGEMAP,
+			       si->shmid, NULL, NULL, 0);
+	munmap(addr,  si->size);
+	return ret;
+}
+
+int dump_sysv_shmem(void *addr, unsigned long size, unsigned long shmid,
+		    u64 *csums, const u64 *pcsums, unsigned long nr_pcsums)
+{
+	pr_info("Dumping SysV shared memory %ld\n", shmid);
+
+	return dump_shmem_pages(addr, size, CR_FD_SYSVSHM_PAGEMAP,
+				shmid, csums, pcsums, nr_pcsums);
+}
+
 int cr_dump_shmem(void)
 {
 	int ret = 0, i;
@@ -63,6 +63,20 @@ static struct inet_port *port_add(int type, int port)
 	return e;
 }
 
+/*
+ * Repaired connections' bind()-s and connect()-s on a port are
+ * serialized with listen()-s on it.
+ */
+void inet_port_lock(struct inet_sk_info *ii)
+{
+	mutex_lock(&ii->port->reuseaddr_lock);
+}
+
+void inet_port_unlock(struct inet_sk_info *ii)
+{
+	mutex_unlock(&ii->port->reuseaddr_lock);
+}
+
 static void show_one_inet(const char *act, const struct inet_sk_desc *sk)
 {
 	char src_addr[INET_ADDR_LEN] = "<unknown>";
@@ -231,7 +245,8 @@ static struct inet_sk_desc *gen_uncon_sk(int lfd, const struct fd_parms *p, int
 
 	sk->state = TCP_CLOSE;
 
-	sk_collect_one(sk->sd.ino, sk->sd.family, &sk->sd);
+	if (sk_collect_one(sk->sd.ino, sk->sd.family, &sk->sd))
+		goto err;
 
 	return sk;
 err:
@@ -596,12 +611,8 @@ static int open_inet_sk(struct file_desc *d)
 			goto err;
 		}
 
-		mutex_lock(&ii->port->reuseaddr_lock);
-		if (restore_one_tcp(sk, ii)) {
-			mutex_unlock(&ii->port->reuseaddr_lock);
+		if (restore_one_tcp(sk, ii))
 			goto err;
-		}
-		mutex_unlock(&ii->port->reuseaddr_lock);
 
 		goto done;
 	}
@@ -4,11 +4,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <string.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/sendfile.h>
+#include <sys/uio.h>
 
 #include "asm/types.h"
 #include "list.h"
@@ -19,6 +21,7 @@
 #include "util.h"
 #include "util-pie.h"
 #include "sockets.h"
+#include "asm/page.h"
 
 #include "sk-queue.h"
 
@@ -59,11 +62,101 @@ struct collect_image_info sk_queues_cinfo = {
 	.collect = collect_one_packet,
 };
 
+/*
+ * Packets are peeked with recvmmsg() in batches into the arena
+ * slots and each batch goes into the image with one bwritev().
+ * Packets not fitting the slot are peeked one by one into the
+ * SO_SNDBUF-sized buffer.
+ */
+#define SK_QUEUE_BATCH		64
+#define SK_QUEUE_SLOT		(4 * PAGE_SIZE)
+#define SK_QUEUE_HDR		32	/* u32 size + packed sk_packet_entry */
+
+struct sk_queue_arena {
+	char			data[SK_QUEUE_BATCH][SK_QUEUE_SLOT];
+	char			hdr[SK_QUEUE_BATCH][SK_QUEUE_HDR];
+	struct iovec		iov[SK_QUEUE_BATCH];
+	struct mmsghdr		msgs[SK_QUEUE_BATCH];
+	struct iovec		wiov[2 * SK_QUEUE_BATCH];
+};
+
+static struct sk_queue_arena *sk_queue_arena;
+
+static int dump_sk_packet_big(int sock_fd, SkPacketEntry *pe, void *data, int size)
+{
+	struct cr_img *img = img_from_set(glob_imgset, CR_FD_SK_QUEUES);
+	struct iovec iov = {
+		.iov_base	= data,
+		.iov_len	= size,
+	};
+	struct msghdr msg = {
+		.msg_iov	= &iov,
+		.msg_iovlen	= 1,
+	};
+	int ret;
+
+	ret = recvmsg(sock_fd, &msg, MSG_DONTWAIT | MSG_PEEK);
+	if (ret < 0) {
+		pr_perror("recvmsg fail: error");
+		return -1;
+	}
+	if (msg.msg_flags & MSG_TRUNC) {
+		/*
+		 * DGRAM truncated. This should not happen. But we have
+		 * to check...
+		 */
+		pr_err("sys_recvmsg failed: truncated\n");
+		return -E2BIG;
+	}
+
+	pe->length = ret;
+	if (pb_write_one(img, pe, PB_SK_QUEUES) < 0)
+		return -EIO;
+	if (write_img_buf(img, data, pe->length) < 0)
+		return -EIO;
+
+	return 0;
+}
+
+/*
+ * Puts the nr peeked packets from the arena into the image.
+ */
+static int dump_sk_packets(struct sk_queue_arena *a, SkPacketEntry *pe, int nr)
+{
+	struct cr_img *img = img_from_set(glob_imgset, CR_FD_SK_QUEUES);
+	int i, len, total = 0;
+
+	if (!nr)
+		return 0;
+
+	for (i = 0; i < nr; i++) {
+		pe->length = a->msgs[i].msg_len;
+		len = pb_pack_one(pe, PB_SK_QUEUES, a->hdr[i], SK_QUEUE_HDR);
+		if (len < 0)
+			return -EIO;
+
+		a->wiov[2 * i].iov_base = a->hdr[i];
+		a->wiov[2 * i].iov_len = len;
+		a->wiov[2 * i + 1].iov_base = a->data[i];
+		a->wiov[2 * i + 1].iov_len = pe->length;
+		total += len + pe->length;
+	}
+
+	len = bwritev(&img->_x, a->wiov, 2 * nr);
+	if (len != total) {
+		pr_perror("Can't write %d bytes of %d packets", total, nr);
+		return -EIO;
+	}
+
+	return 0;
+}
+
 int dump_sk_queue(int sock_fd, int sock_id)
 {
 	SkPacketEntry pe = SK_PACKET_ENTRY__INIT;
-	int ret, size, orig_peek_off;
-	void *data;
+	struct sk_queue_arena *a;
+	int ret, size, orig_peek_off, peek_off = 0, i;
+	void *data = NULL;
 	socklen_t tmp;
 
 	/*
@@ -91,67 +184,95 @@ int dump_sk_queue(int sock_fd, int sock_id)
 	size -= 32;
 
 	/*
-	 * Allocate data for a stream.
+	 * The arena is allocated once and reused for all the sockets.
 	 */
-	data = xmalloc(size);
-	if (!data)
-		return -1;
+	if (!sk_queue_arena) {
+		sk_queue_arena = xmalloc(sizeof(*sk_queue_arena));
+		if (!sk_queue_arena)
+			return -1;
+	}
+	a = sk_queue_arena;
 
 	/*
 	 * Enable peek offset incrementation.
 	 */
-	ret = setsockopt(sock_fd, SOL_SOCKET, SO_PEEK_OFF, &ret, sizeof(int));
+	ret = setsockopt(sock_fd, SOL_SOCKET, SO_PEEK_OFF, &peek_off, sizeof(int));
 	if (ret < 0) {
 		pr_perror("setsockopt fail");
-		goto err_brk;
+		return ret;
 	}
 
 	pe.id_for = sock_id;
 
 	while (1) {
-		struct iovec iov = {
-			.iov_base	= data,
-			.iov_len	= size,
-		};
-		struct msghdr msg = {
-			.msg_iov	= &iov,
-			.msg_iovlen	= 1,
-		};
-
-		ret = pe.length = recvmsg(sock_fd, &msg, MSG_DONTWAIT | MSG_PEEK);
-		if (!ret)
-			/*
-			 * It means, that peer has performed an
-			 * orderly shutdown, so we're done.
-			 */
-			break;
-		else if (ret < 0) {
+		bool done = false, trunc = false;
+		int nr;
+
+		for (i = 0; i < SK_QUEUE_BATCH; i++) {
+			a->iov[i].iov_base = a->data[i];
+			a->iov[i].iov_len = SK_QUEUE_SLOT;
+			memzero(&a->msgs[i], sizeof(a->msgs[i]));
+			a->msgs[i].msg_hdr.msg_iov = &a->iov[i];
+			a->msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		ret = recvmmsg(sock_fd, a->msgs, SK_QUEUE_BATCH, MSG_DONTWAIT | MSG_PEEK, NULL);
+		if (ret < 0) {
 			if (errno == EAGAIN)
 				break; /* we're done */
-			pr_perror("recvmsg fail: error");
+			pr_perror("recvmmsg fail: error");
 			goto err_set_sock;
 		}
-		if (msg.msg_flags & MSG_TRUNC) {
-			/*
-			 * DGRAM truncated. This should not happen. But we have
-			 * to check...
-			 */
-			pr_err("sys_recvmsg failed: truncated\n");
-			ret = -E2BIG;
-			goto err_set_sock;
+
+		for (nr = 0; nr < ret; nr++) {
+			if (!a->msgs[nr].msg_len) {
+				/*
+				 * It means, that peer has performed an
+				 * orderly shutdown, so we're done.
+				 */
+				done = true;
+				break;
+			}
+			if (a->msgs[nr].msg_hdr.msg_flags & MSG_TRUNC) {
+				trunc = true;
+				break;
+			}
+			peek_off += a->msgs[nr].msg_len;
 		}
 
-		ret = pb_write_one(img_from_set(glob_imgset, CR_FD_SK_QUEUES), &pe, PB_SK_QUEUES);
-		if (ret < 0) {
-			ret = -EIO;
+		ret = dump_sk_packets(a, &pe, nr);
+		if (ret < 0)
 			goto err_set_sock;
+
+		if (done)
+			break;
+		if (!trunc)
+			continue;
+
+		/*
+		 * The packet is bigger than the slot. Rewind the peek
+		 * offset to its start (the rest of the batch has moved
+		 * it further) and get it with the big buffer.
+		 */
+		if (!data) {
+			data = xmalloc(size);
+			if (!data) {
+				ret = -1;
+				goto err_set_sock;
+			}
 		}
 
-		ret = write_img_buf(img_from_set(glob_imgset, CR_FD_SK_QUEUES), data, pe.length);
+		ret = setsockopt(sock_fd, SOL_SOCKET, SO_PEEK_OFF, &peek_off, sizeof(int));
 		if (ret < 0) {
-			ret = -EIO;
+			pr_perror("setsockopt fail");
 			goto err_set_sock;
 		}
+
+		ret = dump_sk_packet_big(sock_fd, &pe, data, size);
+		if (ret < 0)
+			goto err_set_sock;
+
+		peek_off += pe.length;
 	}
 	ret = 0;
 
@@ -163,7 +284,6 @@ err_set_sock:
 		pr_perror("setsockopt failed on restore");
 		ret = -1;
 	}
-err_brk:
 	xfree(data);
 	return ret;
 }
@@ -4,6 +4,9 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <string.h>
 #include <sched.h>
 #include <netinet/in.h>
@@ -24,6 +27,7 @@
 #include "kerndat.h"
 #include "restorer.h"
 #include "rst-malloc.h"
+#include "stats.h"
 
 #include "protobuf.h"
 #include "images/tcp-stream.pb-c.h"
@@ -62,6 +66,9 @@ enum {
 #define TCPOPT_SACK_PERM TCPOPT_SACK_PERMITTED
 #endif
 
+/* Collected with dump_one_tcp(), not locked yet */
+static LIST_HEAD(cpt_tcp_pending_sockets);
+/* Locked and in repair mode */
 static LIST_HEAD(cpt_tcp_repair_sockets);
 static LIST_HEAD(rst_tcp_repair_sockets);
 
@@ -118,73 +125,75 @@ static int refresh_inet_sk(struct inet_sk_desc *sk, struct tcp_info *ti)
 	return 0;
 }
 
-static int tcp_repair_establised(int fd, struct inet_sk_desc *sk)
+static void tcp_repair_off_one(struct inet_sk_desc *sk)
 {
-	int ret;
+	tcp_repair_off(sk->rfd);
 
-	pr_info("\tTurning repair on for socket %x\n", sk->sd.ino);
 	/*
-	 * Keep the socket open in criu till the very end. In
-	 * case we close this fd after one task fd dumping and
-	 * fail we'll have to turn repair mode off
+	 * tcp_repair_off modifies SO_REUSEADDR so
+	 * don't forget to restore original value.
 	 */
-	sk->rfd = dup(fd);
-	if (sk->rfd < 0) {
-		pr_perror("Can't save socket fd for repair");
-		goto err1;
-	}
-
-	if (!(root_ns_mask & CLONE_NEWNET)) {
-		ret = nf_lock_connection(sk);
-		if (ret < 0)
-			goto err2;
-	}
-
-	ret = tcp_repair_on(sk->rfd);
-	if (ret < 0)
-		goto err3;
-
-	list_add_tail(&sk->rlist, &cpt_tcp_repair_sockets);
-	return 0;
-
-err3:
-	if (!(root_ns_mask & CLONE_NEWNET))
-		nf_unlock_connection(sk);
-err2:
-	close(sk->rfd);
-err1:
-	return -1;
+	restore_opt(sk->rfd, SOL_SOCKET, SO_REUSEADDR, &sk->cpt_reuseaddr);
 }
 
-static void tcp_unlock_one(struct inet_sk_desc *sk)
+/*
+ * Connections of a task are locked all at once right after its files
+ * are dumped, so that netfilter rules for them are installed in one go,
+ * and only then are put into repair. Their state is dumped later with
+ * dump_tcp_conns().
+ */
+int cpt_lock_tcp_connections(void)
 {
-	int ret;
+	struct inet_sk_desc *sk, *tmp;
 
-	list_del(&sk->rlist);
+	if (list_empty(&cpt_tcp_pending_sockets))
+		return 0;
 
 	if (!(root_ns_mask & CLONE_NEWNET)) {
-		ret = nf_unlock_connection(sk);
-		if (ret < 0)
-			pr_perror("Failed to unlock TCP connection");
+		if (nf_lock_connections(&cpt_tcp_pending_sockets))
+			return -1;
 	}
 
-	tcp_repair_off(sk->rfd);
+	list_for_each_entry(sk, &cpt_tcp_pending_sockets, rlist) {
+		pr_info("\tTurning repair on for socket %x\n", sk->sd.ino);
+		if (tcp_repair_on(sk->rfd) < 0)
+			goto err;
+	}
 
-	/*
-	 * tcp_repair_off modifies SO_REUSEADDR so
-	 * don't forget to restore original value.
-	 */
-	restore_opt(sk->rfd, SOL_SOCKET, SO_REUSEADDR, &sk->cpt_reuseaddr);
+	list_splice_tail_init(&cpt_tcp_pending_sockets, &cpt_tcp_repair_sockets);
+	return 0;
 
-	close(sk->rfd);
+err:
+	list_for_each_entry(tmp, &cpt_tcp_pending_sockets, rlist) {
+		if (tmp == sk)
+			break;
+		tcp_repair_off_one(tmp);
+	}
+
+	if (!(root_ns_mask & CLONE_NEWNET))
+		nf_unlock_connections(&cpt_tcp_pending_sockets);
+	return -1;
 }
 
 void cpt_unlock_tcp_connections(void)
 {
 	struct inet_sk_desc *sk, *n;
 
-	list_for_each_entry_safe(sk, n, &cpt_tcp_repair_sockets, rlist)
-		tcp_unlock_one(sk);
+	if (!list_empty(&cpt_tcp_repair_sockets) && !(root_ns_mask & CLONE_NEWNET)) {
+		if (nf_unlock_connections(&cpt_tcp_repair_sockets))
+			pr_err("Failed to unlock TCP connections\n");
+	}
+
+	list_for_each_entry_safe(sk, n, &cpt_tcp_repair_sockets, rlist) {
+		list_del(&sk->rlist);
+		tcp_repair_off_one(sk);
+		close(sk->rfd);
+	}
+
+	list_for_each_entry_safe(sk, n, &cpt_tcp_pending_sockets, rlist) {
+		list_del(&sk->rlist);
+		close(sk->rfd);
+	}
 }
 
 /*
@@ -411,13 +420,21 @@ int dump_one_tcp(int fd, struct inet_sk_desc *sk)
 	if (sk->state != TCP_ESTABLISHED)
 		return 0;
 
-	pr_info("Dumping TCP connection\n");
+	pr_info("Repairing TCP connection\n");
 
-	if (tcp_repair_establised(fd, sk))
+	/*
+	 * Keep the socket open in criu till the very end. The
+	 * connection is locked and put into repair mode together
+	 * with the other ones of the task, see
+	 * cpt_lock_tcp_connections().
+	 */
+	sk->rfd = dup(fd);
+	if (sk->rfd < 0) {
+		pr_perror("Can't save socket fd for repair");
 		return -1;
+	}
 
-	if (dump_tcp_conn_state(sk))
-		return -1;
+	list_add_tail(&sk->rlist, &cpt_tcp_pending_sockets);
 
 	/*
 	 * Socket is left in repair mode, so that at the end it's just
@@ -426,6 +443,138 @@ int dump_one_tcp(int fd, struct inet_sk_desc *sk)
 	return 0;
 }
 
+/*
+ * Connections are dumped by several workers, each gets one connection
+ * out of nr_workers, when there are more than TCP_CONNS_PER_WORKER ones.
+ */
+#define TCP_CONNS_PER_WORKER	256
+#define TCP_MAX_WORKERS		16
+
+struct tcp_dump_stat {
+	unsigned long	nr;
+	u64		usec;
+};
+
+static int dump_tcp_conns_part(int worker, int nr_workers, struct tcp_dump_stat *st)
+{
+	struct inet_sk_desc *sk;
+	struct timeval start;
+	unsigned long usec;
+	int i = 0;
+
+	list_for_each_entry(sk, &cpt_tcp_repair_sockets, rlist) {
+		if (i++ % nr_workers != worker)
+			continue;
+
+		pr_info("Dumping TCP connection %x\n", sk->sd.ino);
+
+		gettimeofday(&start, NULL);
+		if (dump_tcp_conn_state(sk))
+			return -1;
+		usec = usec_since(&start);
+
+		pr_info("TCP connection %x dumped in %lu usec\n", sk->sd.ino, usec);
+		st->nr++;
+		st->usec += usec;
+	}
+
+	return 0;
+}
+
+int dump_tcp_conns(void)
+{
+	struct tcp_dump_stat *st;
+	struct inet_sk_desc *sk;
+	pid_t pids[TCP_MAX_WORKERS];
+	int nr = 0, nr_workers, nr_forked, i, ret = 0;
+	sigset_t blockmask, oldmask;
+	long nr_cpus;
+
+	list_for_each_entry(sk, &cpt_tcp_repair_sockets, rlist)
+		nr++;
+
+	if (!nr)
+		return 0;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_workers = DIV_ROUND_UP(nr, TCP_CONNS_PER_WORKER);
+	nr_workers = min_t(long, nr_workers, max(nr_cpus, 1L));
+	nr_workers = min(nr_workers, TCP_MAX_WORKERS);
+
+	pr_info("Dumping %d TCP connections with %d workers\n", nr, nr_workers);
+
+	timing_start(TIME_TCP_CONNS);
+
+	st = mmap(NULL, nr_workers * sizeof(*st), PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (st == MAP_FAILED) {
+		pr_perror("Can't map TCP dump stats");
+		return -1;
+	}
+
+	if (nr_workers == 1) {
+		ret = dump_tcp_conns_part(0, 1, st);
+		goto out;
+	}
+
+	/*
+	 * Same as cr_system() does, the workers are waited for right
+	 * here and shouldn't get into the SIGCHLD handler.
+	 */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &blockmask, &oldmask) == -1) {
+		pr_perror("Can not set mask of blocked signals");
+		ret = -1;
+		goto out;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			pr_perror("Can't fork TCP dumper");
+			ret = -1;
+			break;
+		}
+
+		if (pids[i] == 0) {
+			ret = dump_tcp_conns_part(i, nr_workers, &st[i]);
+			exit(ret ? 1 : 0);
+		}
+	}
+	nr_forked = i;
+
+	for (i = 0; i < nr_forked; i++) {
+		int status;
+
+		if (waitpid(pids[i], &status, 0) < 0) {
+			pr_perror("Can't wait TCP dumper");
+			ret = -1;
+			continue;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			pr_err("TCP connections dumping finished with error %d\n", status);
+			ret = -1;
+		}
+	}
+
+	if (sigprocmask(SIG_SETMASK, &oldmask, NULL) == -1) {
+		pr_perror("Can not unset mask of blocked signals");
+		ret = -1;
+	}
+out:
+	timing_stop(TIME_TCP_CONNS);
+
+	for (i = 0; i < nr_workers; i++) {
+		cnt_add(CNT_TCP_CONNS, st[i].nr);
+		cnt_add(CNT_TCP_CONNS_USEC, st[i].usec);
+	}
+
+	munmap(st, nr_workers * sizeof(*st));
+	return ret;
+}
+
 static int set_tcp_queue_seq(int sk, int queue, u32 seq)
 {
 	pr_debug("\tSetting %d queue seq to %u\n", queue, seq);
@@ -455,31 +604,51 @@ static int restore_tcp_seqs(int sk, TcpStreamEntry *tse)
 	return 0;
 }
 
+/*
+ * Queues are read from images and sent in pieces through one buffer
+ * reused for all the connections, so that the memory needed doesn't
+ * depend on the queues sizes.
+ */
+#define TCP_QUEUE_BUF_SIZE	(256 << 10)
+#define TCP_QUEUE_MIN_CHUNK	1024
+#define TCP_QUEUE_GROW_AFTER	8
+
+static char *tcp_queue_buf;
+
+/*
+ * The size of send() kernel agrees to accept. It's shrunk when send
+ * fails and grows back after several successful sends. It's kept
+ * between connections, so that all of them don't go through the
+ * same sequence of failures.
+ */
+static int tcp_max_chunk = TCP_QUEUE_BUF_SIZE;
+static int tcp_chunk_ok;
+
 static int __send_tcp_queue(int sk, int queue, u32 len, struct cr_img *img)
 {
-	int ret, err = -1, max_chunk;
-	int off;
-	char *buf;
+	int ret, off = 0, avail = 0;
 
-	buf = xmalloc(len);
-	if (!buf)
-		return -1;
-
-	if (read_img_buf(img, buf, len) < 0)
-		goto err;
+	if (!tcp_queue_buf) {
+		tcp_queue_buf = xmalloc(TCP_QUEUE_BUF_SIZE);
+		if (!tcp_queue_buf)
+			return -1;
+	}
 
-	max_chunk = len;
-	off = 0;
+	while (len) {
+		int chunk;
 
-	do {
-		int chunk = len;
+		if (!avail) {
+			avail = min_t(u32, len, TCP_QUEUE_BUF_SIZE);
+			if (read_img_buf(img, tcp_queue_buf, avail) < 0)
+				return -1;
+			off = 0;
+		}
 
-		if (chunk > max_chunk)
-			chunk = max_chunk;
+		chunk = min(avail, tcp_max_chunk);
 
-		ret = send(sk, buf + off, chunk, 0);
+		ret = send(sk, tcp_queue_buf + off, chunk, 0);
 		if (ret <= 0) {
-			if (max_chunk > 1024) {
+			if (tcp_max_chunk > TCP_QUEUE_MIN_CHUNK) {
 				/*
 				 * Kernel not only refuses the whole chunk,
 				 * but refuses to split it into pieces too.
@@ -494,23 +663,28 @@ static int __send_tcp_queue(int sk, int queue, u32 len, struct cr_img *img)
 				 * In any case -- try smaller chunk, hopefully
 				 * there's still enough memory in the system.
 				 */
-				max_chunk >>= 1;
+				tcp_max_chunk >>= 1;
+				tcp_chunk_ok = 0;
 				continue;
 			}
 
 			pr_perror("Can't restore %d queue data (%d), want (%d:%d:%d)",
-				  queue, ret, chunk, len, max_chunk);
-			goto err;
+				  queue, ret, chunk, len, tcp_max_chunk);
+			return -1;
 		}
+
+		if (ret == tcp_max_chunk && tcp_max_chunk < TCP_QUEUE_BUF_SIZE &&
+		    ++tcp_chunk_ok >= TCP_QUEUE_GROW_AFTER) {
+			tcp_max_chunk <<= 1;
+			tcp_chunk_ok = 0;
+		}
+
 		off += ret;
+		avail -= ret;
 		len -= ret;
-	} while (len);
-
-	err = 0;
-err:
-	xfree(buf);
+	}
 
-	return err;
+	return 0;
 }
 
 static int send_tcp_queue(int sk, int queue, u32 len, struct cr_img *img)
@@ -627,11 +801,16 @@ static int restore_tcp_conn_state(int sk, struct inet_sk_info *ii)
 	if (restore_tcp_seqs(sk, tse))
 		goto err_c;
 
-	if (inet_bind(sk, ii))
-		goto err_c;
-
-	if (inet_connect(sk, ii))
+	/*
+	 * Only the bind and connect need to be serialized with other
+	 * sockets on this port, the rest is done in parallel with them.
+	 */
+	inet_port_lock(ii);
+	if (inet_bind(sk, ii) || inet_connect(sk, ii)) {
+		inet_port_unlock(ii);
 		goto err_c;
+	}
+	inet_port_unlock(ii);
 
 	if (restore_tcp_opts(sk, tse))
 		goto err_c;
@@ -696,14 +875,24 @@ int prepare_tcp_socks(struct task_restore_args *ta)
 
 int restore_one_tcp(int fd, struct inet_sk_info *ii)
 {
+	struct timeval start;
+	unsigned long usec;
+
 	pr_info("Restoring TCP connection\n");
 
+	gettimeofday(&start, NULL);
+
 	if (tcp_repair_on(fd))
 		return -1;
 
 	if (restore_tcp_conn_state(fd, ii))
 		return -1;
 
+	usec = usec_since(&start);
+	pr_info("TCP connection %x restored in %lu usec\n", ii->ie->ino, usec);
+	cnt_add(CNT_TCP_CONNS_RESTORED, 1);
+	cnt_add(CNT_TCP_CONNS_RESTORE_USEC, usec);
+
 	return 0;
 }
 
@@ -715,14 +904,11 @@ void tcp_locked_conn_add(struct inet_sk_info *ii)
 
 void rst_unlock_tcp_connections(void)
 {
-	struct inet_sk_info *ii;
-
 	/* Network will be unlocked by network-unlock scripts */
 	if (root_ns_mask & CLONE_NEWNET)
 		return;
 
-	list_for_each_entry(ii, &rst_tcp_repair_sockets, rlist)
-		nf_unlock_connection_info(ii);
+	nf_unlock_connections_info(&rst_tcp_repair_sockets);
 }
 
 int check_tcp(void)
@@ -671,7 +671,8 @@ static int unix_collect_one(const struct unix_diag_msg *m,
 		d->wqlen = rq->udiag_wqueue;
 	}
 
-	sk_collect_one(m->udiag_ino, AF_UNIX, &d->sd);
+	if (sk_collect_one(m->udiag_ino, AF_UNIX, &d->sd))
+		goto err;
 	list_add_tail(&d->list, &unix_sockets);
 	show_one_unix("Collected", d);
 
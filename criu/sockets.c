@@ -21,13 +21,12 @@
 #include "namespaces.h"
 #include "net.h"
 #include "fs-magic.h"
+#include "stats.h"
 
 #ifndef SOCK_DIAG_BY_FAMILY
 #define SOCK_DIAG_BY_FAMILY 20
 #endif
 
-#define SK_HASH_SIZE		32
-
 #ifndef SO_GET_FILTER
 #define SO_GET_FILTER	SO_ATTACH_FILTER
 #endif
@@ -328,11 +327,63 @@ static int restore_socket_filter(int sk, SkOptsEntry *soe)
 	return ret;
 }
 
-static struct socket_desc *sockets[SK_HASH_SIZE];
+/*
+ * Sockets are looked up by inode for every socket fd (and socket
+ * VMA) and there can be hundreds of thousands of them, so they live
+ * in an open-addressed hash, which grows to stay at most half full.
+ */
+#define SK_HASH_MIN_SIZE	1024
+
+static struct socket_desc **sockets;
+static unsigned int sockets_size, sockets_nr;
+
+static inline unsigned int sk_hash(unsigned int ino, unsigned int size)
+{
+	return (ino * 2654435761U) & (size - 1);
+}
+
+/*
+ * Returns true if the inode wasn't in the table before
+ */
+static bool sk_hash_insert(struct socket_desc **tbl, unsigned int size,
+			   struct socket_desc *d)
+{
+	unsigned int i;
+
+	for (i = sk_hash(d->ino, size); tbl[i]; i = (i + 1) & (size - 1))
+		if (tbl[i]->ino == d->ino) {
+			tbl[i] = d;
+			return false;
+		}
+
+	tbl[i] = d;
+	return true;
+}
+
+static int sk_hash_grow(void)
+{
+	struct socket_desc **tbl;
+	unsigned int size, i;
+
+	size = sockets_size ? sockets_size * 2 : SK_HASH_MIN_SIZE;
+	tbl = xzalloc(size * sizeof(*tbl));
+	if (!tbl)
+		return -1;
+
+	for (i = 0; i < sockets_size; i++)
+		if (sockets[i])
+			sk_hash_insert(tbl, size, sockets[i]);
+
+	xfree(sockets);
+	sockets = tbl;
+	sockets_size = size;
+	return 0;
+}
 
 struct socket_desc *lookup_socket(unsigned ino, int family, int proto)
 {
 	struct socket_desc *sd;
+	unsigned int i, probes = 0;
 
 	if (!socket_test_collect_bit(family, proto)) {
 		pr_err("Sockets (family %d, proto %d) are not collected\n",
@@ -341,30 +392,46 @@ struct socket_desc *lookup_socket(unsigned ino, int family, int proto)
 	}
 
 	pr_debug("\tSearching for socket %x (family %d.%d)\n", ino, family, proto);
-	for (sd = sockets[ino % SK_HASH_SIZE]; sd; sd = sd->next)
-		if (sd->ino == ino) {
-			BUG_ON(sd->family != family);
-			return sd;
+
+	sd = NULL;
+	if (sockets_size) {
+		for (i = sk_hash(ino, sockets_size); sockets[i];
+				i = (i + 1) & (sockets_size - 1)) {
+			probes++;
+			if (sockets[i]->ino == ino) {
+				sd = sockets[i];
+				BUG_ON(sd->family != family);
+				break;
+			}
 		}
+	}
+
+	cnt_add(CNT_SOCKET_LOOKUPS, 1);
+	cnt_add(CNT_SOCKET_LOOKUP_PROBES, probes);
 
-	return NULL;
+	return sd;
 }
 
 int sk_collect_one(unsigned ino, int family, struct socket_desc *d)
 {
-	struct socket_desc **chain;
-
 	d->ino		= ino;
 	d->family	= family;
 	d->already_dumped = 0;
 
-	chain = &sockets[ino % SK_HASH_SIZE];
-	d->next = *chain;
-	*chain = d;
+	if ((sockets_nr + 1) * 2 > sockets_size && sk_hash_grow())
+		return -1;
+
+	if (sk_hash_insert(sockets, sockets_size, d))
+		sockets_nr++;
 
 	return 0;
 }
 
+unsigned long sk_collected_nr(void)
+{
+	return sockets_nr;
+}
+
 int do_restore_opt(int sk, int level, int name, void *val, int len)
 {
 	if (setsockopt(sk, level, name, val, len) < 0) {
@@ -2,6 +2,7 @@
 #include <fcntl.h>
 #include <sys/time.h>
 #include "asm/atomic.h"
+#include "lock.h"
 #include "rst-malloc.h"
 #include "protobuf.h"
 #include "stats.h"
@@ -15,12 +16,17 @@ struct timing {
 
 struct dump_stats {
 	struct timing	timings[DUMP_TIME_NR_STATS];
-	unsigned long	counts[DUMP_CNT_NR_STATS];
+	u64		counts[DUMP_CNT_NR_STATS];
 };
 
+/*
+ * Counters are updated by all the restored tasks. They are 64-bit,
+ * as the summed microseconds don't fit 32 bits, thus the lock.
+ */
 struct restore_stats {
 	struct timing	timings[RESTORE_TIME_NS_STATS];
-	atomic_t	counts[RESTORE_CNT_NR_STATS];
+	mutex_t		lock;
+	u64		counts[RESTORE_CNT_NR_STATS];
 };
 
 struct dump_stats *dstats;
@@ -33,7 +39,9 @@ void cnt_add(int c, unsigned long val)
 		dstats->counts[c] += val;
 	} else if (rstats != NULL) {
 		BUG_ON(c >= RESTORE_CNT_NR_STATS);
-		atomic_add(val, &rstats->counts[c]);
+		mutex_lock(&rstats->lock);
+		rstats->counts[c] += val;
+		mutex_unlock(&rstats->lock);
 	} else
 		BUG();
 }
@@ -92,6 +100,15 @@ void timing_stop(int t)
 	timeval_accumulate(&tm->start, &now, &tm->total);
 }
 
+unsigned long usec_since(const struct timeval *from)
+{
+	struct timeval now, res = { };
+
+	gettimeofday(&now, NULL);
+	timeval_accumulate(from, &now, &res);
+	return res.tv_sec * USEC_PER_SEC + res.tv_usec;
+}
+
 static void encode_time(int t, u_int32_t *to)
 {
 	struct timing *tm;
@@ -122,18 +139,69 @@ void write_stats(int what)
 		ds_entry.pages_scanned = dstats->counts[CNT_PAGES_SCANNED];
 		ds_entry.pages_skipped_parent = dstats->counts[CNT_PAGES_SKIPPED_PARENT];
 		ds_entry.pages_written = dstats->counts[CNT_PAGES_WRITTEN];
+		ds_entry.has_tcp_conns = true;
+		ds_entry.tcp_conns = dstats->counts[CNT_TCP_CONNS];
+		ds_entry.has_tcp_conns_time = true;
+		ds_entry.tcp_conns_time = dstats->counts[CNT_TCP_CONNS_USEC];
+		ds_entry.has_tcp_dump_time = true;
+		encode_time(TIME_TCP_CONNS, &ds_entry.tcp_dump_time);
+		ds_entry.has_sockets_collected = true;
+		ds_entry.sockets_collected = dstats->counts[CNT_SOCKETS_COLLECTED];
+		ds_entry.has_socket_lookups = true;
+		ds_entry.socket_lookups = dstats->counts[CNT_SOCKET_LOOKUPS];
+		ds_entry.has_socket_lookup_probes = true;
+		ds_entry.socket_lookup_probes = dstats->counts[CNT_SOCKET_LOOKUP_PROBES];
+
+		ds_entry.has_proc_parse_time = true;
+		encode_time(TIME_PROC_PARSE, &ds_entry.proc_parse_time);
+		ds_entry.has_files_dump_time = true;
+		encode_time(TIME_FILES_DUMP, &ds_entry.files_dump_time);
+		ds_entry.has_sockets_collect_time = true;
+		encode_time(TIME_SOCKETS_COLLECT, &ds_entry.sockets_collect_time);
+		ds_entry.has_mnt_dump_time = true;
+		encode_time(TIME_MNT_DUMP, &ds_entry.mnt_dump_time);
+		ds_entry.has_ns_dump_time = true;
+		encode_time(TIME_NS_DUMP, &ds_entry.ns_dump_time);
+		ds_entry.has_page_server_time = true;
+		encode_time(TIME_PAGE_SERVER, &ds_entry.page_server_time);
+		ds_entry.has_page_server_bytes = true;
+		ds_entry.page_server_bytes = dstats->counts[CNT_PAGE_SERVER_BYTES];
+		ds_entry.has_ns_dumped = true;
+		ds_entry.ns_dumped = dstats->counts[CNT_NS_DUMPED];
+		ds_entry.has_ns_dumped_time = true;
+		ds_entry.ns_dumped_time = dstats->counts[CNT_NS_DUMP_USEC];
 
 		name = "dump";
 	} else if (what == RESTORE_STATS) {
 		stats.restore = &rs_entry;
 
-		rs_entry.pages_compared = atomic_read(&rstats->counts[CNT_PAGES_COMPARED]);
-		rs_entry.pages_skipped_cow = atomic_read(&rstats->counts[CNT_PAGES_SKIPPED_COW]);
+		rs_entry.pages_compared = rstats->counts[CNT_PAGES_COMPARED];
+		rs_entry.pages_skipped_cow = rstats->counts[CNT_PAGES_SKIPPED_COW];
 		rs_entry.has_pages_restored = true;
-		rs_entry.pages_restored = atomic_read(&rstats->counts[CNT_PAGES_RESTORED]);
+		rs_entry.pages_restored = rstats->counts[CNT_PAGES_RESTORED];
+		rs_entry.has_tcp_conns = true;
+		rs_entry.tcp_conns = rstats->counts[CNT_TCP_CONNS_RESTORED];
+		rs_entry.has_tcp_conns_time = true;
+		rs_entry.tcp_conns_time = rstats->counts[CNT_TCP_CONNS_RESTORE_USEC];
+		rs_entry.has_files_restore_time = true;
+		rs_entry.files_restore_time = rstats->counts[CNT_FILES_RESTORE_USEC];
 
 		encode_time(TIME_FORK, &rs_entry.forking_time);
 		encode_time(TIME_RESTORE, &rs_entry.restore_time);
+		rs_entry.has_ns_restore_time = true;
+		encode_time(TIME_NS_RESTORE, &rs_entry.ns_restore_time);
+		rs_entry.has_mnt_restore_time = true;
+		encode_time(TIME_MNT_RESTORE, &rs_entry.mnt_restore_time);
+		rs_entry.has_ns_stage_time = true;
+		encode_time(TIME_STAGE_RESTORE_NS, &rs_entry.ns_stage_time);
+		rs_entry.has_forking_stage_time = true;
+		encode_time(TIME_STAGE_FORKING, &rs_entry.forking_stage_time);
+		rs_entry.has_restore_stage_time = true;
+		encode_time(TIME_STAGE_RESTORE, &rs_entry.restore_stage_time);
+		rs_entry.has_sigchld_stage_time = true;
+		encode_time(TIME_STAGE_RESTORE_SIGCHLD, &rs_entry.sigchld_stage_time);
+		rs_entry.has_creds_stage_time = true;
+		encode_time(TIME_STAGE_RESTORE_CREDS, &rs_entry.creds_stage_time);
 
 		name = "restore";
 	} else
@@ -146,6 +214,89 @@ void write_stats(int what)
 	}
 }
 
+static const char *dump_time_names[DUMP_TIME_NR_STATS] = {
+	[TIME_FREEZING]		= "freezing_time",
+	[TIME_FROZEN]		= "frozen_time",
+	[TIME_MEMDUMP]		= "memdump_time",
+	[TIME_MEMWRITE]		= "memwrite_time",
+	[TIME_IRMAP_RESOLVE]	= "irmap_resolve",
+	[TIME_TCP_CONNS]	= "tcp_dump_time",
+	[TIME_PROC_PARSE]	= "proc_parse_time",
+	[TIME_FILES_DUMP]	= "files_dump_time",
+	[TIME_SOCKETS_COLLECT]	= "sockets_collect_time",
+	[TIME_MNT_DUMP]		= "mnt_dump_time",
+	[TIME_NS_DUMP]		= "ns_dump_time",
+	[TIME_PAGE_SERVER]	= "page_server_time",
+};
+
+static const char *dump_cnt_names[DUMP_CNT_NR_STATS] = {
+	[CNT_PAGES_SCANNED]		= "pages_scanned",
+	[CNT_PAGES_SKIPPED_PARENT]	= "pages_skipped_parent",
+	[CNT_PAGES_WRITTEN]		= "pages_written",
+	[CNT_TCP_CONNS]			= "tcp_conns",
+	[CNT_TCP_CONNS_USEC]		= "tcp_conns_time",
+	[CNT_SOCKETS_COLLECTED]		= "sockets_collected",
+	[CNT_SOCKET_LOOKUPS]		= "socket_lookups",
+	[CNT_SOCKET_LOOKUP_PROBES]	= "socket_lookup_probes",
+	[CNT_PAGE_SERVER_BYTES]		= "page_server_bytes",
+	[CNT_NS_DUMPED]			= "ns_dumped",
+	[CNT_NS_DUMP_USEC]		= "ns_dumped_time",
+};
+
+static const char *restore_time_names[RESTORE_TIME_NS_STATS] = {
+	[TIME_FORK]		= "forking_time",
+	[TIME_RESTORE]		= "restore_time",
+	[TIME_NS_RESTORE]	= "ns_restore_time",
+	[TIME_MNT_RESTORE]	= "mnt_restore_time",
+	[TIME_STAGE_RESTORE_NS]		= "ns_stage_time",
+	[TIME_STAGE_FORKING]		= "forking_stage_time",
+	[TIME_STAGE_RESTORE]		= "restore_stage_time",
+	[TIME_STAGE_RESTORE_SIGCHLD]	= "sigchld_stage_time",
+	[TIME_STAGE_RESTORE_CREDS]	= "creds_stage_time",
+};
+
+static const char *restore_cnt_names[RESTORE_CNT_NR_STATS] = {
+	[CNT_PAGES_COMPARED]		= "pages_compared",
+	[CNT_PAGES_SKIPPED_COW]		= "pages_skipped_cow",
+	[CNT_PAGES_RESTORED]		= "pages_restored",
+	[CNT_TCP_CONNS_RESTORED]	= "tcp_conns",
+	[CNT_TCP_CONNS_RESTORE_USEC]	= "tcp_conns_time",
+	[CNT_FILES_RESTORE_USEC]	= "files_restore_time",
+};
+
+int get_stats(int what, struct stats_value *vals)
+{
+	int i, nr = 0;
+
+	BUILD_BUG_ON(RESTORE_TIME_NS_STATS + RESTORE_CNT_NR_STATS > STATS_MAX_VALUES);
+
+	if (what == DUMP_STATS && dstats) {
+		for (i = 0; i < DUMP_TIME_NR_STATS; i++, nr++) {
+			struct timing *tm = &dstats->timings[i];
+
+			vals[nr].name = dump_time_names[i];
+			vals[nr].val = tm->total.tv_sec * USEC_PER_SEC + tm->total.tv_usec;
+		}
+		for (i = 0; i < DUMP_CNT_NR_STATS; i++, nr++) {
+			vals[nr].name = dump_cnt_names[i];
+			vals[nr].val = dstats->counts[i];
+		}
+	} else if (what == RESTORE_STATS && rstats) {
+		for (i = 0; i < RESTORE_TIME_NS_STATS; i++, nr++) {
+			struct timing *tm = &rstats->timings[i];
+
+			vals[nr].name = restore_time_names[i];
+			vals[nr].val = tm->total.tv_sec * USEC_PER_SEC + tm->total.tv_usec;
+		}
+		for (i = 0; i < RESTORE_CNT_NR_STATS; i++, nr++) {
+			vals[nr].name = restore_cnt_names[i];
+			vals[nr].val = rstats->counts[i];
+		}
+	}
+
+	return nr;
+}
+
 int init_stats(int what)
 {
 	if (what == DUMP_STATS) {
@@ -154,5 +305,9 @@ int init_stats(int what)
 	}
 
 	rstats = shmalloc(sizeof(struct restore_stats));
-	return rstats ? 0 : -1;
+	if (!rstats)
+		return -1;
+
+	mutex_init(&rstats->lock);
+	return 0;
 }
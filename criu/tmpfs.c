@@ -0,0 +1,688 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "asm/types.h"
+#include "util.h"
+#include "log.h"
+#include "xmalloc.h"
+#include "image.h"
+#include "namespaces.h"
+#include "protobuf.h"
+#include "tmpfs.h"
+#include "images/tmpfs.pb-c.h"
+
+#undef	LOG_PREFIX
+#define LOG_PREFIX "tmpfs: "
+
+/*
+ * Native tmpfs contents archiver.
+ *
+ * The tree is described in the tmpfs-files image, one entry per file
+ * in the pre-order, so that directories go before their contents. The
+ * data of regular files (only the non-hole extents of them) is put into
+ * the raw tmpfs-data image, each file at its own offset. Offsets are
+ * known after the tree walk, thus the data is copied by several workers
+ * in parallel both on dump and on restore.
+ */
+
+#define TMPFS_BYTES_PER_WORKER	(64 << 20)
+#define TMPFS_MAX_WORKERS	8
+#define TMPFS_LINKS_HASH_SIZE	1024
+
+struct tmpfs_file {
+	TmpfsFileEntry		e;
+	Timeval			atim;
+	Timeval			mtim;
+	ino_t			ino;
+	struct tmpfs_file	*link_next;
+};
+
+struct tmpfs_tree {
+	struct tmpfs_file	**files;
+	unsigned int		nr;
+	unsigned int		size;
+	u64			data_size;
+	dev_t			dev;
+	struct tmpfs_file	*links[TMPFS_LINKS_HASH_SIZE];
+};
+
+static int tmpfs_tree_add(struct tmpfs_tree *t, struct tmpfs_file *f)
+{
+	if (t->nr == t->size) {
+		struct tmpfs_file **n;
+
+		n = xrealloc(t->files, (t->size * 2 + 64) * sizeof(*n));
+		if (!n)
+			return -1;
+
+		t->files = n;
+		t->size = t->size * 2 + 64;
+	}
+
+	t->files[t->nr++] = f;
+	return 0;
+}
+
+static void tmpfs_tree_free(struct tmpfs_tree *t)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < t->nr; i++) {
+		struct tmpfs_file *f = t->files[i];
+
+		for (j = 0; j < f->e.n_data; j++)
+			xfree(f->e.data[j]);
+		xfree(f->e.data);
+		xfree(f->e.path);
+		xfree(f->e.target);
+		xfree(f);
+	}
+
+	xfree(t->files);
+}
+
+static struct tmpfs_file *tmpfs_lookup_link(struct tmpfs_tree *t, ino_t ino)
+{
+	struct tmpfs_file *f;
+
+	for (f = t->links[ino % TMPFS_LINKS_HASH_SIZE]; f; f = f->link_next)
+		if (f->ino == ino)
+			return f;
+
+	return NULL;
+}
+
+static int tmpfs_add_extent(TmpfsFileEntry *e, u64 off, u64 len)
+{
+	TmpfsExtent *ext, **n;
+
+	ext = xmalloc(sizeof(*ext));
+	if (!ext)
+		return -1;
+
+	n = xrealloc(e->data, (e->n_data + 1) * sizeof(*n));
+	if (!n) {
+		xfree(ext);
+		return -1;
+	}
+
+	tmpfs_extent__init(ext);
+	ext->off = off;
+	ext->len = len;
+
+	e->data = n;
+	e->data[e->n_data++] = ext;
+	return 0;
+}
+
+static int tmpfs_collect_extents(struct tmpfs_tree *t, struct tmpfs_file *f,
+				 int dfd, const char *name)
+{
+	off_t off = 0, end;
+	int fd, i, ret = -1;
+
+	fd = openat(dfd, name, O_RDONLY | O_NOFOLLOW);
+	if (fd < 0) {
+		pr_perror("Can't open %s", f->e.path);
+		return -1;
+	}
+
+	while (off < f->e.size) {
+		off = lseek(fd, off, SEEK_DATA);
+		if (off < 0) {
+			if (errno == ENXIO)
+				break;
+			if (errno != EINVAL) {
+				pr_perror("Can't find data in %s", f->e.path);
+				goto out;
+			}
+
+			/* No SEEK_DATA support, dump the whole file */
+			if (tmpfs_add_extent(&f->e, 0, f->e.size))
+				goto out;
+			break;
+		}
+
+		end = lseek(fd, off, SEEK_HOLE);
+		if (end < 0) {
+			pr_perror("Can't find hole in %s", f->e.path);
+			goto out;
+		}
+
+		if (tmpfs_add_extent(&f->e, off, end - off))
+			goto out;
+		off = end;
+	}
+
+	f->e.has_data_off = true;
+	f->e.data_off = t->data_size;
+	for (i = 0; i < f->e.n_data; i++)
+		t->data_size += f->e.data[i]->len;
+
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static int tmpfs_collect_one(struct tmpfs_tree *t, int dfd, const char *name,
+			     const char *path, struct stat *st)
+{
+	struct tmpfs_file *f;
+
+	if (S_ISSOCK(st->st_mode)) {
+		pr_warn("Socket %s is skipped\n", path);
+		return 0;
+	}
+
+	f = xzalloc(sizeof(*f));
+	if (!f)
+		return -1;
+
+	tmpfs_file_entry__init(&f->e);
+	timeval__init(&f->atim);
+	timeval__init(&f->mtim);
+
+	f->e.path = xstrdup(path);
+	if (!f->e.path || tmpfs_tree_add(t, f)) {
+		xfree(f->e.path);
+		xfree(f);
+		return -1;
+	}
+
+	f->ino = st->st_ino;
+	f->e.mode = st->st_mode;
+	f->e.uid = userns_uid(st->st_uid);
+	f->e.gid = userns_gid(st->st_gid);
+
+	f->atim.tv_sec = st->st_atim.tv_sec;
+	f->atim.tv_usec = st->st_atim.tv_nsec / 1000;
+	f->mtim.tv_sec = st->st_mtim.tv_sec;
+	f->mtim.tv_usec = st->st_mtim.tv_nsec / 1000;
+	f->e.atim = &f->atim;
+	f->e.mtim = &f->mtim;
+
+	switch (st->st_mode & S_IFMT) {
+	case S_IFREG: {
+		struct tmpfs_file *l;
+
+		if (st->st_nlink > 1) {
+			l = tmpfs_lookup_link(t, st->st_ino);
+			if (l) {
+				f->e.link = l->e.path;
+				return 0;
+			}
+
+			f->link_next = t->links[st->st_ino % TMPFS_LINKS_HASH_SIZE];
+			t->links[st->st_ino % TMPFS_LINKS_HASH_SIZE] = f;
+		}
+
+		f->e.has_size = true;
+		f->e.size = st->st_size;
+		return tmpfs_collect_extents(t, f, dfd, name);
+	}
+	case S_IFLNK: {
+		char buf[PATH_MAX];
+		int len;
+
+		len = readlinkat(dfd, name, buf, sizeof(buf) - 1);
+		if (len < 0) {
+			pr_perror("Can't read link %s", path);
+			return -1;
+		}
+		buf[len] = '\0';
+
+		f->e.target = xstrdup(buf);
+		return f->e.target ? 0 : -1;
+	}
+	case S_IFCHR:
+	case S_IFBLK:
+	case S_IFIFO:
+		f->e.has_rdev = true;
+		f->e.rdev = st->st_rdev;
+		return 0;
+	}
+
+	return 0;
+}
+
+static int tmpfs_collect_dir(struct tmpfs_tree *t, int dfd, const char *path)
+{
+	char cpath[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	int fd, ret = -1;
+	DIR *d;
+
+	fd = dup(dfd);
+	if (fd < 0) {
+		pr_perror("Can't dup %s fd", path);
+		return -1;
+	}
+
+	d = fdopendir(fd);
+	if (!d) {
+		pr_perror("Can't open dir %s", path);
+		close(fd);
+		return -1;
+	}
+
+	while ((errno = 0, de = readdir(d)) != NULL) {
+		if (dir_dots(de))
+			continue;
+
+		if (snprintf(cpath, sizeof(cpath), "%s/%s", path, de->d_name) >= sizeof(cpath)) {
+			pr_err("Too long path %s/%s\n", path, de->d_name);
+			goto out;
+		}
+
+		if (fstatat(dfd, de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+			pr_perror("Can't stat %s", cpath);
+			goto out;
+		}
+
+		if (tmpfs_collect_one(t, dfd, de->d_name, cpath, &st))
+			goto out;
+
+		/* Don't go into other file systems, same as tar --one-file-system */
+		if (S_ISDIR(st.st_mode) && st.st_dev == t->dev) {
+			int cfd;
+
+			cfd = openat(dfd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+			if (cfd < 0) {
+				pr_perror("Can't open dir %s", cpath);
+				goto out;
+			}
+
+			ret = tmpfs_collect_dir(t, cfd, cpath);
+			close(cfd);
+			if (ret)
+				goto out;
+			ret = -1;
+		}
+	}
+
+	if (errno) {
+		pr_perror("Can't read dir %s", path);
+		goto out;
+	}
+
+	ret = 0;
+out:
+	closedir(d);
+	return ret;
+}
+
+static int tmpfs_xfer_file(int root_fd, TmpfsFileEntry *e, int img_fd, bool dump)
+{
+	u64 off = e->data_off;
+	int fd, i, ret = 0;
+
+	fd = openat(root_fd, e->path, (dump ? O_RDONLY : O_WRONLY) | O_NOFOLLOW);
+	if (fd < 0) {
+		pr_perror("Can't open %s", e->path);
+		return -1;
+	}
+
+	for (i = 0; i < e->n_data && !ret; i++) {
+		TmpfsExtent *ext = e->data[i];
+
+		if (dump)
+			ret = copy_file_part(fd, ext->off, img_fd, off, ext->len);
+		else
+			ret = copy_file_part(img_fd, off, fd, ext->off, ext->len);
+		off += ext->len;
+	}
+
+	if (ret)
+		pr_err("Can't %s data of %s\n", dump ? "dump" : "restore", e->path);
+
+	close(fd);
+	return ret;
+}
+
+static int tmpfs_xfer_part(TmpfsFileEntry **files, unsigned int nr, u64 chunk,
+			   int root_fd, int img_fd, bool dump, int worker)
+{
+	unsigned int i;
+
+	for (i = 0; i < nr; i++) {
+		TmpfsFileEntry *e = files[i];
+
+		if (!e->n_data || e->data_off / chunk != worker)
+			continue;
+
+		if (tmpfs_xfer_file(root_fd, e, img_fd, dump))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Each worker gets files which data starts in its own @chunk of the
+ * data image, so all of them read and write sequentially.
+ */
+static int tmpfs_xfer_data(TmpfsFileEntry **files, unsigned int nr, u64 size,
+			   int root_fd, int img_fd, bool dump)
+{
+	pid_t pids[TMPFS_MAX_WORKERS];
+	sigset_t blockmask, oldmask;
+	int nr_workers, i, ret = 0;
+	long nr_cpus;
+	u64 chunk;
+
+	if (!size)
+		return 0;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_workers = DIV_ROUND_UP(size, TMPFS_BYTES_PER_WORKER);
+	nr_workers = min_t(long, nr_workers, max(nr_cpus, 1L));
+	nr_workers = min(nr_workers, TMPFS_MAX_WORKERS);
+	chunk = DIV_ROUND_UP(size, nr_workers);
+
+	pr_info("%s %llu bytes with %d workers\n", dump ? "Dumping" : "Restoring",
+			(unsigned long long)size, nr_workers);
+
+	if (nr_workers == 1)
+		return tmpfs_xfer_part(files, nr, chunk, root_fd, img_fd, dump, 0);
+
+	/*
+	 * Same as cr_system() does, the workers are waited for right
+	 * here and shouldn't get into the SIGCHLD handler.
+	 */
+	sigemptyset(&blockmask);
+	sigaddset(&blockmask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &blockmask, &oldmask) == -1) {
+		pr_perror("Can not set mask of blocked signals");
+		return -1;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		pids[i] = fork();
+		if (pids[i] < 0) {
+			pr_perror("Can't fork tmpfs worker");
+			ret = -1;
+			nr_workers = i;
+			break;
+		}
+
+		if (pids[i] == 0) {
+			ret = tmpfs_xfer_part(files, nr, chunk, root_fd, img_fd, dump, i);
+			exit(ret ? 1 : 0);
+		}
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		int status;
+
+		if (waitpid(pids[i], &status, 0) < 0) {
+			pr_perror("Can't wait tmpfs worker");
+			ret = -1;
+			continue;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			pr_err("tmpfs worker finished with error %d\n", status);
+			ret = -1;
+		}
+	}
+
+	if (sigprocmask(SIG_SETMASK, &oldmask, NULL) == -1) {
+		pr_perror("Can not unset mask of blocked signals");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+int tmpfs_dump_files(int root_fd, unsigned int id)
+{
+	struct tmpfs_tree t = { };
+	TmpfsFileEntry **files = NULL;
+	struct cr_img *img;
+	struct stat st;
+	unsigned int i;
+	int ret = -1;
+
+	if (fstat(root_fd, &st)) {
+		pr_perror("Can't stat tmpfs root");
+		return -1;
+	}
+
+	t.dev = st.st_dev;
+	if (tmpfs_collect_one(&t, root_fd, ".", ".", &st))
+		goto out;
+	if (tmpfs_collect_dir(&t, root_fd, "."))
+		goto out;
+
+	pr_info("Collected %u files with %llu bytes of data\n",
+			t.nr, (unsigned long long)t.data_size);
+
+	img = open_image(CR_FD_TMPFS_FILES, O_DUMP, id);
+	if (!img)
+		goto out;
+
+	for (i = 0; i < t.nr; i++) {
+		if (pb_write_one(img, &t.files[i]->e, PB_TMPFS_FILE)) {
+			close_image(img);
+			goto out;
+		}
+	}
+	close_image(img);
+
+	files = xmalloc(t.nr * sizeof(*files));
+	if (!files)
+		goto out;
+	for (i = 0; i < t.nr; i++)
+		files[i] = &t.files[i]->e;
+
+	img = open_image(CR_FD_TMPFS_DATA, O_DUMP, id);
+	if (!img)
+		goto out;
+
+	if (ftruncate(img_raw_fd(img), t.data_size)) {
+		pr_perror("Can't set tmpfs data image size");
+		close_image(img);
+		goto out;
+	}
+
+	ret = tmpfs_xfer_data(files, t.nr, t.data_size, root_fd, img_raw_fd(img), true);
+	close_image(img);
+out:
+	xfree(files);
+	tmpfs_tree_free(&t);
+	return ret;
+}
+
+static int tmpfs_create_one(int root_fd, TmpfsFileEntry *e)
+{
+	int fd;
+
+	if (!strcmp(e->path, "."))
+		return 0;
+
+	if (e->link) {
+		if (linkat(root_fd, e->link, root_fd, e->path, 0)) {
+			pr_perror("Can't link %s to %s", e->path, e->link);
+			return -1;
+		}
+		return 0;
+	}
+
+	switch (e->mode & S_IFMT) {
+	case S_IFDIR:
+		if (mkdirat(root_fd, e->path, 0700)) {
+			pr_perror("Can't create dir %s", e->path);
+			return -1;
+		}
+		break;
+	case S_IFREG:
+		fd = openat(root_fd, e->path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+		if (fd < 0) {
+			pr_perror("Can't create %s", e->path);
+			return -1;
+		}
+
+		/* Holes are just not written to */
+		if (ftruncate(fd, e->size)) {
+			pr_perror("Can't set size of %s", e->path);
+			close(fd);
+			return -1;
+		}
+		close(fd);
+		break;
+	case S_IFLNK:
+		if (!e->target || symlinkat(e->target, root_fd, e->path)) {
+			pr_perror("Can't create symlink %s", e->path);
+			return -1;
+		}
+		break;
+	case S_IFCHR:
+	case S_IFBLK:
+	case S_IFIFO:
+		if (mknodat(root_fd, e->path, e->mode, e->rdev)) {
+			pr_perror("Can't create node %s", e->path);
+			return -1;
+		}
+		break;
+	default:
+		pr_err("Unknown file type %o of %s\n", e->mode & S_IFMT, e->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tmpfs_restore_attrs(int root_fd, TmpfsFileEntry *e)
+{
+	struct timespec ts[2] = {
+		{ .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+		{ .tv_sec = 0, .tv_nsec = UTIME_OMIT },
+	};
+
+	/* Attributes are shared with the first name of the file */
+	if (e->link)
+		return 0;
+
+	if (fchownat(root_fd, e->path, e->uid, e->gid, AT_SYMLINK_NOFOLLOW)) {
+		pr_perror("Can't restore owner of %s", e->path);
+		return -1;
+	}
+
+	/* Chown drops suid bits, so mode goes after it */
+	if (!S_ISLNK(e->mode) && fchmodat(root_fd, e->path, e->mode & 07777, 0)) {
+		pr_perror("Can't restore mode of %s", e->path);
+		return -1;
+	}
+
+	if (e->atim) {
+		ts[0].tv_sec = e->atim->tv_sec;
+		ts[0].tv_nsec = e->atim->tv_usec * 1000;
+	}
+	if (e->mtim) {
+		ts[1].tv_sec = e->mtim->tv_sec;
+		ts[1].tv_nsec = e->mtim->tv_usec * 1000;
+	}
+
+	if (utimensat(root_fd, e->path, ts, AT_SYMLINK_NOFOLLOW)) {
+		pr_perror("Can't restore times of %s", e->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Returns 1 if there's no native images for this tmpfs, these
+ * are to be restored from tarball then.
+ */
+int tmpfs_restore_files(const char *mountpoint, unsigned int id)
+{
+	TmpfsFileEntry **files = NULL;
+	unsigned int nr = 0, size = 0;
+	int root_fd = -1, ret = -1;
+	u64 data_size = 0;
+	struct cr_img *img;
+	int i;
+
+	img = open_image(CR_FD_TMPFS_FILES, O_RSTR, id);
+	if (!img)
+		return -1;
+
+	if (empty_image(img)) {
+		close_image(img);
+		return 1;
+	}
+
+	while (1) {
+		TmpfsFileEntry *e;
+
+		ret = pb_read_one_eof(img, &e, PB_TMPFS_FILE);
+		if (ret <= 0)
+			break;
+
+		if (nr == size) {
+			TmpfsFileEntry **n;
+
+			n = xrealloc(files, (size * 2 + 64) * sizeof(*n));
+			if (!n) {
+				tmpfs_file_entry__free_unpacked(e, NULL);
+				ret = -1;
+				break;
+			}
+
+			files = n;
+			size = size * 2 + 64;
+		}
+
+		files[nr++] = e;
+		for (i = 0; i < e->n_data; i++)
+			data_size += e->data[i]->len;
+	}
+	close_image(img);
+	if (ret < 0)
+		goto out;
+
+	ret = -1;
+	root_fd = open(mountpoint, O_RDONLY | O_DIRECTORY);
+	if (root_fd < 0) {
+		pr_perror("Can't open %s", mountpoint);
+		goto out;
+	}
+
+	for (i = 0; i < nr; i++)
+		if (tmpfs_create_one(root_fd, files[i]))
+			goto out;
+
+	img = open_image(CR_FD_TMPFS_DATA, O_RSTR, id);
+	if (!img)
+		goto out;
+
+	if (tmpfs_xfer_data(files, nr, data_size, root_fd, img_raw_fd(img), false)) {
+		close_image(img);
+		goto out;
+	}
+	close_image(img);
+
+	/* Directories' times are set after their contents */
+	for (i = nr - 1; i >= 0; i--)
+		if (tmpfs_restore_attrs(root_fd, files[i]))
+			goto out;
+
+	ret = 0;
+out:
+	close_safe(&root_fd);
+	for (i = 0; i < nr; i++)
+		tmpfs_file_entry__free_unpacked(files[i], NULL);
+	xfree(files);
+	return ret;
+}
@@ -11,7 +11,7 @@
 #include <errno.h>
 #include <string.h>
 #include <dirent.h>
-#include <sys/sendfile.h>
+#include <sys/syscall.h>
 #include <fcntl.h>
 #include <poll.h>
 #include <arpa/inet.h>
@@ -507,33 +507,88 @@ bool is_service_fd(int fd, enum sfd_type type)
 	return fd == get_service_fd(type);
 }
 
-int copy_file(int fd_in, int fd_out, size_t bytes)
+#define COPY_CHUNK	(256 << 10)
+
+/*
+ * Copy @len bytes from @off_in of @fd_in to @off_out of @fd_out.
+ * Files' positions are not used, so this is safe to be called on
+ * descriptors shared with other processes. The copy_file_range()
+ * is tried first, when the kernel can't do it for this pair of files
+ * (old kernel or files on different filesystems) the rest of the data
+ * goes through a bounce buffer.
+ */
+int copy_file_part(int fd_in, off_t off_in, int fd_out, off_t off_out, size_t len)
 {
-	ssize_t written = 0;
-	size_t chunk = bytes ? bytes : 4096;
+	static char *buf;
+	ssize_t ret, done;
 
-	while (1) {
-		ssize_t ret;
+#ifdef SYS_copy_file_range
+	while (len) {
+		loff_t i = off_in, o = off_out;
+
+		ret = syscall(SYS_copy_file_range, fd_in, &i, fd_out, &o, len, 0);
+		if (ret < 0) {
+			if (errno == ENOSYS || errno == EXDEV ||
+			    errno == EINVAL || errno == EOPNOTSUPP)
+				break;
+
+			pr_perror("Can't copy file data");
+			return -1;
+		}
+
+		if (ret == 0)
+			goto short_copy;
+
+		off_in += ret;
+		off_out += ret;
+		len -= ret;
+	}
+
+	if (!len)
+		return 0;
+#endif
+
+	if (!buf) {
+		buf = xmalloc(COPY_CHUNK);
+		if (!buf)
+			return -1;
+	}
 
-		ret = sendfile(fd_out, fd_in, NULL, chunk);
+	while (len) {
+		ssize_t chunk = min_t(size_t, len, COPY_CHUNK);
+
+		ret = pread(fd_in, buf, chunk, off_in);
 		if (ret < 0) {
-			pr_perror("Can't send data to ghost file");
+			pr_perror("Can't read file data");
 			return -1;
 		}
 
-		if (ret == 0) {
-			if (bytes && (written != bytes)) {
-				pr_err("Ghost file size mismatch %zu/%zu\n",
-						written, bytes);
+		if (ret == 0)
+			goto short_copy;
+
+		chunk = ret;
+		off_in += chunk;
+		len -= chunk;
+
+		for (done = 0; done < chunk; done += ret) {
+			ret = pwrite(fd_out, buf + done, chunk - done, off_out + done);
+			if (ret < 0) {
+				pr_perror("Can't write file data");
+				return -1;
+			}
+			if (ret == 0) {
+				pr_err("Can't write file data, nothing written\n");
 				return -1;
 			}
-			break;
 		}
-
-		written += ret;
+		off_out += chunk;
 	}
 
 	return 0;
+
+short_copy:
+	pr_err("File is shorter than expected, %zu bytes left\n", len);
+	return -1;
 }
 
 int read_fd_link(int lfd, char *buf, size_t size)
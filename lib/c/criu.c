@@ -794,6 +794,28 @@ void criu_set_ghost_limit(unsigned int limit)
 	criu_local_set_ghost_limit(global_opts, limit);
 }
 
+void criu_local_set_pre_dump_mem_limit(criu_opts *opts, uint64_t limit)
+{
+	opts->rpc->has_pre_dump_mem_limit = true;
+	opts->rpc->pre_dump_mem_limit = limit;
+}
+
+void criu_set_pre_dump_mem_limit(uint64_t limit)
+{
+	criu_local_set_pre_dump_mem_limit(global_opts, limit);
+}
+
+void criu_local_set_keep_parasite(criu_opts *opts, bool keep)
+{
+	opts->rpc->has_keep_parasite = true;
+	opts->rpc->keep_parasite = keep;
+}
+
+void criu_set_keep_parasite(bool keep)
+{
+	criu_local_set_keep_parasite(global_opts, keep);
+}
+
 int criu_add_irmap_path(char *path)
 {
 	return criu_local_add_irmap_path(global_opts, path);
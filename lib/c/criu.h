@@ -20,6 +20,7 @@
 #define __CRIU_LIB_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef __GNUG__
        extern "C" {
@@ -91,6 +92,8 @@ int criu_add_cg_root(char *ctrl, char *path);
 int criu_add_enable_fs(char *fs);
 int criu_add_skip_mnt(char *mnt);
 void criu_set_ghost_limit(unsigned int limit);
+void criu_set_pre_dump_mem_limit(uint64_t limit);
+void criu_set_keep_parasite(bool keep);
 int criu_add_irmap_path(char *path);
 
 /*
@@ -196,6 +199,8 @@ int criu_local_add_cg_root(criu_opts *opts, char *ctrl, char *path);
 int criu_local_add_enable_fs(criu_opts *opts, char *fs);
 int criu_local_add_skip_mnt(criu_opts *opts, char *mnt);
 void criu_local_set_ghost_limit(criu_opts *opts, unsigned int limit);
+void criu_local_set_pre_dump_mem_limit(criu_opts *opts, uint64_t limit);
+void criu_local_set_keep_parasite(criu_opts *opts, bool keep);
 int criu_local_add_irmap_path(criu_opts *opts, char *path);
 int criu_local_add_cg_props(criu_opts *opts, char *stream);
 int criu_local_add_cg_props_file(criu_opts *opts, char *path);
@@ -257,17 +257,58 @@ class sk_queues_extra_handler:
 
 class ghost_file_extra_handler:
 	def load(self, f, pb):
-		data = f.read()
-		return data.encode('base64')
+		if not pb.chunks:
+			data = f.read()
+			return data.encode('base64')
+
+		chunks = []
+		while True:
+			buf = f.read(4)
+			if buf == '':
+				break
+			size, = struct.unpack('i', buf)
+			gc = ghost_chunk_entry()
+			gc.ParseFromString(f.read(size))
+			f.seek(gc.pad, 1)
+			data = f.read(gc.len)
+			chunks.append(pb2dict.pb2dict(gc))
+			chunks.append(data.encode('base64'))
+		return chunks
 
 	def dump(self, extra, f, pb):
-		data = extra.decode('base64')
-		f.write(data)
+		if not pb.chunks:
+			data = extra.decode('base64')
+			f.write(data)
+			return
+
+		for i in range (0, len(extra), 2):
+			gc = ghost_chunk_entry()
+			pb2dict.dict2pb(extra[i], gc)
+			gc_str = gc.SerializeToString()
+			size = len(gc_str)
+			f.write(struct.pack('i', size))
+			f.write(gc_str)
+			f.write('\0' * gc.pad)
+			data = extra[i + 1].decode('base64')
+			f.write(data[:gc.len])
 
 	def skip(self, f, pb):
 		p = f.tell()
-		f.seek(0, os.SEEK_END)
-		return f.tell() - p
+		if not pb.chunks:
+			f.seek(0, os.SEEK_END)
+			return f.tell() - p
+
+		pl_len = 0
+		while True:
+			buf = f.read(4)
+			if buf == '':
+				break
+			size, = struct.unpack('i', buf)
+			gc = ghost_chunk_entry()
+			gc.ParseFromString(f.read(size))
+			f.seek(gc.pad + gc.len, os.SEEK_CUR)
+			pl_len += gc.len
+		return pl_len
 
 class tcp_stream_extra_handler:
 	def load(self, f, pb):
@@ -373,6 +414,9 @@ class ipc_msg_queue_handler:
 
 class ipc_shm_handler:
 	def load(self, f, pb):
+		# Contents are in pagemap-sysvshm images
+		if pb.in_pagemaps:
+			return None
 		entry = pb2dict.pb2dict(pb)
 		size = entry['size']
 		data = f.read(size)
@@ -389,6 +433,8 @@ class ipc_shm_handler:
 		f.write('\0' * (rounded - size))
 
 	def skip(self, f, pb):
+		if pb.in_pagemaps:
+			return 0
 		entry = pb2dict.pb2dict(pb)
 		size = entry['size']
 		rounded = round_up(size, sizeof_u32)
@@ -454,6 +500,7 @@ handlers = {
 	'USERNS'		: entry_handler(userns_entry),
 	'SECCOMP'		: entry_handler(seccomp_entry),
 	'AUTOFS'		: entry_handler(autofs_entry),
+	'TMPFS_FILES'		: entry_handler(tmpfs_file_entry),
 	}
 
 def __rhandler(f):
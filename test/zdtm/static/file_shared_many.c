@@ -0,0 +1,113 @@
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check many files shared between several tasks";
+const char *test_author	= "CRIU developers <criu@openvz.org>";
+
+#define NR_PIPES	400
+#define NR_CHILDREN	4
+
+static int pipes[NR_PIPES][2];
+
+static int check_flags(void)
+{
+	int i;
+
+	for (i = 0; i < NR_PIPES; i++) {
+		int want = (i % 3 == 0) ? FD_CLOEXEC : 0;
+
+		if (fcntl(pipes[i][1], F_GETFD) != want) {
+			fail("Wrong flags on fd %d", pipes[i][1]);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	pid_t pids[NR_CHILDREN];
+	int i, j, status;
+	char c;
+
+	test_init(argc, argv);
+
+	for (i = 0; i < NR_PIPES; i++) {
+		if (pipe(pipes[i])) {
+			pr_perror("pipe");
+			return 1;
+		}
+
+		if (i % 3 == 0 && fcntl(pipes[i][1], F_SETFD, FD_CLOEXEC)) {
+			pr_perror("fcntl");
+			return 1;
+		}
+	}
+
+	for (j = 0; j < NR_CHILDREN; j++) {
+		pids[j] = test_fork();
+		if (pids[j] < 0)
+			return 1;
+
+		if (pids[j] == 0) {
+			test_waitsig();
+
+			if (check_flags())
+				_exit(1);
+
+			c = 'a' + j;
+			for (i = 0; i < NR_PIPES; i++)
+				if (write(pipes[i][1], &c, 1) != 1) {
+					pr_perror("write");
+					_exit(1);
+				}
+
+			_exit(0);
+		}
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	for (j = 0; j < NR_CHILDREN; j++) {
+		kill(pids[j], SIGTERM);
+		if (waitpid(pids[j], &status, 0) != pids[j]) {
+			pr_perror("waitpid");
+			return 1;
+		}
+
+		if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+			fail("Child %d failed", j);
+			return 1;
+		}
+	}
+
+	if (check_flags())
+		return 1;
+
+	for (i = 0; i < NR_PIPES; i++) {
+		int seen = 0;
+
+		for (j = 0; j < NR_CHILDREN; j++) {
+			if (read(pipes[i][0], &c, 1) != 1) {
+				fail("Pipe %d is short", i);
+				return 1;
+			}
+			seen |= 1 << (c - 'a');
+		}
+
+		if (seen != (1 << NR_CHILDREN) - 1) {
+			fail("Pipe %d got %x", i, seen);
+			return 1;
+		}
+	}
+
+	pass();
+	return 0;
+}
@@ -0,0 +1,249 @@
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check a mount namespace with thousands of mounts";
+const char *test_author	= "CRIU developers <criu@openvz.org>";
+
+char *dirname;
+TEST_OPTION(dirname, string, "directory name", 1);
+
+/*
+ * Every mount gets its own superblock, every 10th one has a nested
+ * mount and files are kept open on every 50th one, so that mnt_id,
+ * s_dev and path lookups are all exercised on a big mount tree.
+ */
+#define NR_MOUNTS	5000
+#define NESTED_EVERY	10
+#define OPEN_EVERY	50
+
+static int fds[NR_MOUNTS / OPEN_EVERY];
+
+/*
+ * A stack of sibling mounts on the same mountpoint, with a file open on
+ * every layer. Only the top one is visible after restore and the files
+ * have to stay on their own layers.
+ */
+#define NR_OVERMOUNTS	4
+
+static int ofds[NR_OVERMOUNTS];
+
+static char *mnt_path(char *buf, int i, bool nested)
+{
+	snprintf(buf, PATH_MAX, "%s/m%d%s", dirname, i, nested ? "/n" : "");
+	return buf;
+}
+
+static int make_mount(int i, bool nested)
+{
+	char path[PATH_MAX], fpath[PATH_MAX + 4];
+	int fd;
+
+	mnt_path(path, i, nested);
+	if (mkdir(path, 0700)) {
+		pr_perror("Can't create %s", path);
+		return -1;
+	}
+
+	if (mount("zdtm_many", path, "tmpfs", 0, "size=64k")) {
+		pr_perror("Can't mount %s", path);
+		return -1;
+	}
+
+	snprintf(fpath, sizeof(fpath), "%s/f", path);
+	fd = open(fpath, O_RDWR | O_CREAT, 0600);
+	if (fd < 0) {
+		pr_perror("Can't create %s", fpath);
+		return -1;
+	}
+
+	if (write(fd, &i, sizeof(i)) != sizeof(i)) {
+		pr_perror("Can't write %s", fpath);
+		close(fd);
+		return -1;
+	}
+
+	if (!nested && i % OPEN_EVERY == 0)
+		fds[i / OPEN_EVERY] = fd;
+	else
+		close(fd);
+
+	return 0;
+}
+
+static int check_mount(int i, bool nested)
+{
+	char path[PATH_MAX], fpath[PATH_MAX + 4];
+	struct stat st, pst;
+	int fd, val;
+
+	mnt_path(path, i, nested);
+	snprintf(fpath, sizeof(fpath), "%s/..", path);
+	if (stat(path, &st) || stat(fpath, &pst)) {
+		fail("Can't stat %s", path);
+		return -1;
+	}
+
+	if (st.st_dev == pst.st_dev) {
+		fail("%s isn't mounted", path);
+		return -1;
+	}
+
+	snprintf(fpath, sizeof(fpath), "%s/f", path);
+	fd = open(fpath, O_RDONLY);
+	if (fd < 0) {
+		fail("Can't open %s", fpath);
+		return -1;
+	}
+
+	if (read(fd, &val, sizeof(val)) != sizeof(val) || val != i) {
+		fail("Data mismatch in %s", fpath);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	if (!nested && i % OPEN_EVERY == 0) {
+		struct stat fst;
+
+		if (fstat(fds[i / OPEN_EVERY], &fst) || fst.st_dev != st.st_dev) {
+			fail("Opened file on %s has wrong device", path);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int make_overmounts(void)
+{
+	char path[PATH_MAX], fpath[PATH_MAX + 4];
+	int i;
+
+	snprintf(path, sizeof(path), "%s/o", dirname);
+	snprintf(fpath, sizeof(fpath), "%s/f", path);
+	if (mkdir(path, 0700)) {
+		pr_perror("Can't create %s", path);
+		return -1;
+	}
+
+	for (i = 0; i < NR_OVERMOUNTS; i++) {
+		if (mount("zdtm_over", path, "tmpfs", 0, "size=64k")) {
+			pr_perror("Can't mount %s", path);
+			return -1;
+		}
+
+		ofds[i] = open(fpath, O_RDWR | O_CREAT, 0600);
+		if (ofds[i] < 0) {
+			pr_perror("Can't create %s", fpath);
+			return -1;
+		}
+
+		if (write(ofds[i], &i, sizeof(i)) != sizeof(i)) {
+			pr_perror("Can't write %s", fpath);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int check_overmounts(void)
+{
+	char path[PATH_MAX], fpath[PATH_MAX + 4];
+	struct stat st[NR_OVERMOUNTS];
+	int i, j, fd, val;
+
+	snprintf(path, sizeof(path), "%s/o", dirname);
+	snprintf(fpath, sizeof(fpath), "%s/f", path);
+
+	for (i = 0; i < NR_OVERMOUNTS; i++) {
+		if (pread(ofds[i], &val, sizeof(val), 0) != sizeof(val) || val != i) {
+			fail("Opened file on layer %d has wrong data", i);
+			return -1;
+		}
+
+		if (fstat(ofds[i], &st[i])) {
+			fail("Can't stat file on layer %d", i);
+			return -1;
+		}
+
+		for (j = 0; j < i; j++)
+			if (st[j].st_dev == st[i].st_dev) {
+				fail("Layers %d and %d share a device", j, i);
+				return -1;
+			}
+	}
+
+	/* Layers have to come off in the order they were mounted */
+	for (i = NR_OVERMOUNTS - 1; i >= 0; i--) {
+		fd = open(fpath, O_RDONLY);
+		if (fd < 0) {
+			fail("Can't open %s", fpath);
+			return -1;
+		}
+
+		if (read(fd, &val, sizeof(val)) != sizeof(val) || val != i) {
+			fail("Layer %d is on top instead of %d", val, i);
+			close(fd);
+			return -1;
+		}
+		close(fd);
+
+		if (umount2(path, MNT_DETACH)) {
+			fail("Can't umount layer %d", i);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int i, ret = 1;
+
+	test_init(argc, argv);
+
+	mkdir(dirname, 0700);
+	if (mount("none", dirname, "tmpfs", 0, "") < 0) {
+		fail("Can't mount tmpfs");
+		return 1;
+	}
+
+	for (i = 0; i < NR_MOUNTS; i++) {
+		if (make_mount(i, false))
+			goto err;
+		if (i % NESTED_EVERY == 0 && make_mount(i, true))
+			goto err;
+	}
+
+	if (make_overmounts())
+		goto err;
+
+	test_daemon();
+	test_waitsig();
+
+	for (i = 0; i < NR_MOUNTS; i++) {
+		if (check_mount(i, false))
+			goto err;
+		if (i % NESTED_EVERY == 0 && check_mount(i, true))
+			goto err;
+	}
+
+	if (check_overmounts())
+		goto err;
+
+	pass();
+	ret = 0;
+err:
+	umount2(dirname, MNT_DETACH);
+	rmdir(dirname);
+	return ret;
+}
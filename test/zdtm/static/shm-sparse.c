@@ -0,0 +1,68 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check that a big sparsely populated SysV shm segment is restored";
+const char *test_author	= "CRIU developers <criu@openvz.org>";
+
+#define SHM_PAGES	16384
+#define SHM_STEP	61
+
+static int check_pages(unsigned char *mem, size_t ps)
+{
+	int i;
+
+	for (i = 0; i < SHM_PAGES; i++) {
+		unsigned char *p = mem + i * ps;
+		unsigned char c = (i % SHM_STEP) ? 0 : (i / SHM_STEP) | 1;
+
+		if (p[0] != c || p[ps - 1] != c) {
+			fail("Page %d corrupted: %x/%x, want %x", i, p[0], p[ps - 1], c);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	size_t ps = sysconf(_SC_PAGESIZE);
+	unsigned char *mem;
+	int id, i;
+
+	test_init(argc, argv);
+
+	id = shmget(IPC_PRIVATE, SHM_PAGES * ps, 0600 | IPC_CREAT);
+	if (id < 0) {
+		pr_perror("Can't create shm");
+		return 1;
+	}
+
+	mem = shmat(id, NULL, 0);
+	if (mem == (void *)-1) {
+		pr_perror("Can't attach shm");
+		return 1;
+	}
+
+	/* Only every SHM_STEP-th page gets populated */
+	for (i = 0; i < SHM_PAGES; i += SHM_STEP)
+		memset(mem + i * ps, (i / SHM_STEP) | 1, ps);
+
+	test_daemon();
+	test_waitsig();
+
+	if (check_pages(mem, ps))
+		return 1;
+
+	if (shmdt(mem) || shmctl(id, IPC_RMID, NULL)) {
+		pr_perror("Can't remove shm");
+		return 1;
+	}
+
+	pass();
+	return 0;
+}
@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check that a deep queue of dgrams of mixed sizes is restored correctly";
+const char *test_author	= "CRIU developers <criu@openvz.org>";
+
+#define SK_SRV "\0socket_dgram_queue_srv"
+
+#define NR_MSGS		512
+#define MSG_BIG		(20 * 1024)
+#define MSG_MAX		(MSG_BIG + NR_MSGS)
+
+/*
+ * Every 8th message doesn't fit into one slot
+ * of the batched queue dumper.
+ */
+static int msg_size(int i)
+{
+	return (i % 8 == 3) ? MSG_BIG + i : 16 + i;
+}
+
+static void msg_fill(char *buf, int i)
+{
+	int j, len = msg_size(i);
+
+	for (j = 0; j < len; j++)
+		buf[j] = i + j;
+}
+
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr;
+	unsigned int addrlen;
+	int srv, clnt, ret, i, nr;
+	static char buf[MSG_MAX], rbuf[MSG_MAX];
+
+	test_init(argc, argv);
+
+	srv = socket(PF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (srv < 0) {
+		pr_perror("socket");
+		return 1;
+	}
+	clnt = socket(PF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+	if (clnt < 0) {
+		pr_perror("socket");
+		return 1;
+	}
+
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, SK_SRV, sizeof(SK_SRV));
+	addrlen = sizeof(addr.sun_family) + sizeof(SK_SRV);
+
+	if (bind(srv, &addr, addrlen)) {
+		fail("bind\n");
+		exit(1);
+	}
+	if (connect(clnt, &addr, addrlen)) {
+		fail("connect\n");
+		exit(1);
+	}
+
+	/*
+	 * Fill the queue up to the limits (max_dgram_qlen or
+	 * buffer sizes), whatever comes first.
+	 */
+	for (nr = 0; nr < NR_MSGS; nr++) {
+		msg_fill(buf, nr);
+		ret = write(clnt, buf, msg_size(nr));
+		if (ret < 0 && errno == EAGAIN)
+			break;
+		if (ret != msg_size(nr)) {
+			pr_perror("write");
+			return 1;
+		}
+	}
+
+	if (nr == 0) {
+		pr_err("Can't queue any message\n");
+		return 1;
+	}
+
+	test_msg("%d messages queued\n", nr);
+
+	test_daemon();
+	test_waitsig();
+
+	for (i = 0; i < nr; i++) {
+		ret = read(srv, rbuf, sizeof(rbuf));
+		if (ret != msg_size(i)) {
+			fail("%d: size mismatch %d/%d", i, ret, msg_size(i));
+			return 1;
+		}
+
+		msg_fill(buf, i);
+		if (memcmp(buf, rbuf, ret)) {
+			fail("%d: data mismatch", i);
+			return 1;
+		}
+	}
+
+	ret = read(srv, rbuf, sizeof(rbuf));
+	if (ret != -1 || errno != EAGAIN) {
+		fail("unexpected data: %d", ret);
+		return 1;
+	}
+
+	pass();
+	return 0;
+}
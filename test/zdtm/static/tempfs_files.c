@@ -0,0 +1,152 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check sparse files, links, fifos and attributes on tmpfs";
+const char *test_author	= "CRIU developers <criu@openvz.org>";
+
+char *dirname;
+TEST_OPTION(dirname, string, "directory name", 1);
+
+#define TEST_HEAD	"head"
+#define TEST_TAIL	"tail"
+#define TAIL_OFF	(16 << 20)
+#define TEST_MTIME	1234567
+
+static char *path(char *buf, const char *name)
+{
+	snprintf(buf, PATH_MAX, "%s/%s", dirname, name);
+	return buf;
+}
+
+static int check_data(char *fname, off_t off, const char *word)
+{
+	char buf[32];
+	int fd, ret;
+
+	fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		pr_perror("open failed");
+		return -1;
+	}
+
+	ret = pread(fd, buf, strlen(word), off);
+	close(fd);
+	if (ret != strlen(word) || memcmp(buf, word, ret)) {
+		fail("Data at %lld corrupted", (long long)off);
+		return -1;
+	}
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	char fname[PATH_MAX], lname[PATH_MAX], buf[PATH_MAX];
+	struct timespec ts[2] = { { TEST_MTIME, 0 }, { TEST_MTIME, 0 } };
+	struct stat st, lst;
+	int fd, ret = 1;
+
+	test_init(argc, argv);
+
+	mkdir(dirname, 0700);
+	if (mount("none", dirname, "tmpfs", 0, "") < 0) {
+		fail("Can't mount tmpfs");
+		return 1;
+	}
+
+	if (mkdir(path(fname, "d"), 0751) || mkdir(path(fname, "d/e"), 0700)) {
+		pr_perror("mkdir failed");
+		goto err;
+	}
+
+	fd = open(path(fname, "d/sparse"), O_RDWR | O_CREAT, 0604);
+	if (fd < 0) {
+		pr_perror("open failed");
+		goto err;
+	}
+
+	if (pwrite(fd, TEST_HEAD, strlen(TEST_HEAD), 0) != strlen(TEST_HEAD) ||
+	    pwrite(fd, TEST_TAIL, strlen(TEST_TAIL), TAIL_OFF) != strlen(TEST_TAIL)) {
+		pr_perror("write failed");
+		goto err;
+	}
+	close(fd);
+
+	if (utimensat(AT_FDCWD, fname, ts, 0)) {
+		pr_perror("Can't set mtime");
+		goto err;
+	}
+
+	if (link(fname, path(lname, "d/e/link"))) {
+		pr_perror("link failed");
+		goto err;
+	}
+
+	if (symlink("d/sparse", path(buf, "sym"))) {
+		pr_perror("symlink failed");
+		goto err;
+	}
+
+	if (mknod(path(buf, "fifo"), S_IFIFO | 0640, 0)) {
+		pr_perror("mknod failed");
+		goto err;
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	if (stat(path(buf, "d"), &st) || (st.st_mode & 07777) != 0751) {
+		fail("Directory mode mismatch");
+		goto err;
+	}
+
+	if (stat(fname, &st)) {
+		fail("Can't stat sparse file");
+		goto err;
+	}
+
+	if (st.st_size != TAIL_OFF + strlen(TEST_TAIL) ||
+	    (st.st_mode & 07777) != 0604 || st.st_mtime != TEST_MTIME) {
+		fail("Sparse file attributes mismatch");
+		goto err;
+	}
+
+	if (st.st_blocks * 512 >= TAIL_OFF) {
+		fail("Holes are not preserved (%lld blocks)", (long long)st.st_blocks);
+		goto err;
+	}
+
+	if (check_data(fname, 0, TEST_HEAD) || check_data(fname, TAIL_OFF, TEST_TAIL))
+		goto err;
+
+	if (stat(lname, &lst) || lst.st_ino != st.st_ino) {
+		fail("Hard link is broken");
+		goto err;
+	}
+
+	memset(lname, 0, sizeof(lname));
+	if (readlink(path(buf, "sym"), lname, sizeof(lname) - 1) < 0 ||
+	    strcmp(lname, "d/sparse")) {
+		fail("Symlink mismatch");
+		goto err;
+	}
+
+	if (lstat(path(buf, "fifo"), &st) || !S_ISFIFO(st.st_mode) ||
+	    (st.st_mode & 07777) != 0640) {
+		fail("Fifo mismatch");
+		goto err;
+	}
+
+	pass();
+	ret = 0;
+err:
+	umount2(dirname, MNT_DETACH);
+	rmdir(dirname);
+	return ret;
+}
@@ -0,0 +1,101 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "zdtmtst.h"
+
+const char *test_doc	= "Check that holes in unlinked files are preserved";
+const char *test_author	= "CRIU developers <criu@openvz.org>";
+
+char *filename;
+TEST_OPTION(filename, string, "file name", 1);
+
+#define FILE_SIZE	(32 << 20)
+#define EXT_SIZE	(512 << 10)
+#define NR_EXTS		4
+
+static off_t ext_off(int i)
+{
+	return (off_t)i * (FILE_SIZE - EXT_SIZE) / (NR_EXTS - 1);
+}
+
+static void ext_fill(char *buf, int i)
+{
+	int j;
+
+	for (j = 0; j < EXT_SIZE; j++)
+		buf[j] = i + j / 7;
+}
+
+int main(int argc, char **argv)
+{
+	static char buf[EXT_SIZE], rbuf[EXT_SIZE];
+	struct stat st;
+	int fd, i;
+
+	test_init(argc, argv);
+
+	fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		pr_perror("can't open %s", filename);
+		return 1;
+	}
+
+	for (i = 0; i < NR_EXTS; i++) {
+		ext_fill(buf, i);
+		if (pwrite(fd, buf, EXT_SIZE, ext_off(i)) != EXT_SIZE) {
+			pr_perror("can't write %s", filename);
+			goto failed;
+		}
+	}
+
+	if (unlink(filename) < 0) {
+		pr_perror("can't unlink %s", filename);
+		goto failed;
+	}
+
+	test_daemon();
+	test_waitsig();
+
+	if (fstat(fd, &st) < 0) {
+		fail("can't stat the file");
+		return 1;
+	}
+
+	if (st.st_size != FILE_SIZE) {
+		fail("size mismatch %lld", (long long)st.st_size);
+		return 1;
+	}
+
+	if (st.st_blocks * 512 >= FILE_SIZE / 2) {
+		fail("holes are not preserved (%lld blocks)", (long long)st.st_blocks);
+		return 1;
+	}
+
+	for (i = 0; i < NR_EXTS; i++) {
+		ext_fill(buf, i);
+		if (pread(fd, rbuf, EXT_SIZE, ext_off(i)) != EXT_SIZE ||
+		    memcmp(buf, rbuf, EXT_SIZE)) {
+			fail("extent %d corrupted", i);
+			return 1;
+		}
+	}
+
+	memset(buf, 0, EXT_SIZE);
+	if (pread(fd, rbuf, EXT_SIZE, ext_off(1) - EXT_SIZE) != EXT_SIZE ||
+	    memcmp(buf, rbuf, EXT_SIZE)) {
+		fail("hole is not zeroed");
+		return 1;
+	}
+
+	close(fd);
+	pass();
+	return 0;
+failed:
+	unlink(filename);
+	close(fd);
+	return 1;
+}